@@ -0,0 +1,23 @@
+#!/bin/bash
+# Times frames that each assign many variables, which is dominated by
+# the commit phase and by looking up bindings among many variables.
+
+set -e
+SYNC=${SYNC:-./sync}
+N=${N:-50000}
+FRAMES=${FRAMES:-4}
+TMP=${TMPDIR:-/tmp}
+
+awk -v n="$N" -v frames="$FRAMES" 'BEGIN {
+	for (f = 0; f < frames; f++) {
+		for (i = 0; i < n; i++) {
+			if (f == 0) printf "v%d <- %d", i, i;
+			else printf "v%d <- v%d + 1", i, i;
+			printf i + 1 < n ? ", " : ";\n";
+		}
+	}
+	print "_ <- output: [v0 v" n - 1 "];";
+}' > "$TMP/sync_commit.txt"
+
+echo "== $N assignments per frame, $FRAMES frames"
+time "$SYNC" "$TMP/sync_commit.txt" > /dev/null
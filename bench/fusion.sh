@@ -0,0 +1,33 @@
+#!/bin/bash
+# Reports how many commands the VM dispatches with and without
+# superinstructions. Runs a generated arithmetic script, plus any
+# scripts named on the command line, e.g. the ones the other benchmarks
+# leave in $TMPDIR.
+
+set -e
+SYNC=${SYNC:-./sync}
+FRAMES=${FRAMES:-200}
+JOBS=${JOBS:-16}
+TMP=${TMPDIR:-/tmp}
+
+awk -v frames="$FRAMES" -v jobs="$JOBS" 'BEGIN {
+	for (j = 0; j < jobs; j++) printf "%sa%d <- %d", (j ? ", " : ""), j, j + 1;
+	print ";";
+	for (i = 0; i < frames; i++) {
+		for (j = 0; j < jobs; j++) {
+			k = (j + 1) % jobs;
+			printf "%sa%d <- (a%d * 3) + (a%d - a%d) / 2 + (a%d + %d)",
+				(j ? ", " : ""), j, j, j, k, k, i % 7;
+		}
+		print ";";
+	}
+	printf "_ <- output: [";
+	for (j = 0; j < jobs; j++) printf "a%d ", j;
+	print "];";
+}' > "$TMP/sync_fusion.txt"
+
+for script in "$TMP/sync_fusion.txt" "$@"; do
+	echo "== $script"
+	"$SYNC" --stats --no-fuse "$script" 2>&1 >/dev/null | grep "vm dispatches" | sed 's/^/unfused: /'
+	"$SYNC" --stats "$script" 2>&1 >/dev/null | grep "vm dispatches" | sed 's/^/fused:   /'
+done
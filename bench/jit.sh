@@ -0,0 +1,39 @@
+#!/bin/bash
+# Times integer-only jobs under the VM and under --jit. Every frame
+# updates a set of accumulators with long arithmetic expressions whose
+# shapes repeat, so native code is compiled once and reused throughout.
+# The script is compiled ahead of time so only execution is timed.
+
+set -e
+SYNC=${SYNC:-./sync}
+FRAMES=${FRAMES:-500}
+JOBS=${JOBS:-16}
+TERMS=${TERMS:-400}
+TMP=${TMPDIR:-/tmp}
+
+awk -v frames="$FRAMES" -v jobs="$JOBS" -v terms="$TERMS" 'BEGIN {
+	for (j = 0; j < jobs; j++) printf "%sa%d <- %d", (j ? ", " : ""), j, j + 1;
+	print ";";
+	for (i = 0; i < frames; i++) {
+		for (j = 0; j < jobs; j++) {
+			printf "%sa%d <- a%d", (j ? ", " : ""), j, j;
+			for (t = 0; t < terms; t++) {
+				# Distinct divisors per job keep CSE from splitting the jobs
+				printf " %s a%d / %d * %d - %d", (t % 2 ? "-" : "+"), (j + t) % jobs, j * terms + t + 2, t % 5 + 1, t;
+			}
+		}
+		print ";";
+	}
+	printf "_ <- output: [";
+	for (j = 0; j < jobs; j++) printf "a%d ", j;
+	print "];";
+}' > "$TMP/sync_jit.txt"
+
+"$SYNC" --compile="$TMP/sync_jit.syc" "$TMP/sync_jit.txt"
+
+echo "== $FRAMES frames of $JOBS jobs, $TERMS terms each"
+echo "-- interpreter"
+time "$SYNC" "$TMP/sync_jit.syc" > "$TMP/sync_jit_vm.out"
+echo "-- jit"
+time "$SYNC" --jit "$TMP/sync_jit.syc" > "$TMP/sync_jit_native.out"
+cmp "$TMP/sync_jit_vm.out" "$TMP/sync_jit_native.out"
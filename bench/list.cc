@@ -0,0 +1,129 @@
+// Microbenchmarks for List, run by make bench-list. Prints the time and
+// the allocations each operation takes, for lists kept inline and on
+// the heap.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "../src/memory.cc"
+
+#define ROUNDS 1000000
+
+struct Slot {
+	long a;
+	long b;
+};
+
+static double now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static size_t allocations()
+{
+	size_t total = 0;
+	for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+		total += memory_stats.tags[tag].allocations;
+	}
+	return total;
+}
+
+// Keeps results alive so the loops are not optimized away
+static volatile long sink;
+
+static void report(const char * name, size_t ops, double start, size_t allocations_before)
+{
+	double elapsed = now_ns() - start;
+	printf("%-36s %8.2f ns/op %8.3f allocations/op\n", name, elapsed / ops,
+		   (double) (allocations() - allocations_before) / ops);
+}
+
+// A list built and dropped per operation, like a call's arguments
+template <size_t N>
+static void short_lists(const char * name)
+{
+	size_t before = allocations();
+	double start = now_ns();
+	for (long i = 0; i < ROUNDS; i++) {
+		List<long, N> list;
+		list.alloc();
+		list.push(i);
+		list.push(i + 1);
+		sink += list[0] + list[1];
+		list.dealloc();
+	}
+	report(name, ROUNDS, start, before);
+}
+
+// Pushes and pops around a fixed depth, like a job's stack
+template <size_t N>
+static void stack(const char * name)
+{
+	size_t before = allocations();
+	double start = now_ns();
+	for (long i = 0; i < ROUNDS; i++) {
+		List<Slot, N> stack;
+		stack.alloc();
+		for (long j = 0; j < 8; j++) stack.push((Slot) { i, j });
+		long total = 0;
+		while (stack.size) total += stack.pop().b;
+		sink += total;
+		stack.dealloc();
+	}
+	report(name, ROUNDS, start, before);
+}
+
+// Pops a large list to just below a quarter full and pushes it back to
+// almost half, which would shrink and regrow it every round if lists
+// shrank as soon as they could fit in less
+static void churn(const char * name)
+{
+	List<long> list;
+	list.alloc();
+	for (long i = 0; i < 4096; i++) list.push(i);
+	size_t before = allocations();
+	double start = now_ns();
+	size_t ops = 0;
+	for (long round = 0; round < ROUNDS / 1000; round++) {
+		while (list.size > 1000) {
+			sink += list.pop();
+			ops++;
+		}
+		while (list.size < 2000) {
+			list.push(round);
+			ops++;
+		}
+	}
+	report(name, ops, start, before);
+	list.dealloc();
+}
+
+// Grows one list a push at a time
+static void growth(const char * name)
+{
+	size_t before = allocations();
+	double start = now_ns();
+	List<long> list;
+	list.alloc();
+	for (long i = 0; i < 10 * ROUNDS; i++) list.push(i);
+	sink += list[list.size - 1];
+	report(name, list.size, start, before);
+	list.dealloc();
+}
+
+int main()
+{
+	memory_stats.init(false);
+	short_lists<0>("2-element list, on the heap");
+	short_lists<4>("2-element list, inline");
+	stack<0>("stack of 8 slots, on the heap");
+	stack<16>("stack of 8 slots, inline");
+	churn("pop and push across a quarter full");
+	growth("push 10M elements");
+	return 0;
+}
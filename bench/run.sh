@@ -0,0 +1,165 @@
+#!/bin/bash
+# Benchmark suite, run by make bench. Generates synthetic scripts that
+# each stress one part of the interpreter, runs each REPEAT times with
+# --bench and keeps the fastest run. Results are one JSON object per
+# workload and line, written to OUT:
+#
+#   {"workload":"wide","frames":...,"jobs":...,"seconds":...,
+#    "frames_per_second":...,"jobs_per_second":...,
+#    "p50_us":...,"p99_us":...,"max_us":...}
+#
+# With BASELINE set to an earlier OUT, prints the change in run time and
+# frame latency for each workload and fails if any got slower by more
+# than THRESHOLD percent. make bench-baseline stores a baseline and make
+# bench-compare compares against it.
+#
+# Sizes can be scaled down for a quick run, e.g. SCALE=10 divides them
+# all by ten. WORKLOADS picks a subset, e.g. WORKLOADS="wide deep".
+
+set -e -o pipefail
+SYNC=${SYNC:-./sync}
+REPEAT=${REPEAT:-3}
+SCALE=${SCALE:-1}
+THRESHOLD=${THRESHOLD:-10}
+TMP=${TMPDIR:-/tmp}
+OUT=${OUT:-$TMP/sync_bench.json}
+WORKLOADS=${WORKLOADS:-wide long deep tuples variables}
+
+# Frames of 10k independent jobs
+generate_wide()
+{
+	awk -v width=$((10000 / SCALE)) -v frames=20 'BEGIN {
+		for (i = 0; i < width; i++) printf "%sw%d <- %d", i ? ", " : "", i, i;
+		print ";";
+		for (f = 0; f < frames; f++) {
+			for (i = 0; i < width; i++) printf "%sw%d <- w%d * 3 + %d", i ? ", " : "", i, i, f;
+			print ";";
+		}
+		print "_ <- output: [w0];";
+	}'
+}
+
+# A million frames of one small job each
+generate_long()
+{
+	awk -v frames=$((1000000 / SCALE)) 'BEGIN {
+		print "a <- 0;";
+		for (f = 0; f < frames; f++) print "a <- a + 1;";
+		print "_ <- output: [a];";
+	}'
+}
+
+# Jobs of one deeply nested expression
+generate_deep()
+{
+	awk -v depth=$((2000 / SCALE)) -v frames=200 'BEGIN {
+		print "x <- 1;";
+		for (f = 0; f < frames; f++) {
+			printf "x <- ";
+			for (i = 0; i < depth; i++) printf "(%d - ", i;
+			printf "x";
+			for (i = 0; i < depth; i++) printf ")";
+			print ";";
+		}
+		print "_ <- output: [x];";
+	}'
+}
+
+# Frames that read, slice and extend a million-element tuple
+generate_tuples()
+{
+	awk -v n=$((1000000 / SCALE)) -v frames=50 'BEGIN {
+		printf "t <- [";
+		for (i = 0; i < n; i++) printf "%d ", i;
+		print "];";
+		for (f = 0; f < frames; f++) {
+			printf "t <- t + [%d], n <- length: [t], ", f;
+			printf "h <- slice: [t 0 %d], e <- index: [t %d];\n", n / 2, f;
+		}
+		print "_ <- output: [n e];";
+	}'
+}
+
+# A hundred thousand variables, then frames that each update a few
+generate_variables()
+{
+	awk -v count=$((100000 / SCALE)) -v frames=2000 'BEGIN {
+		for (i = 0; i < count; i++) printf "%sv%d <- %d", i ? ", " : "", i, i;
+		print ";";
+		for (f = 0; f < frames; f++) {
+			a = (f * 7919) % count;
+			b = (f * 104729) % count;
+			printf "v%d <- v%d + v%d, total <- v%d;\n", a, a, b, b;
+		}
+		print "_ <- output: [total];";
+	}'
+}
+
+run_workload()
+{
+	local name=$1 script="$TMP/sync_bench_$1.txt" best=
+	generate_$name > "$script"
+	for ((run = 0; run < REPEAT; run++)); do
+		local result
+		result=$("$SYNC" --bench "$script" 2>&1 > /dev/null | tail -n 1) || true
+		case "$result" in
+			"{"*) ;;
+			*) echo "$name: $result" >&2; exit 1 ;;
+		esac
+		if [ -z "$best" ] || [ "$(seconds_of "$result")" \< "$(seconds_of "$best")" ]; then
+			best=$result
+		fi
+	done
+	rm -f "$script"
+	echo "{\"workload\":\"$name\",${best#\{}"
+}
+
+seconds_of()
+{
+	# Zero-padded so that comparing strings compares numbers
+	printf "%020.6f" "$(echo "$1" | sed 's/.*"seconds":\([0-9.]*\).*/\1/')"
+}
+
+: > "$OUT"
+for name in $WORKLOADS; do
+	run_workload $name | tee -a "$OUT"
+done
+
+if [ -n "$BASELINE" ]; then
+	echo "== compared to $BASELINE (regressions above $THRESHOLD%)"
+	awk -v threshold="$THRESHOLD" '
+		function field(line, key,   rest) {
+			rest = substr(line, index(line, "\"" key "\":") + length(key) + 3);
+			sub(/[,}].*/, "", rest);
+			return rest;
+		}
+		function change(old, new) {
+			return old > 0 ? 100 * (new - old) / old : 0;
+		}
+		function workload(line,   name) {
+			name = field(line, "workload");
+			gsub(/"/, "", name);
+			return name;
+		}
+		FNR == NR { baseline[workload($0)] = $0; next }
+		{
+			name = workload($0);
+			if (!(name in baseline)) {
+				printf "%-10s not in baseline\n", name;
+				next;
+			}
+			old = baseline[name];
+			verdict = "";
+			split("seconds p50_us p99_us", keys, " ");
+			line = sprintf("%-10s", name);
+			for (k = 1; k <= 3; k++) {
+				delta = change(field(old, keys[k]), field($0, keys[k]));
+				line = line sprintf("  %s %+7.1f%%", keys[k], delta);
+				if (delta > threshold) verdict = "  REGRESSION";
+			}
+			print line verdict;
+			if (verdict != "") failed = 1;
+		}
+		END { exit failed }
+	' "$BASELINE" "$OUT"
+fi
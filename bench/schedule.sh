@@ -0,0 +1,29 @@
+#!/bin/bash
+# Times frames with a skewed mix of jobs: many tiny ones and, last in
+# each frame, one that copies a large tuple. Run with and without
+# cost-based scheduling; ordering only matters with several CPUs, while
+# batching the tiny jobs helps on any machine.
+
+set -e
+SYNC=${SYNC:-./sync}
+N=${N:-100000}
+SMALL=${SMALL:-5000}
+FRAMES=${FRAMES:-20}
+TMP=${TMPDIR:-/tmp}
+
+awk -v n="$N" -v small="$SMALL" -v frames="$FRAMES" 'BEGIN {
+	printf "w <- [";
+	for (i = 0; i < n; i++) printf "%d ", i;
+	print "];";
+	for (f = 0; f < frames; f++) {
+		for (i = 0; i < small; i++) printf "s%d <- %d + %d, ", i, i, f;
+		printf "big <- w + [%d];\n", f;
+	}
+	print "_ <- output: [length: [big] s0];";
+}' > "$TMP/sync_schedule.txt"
+
+echo "== $SMALL small jobs and one $N-element copy per frame, $FRAMES frames, $(nproc) CPUs"
+for flag in --no-schedule ""; do
+	echo "-- ${flag:-default}"
+	time "$SYNC" $flag "$TMP/sync_schedule.txt"
+done
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Times a script of many tiny frames, where starting worker threads for
+# every frame would cost far more than the frames' own work.
+
+set -e
+SYNC=${SYNC:-./sync}
+FRAMES=${FRAMES:-20000}
+TMP=${TMPDIR:-/tmp}
+
+awk -v frames="$FRAMES" 'BEGIN {
+	print "a <- 0, b <- 1;";
+	for (i = 0; i < frames; i++) print "a <- a + b, b <- b * 1;";
+	print "_ <- output: [a b];";
+}' > "$TMP/sync_small_frames.txt"
+
+echo "== $FRAMES frames of two jobs"
+for threads in 1 4; do
+	echo "-- $threads workers"
+	time "$SYNC" --threads=$threads "$TMP/sync_small_frames.txt"
+	echo "-- $threads workers, never inline"
+	time "$SYNC" --threads=$threads --inline-threshold=0 "$TMP/sync_small_frames.txt"
+done
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Times appending to a large tuple one frame at a time, first when the
+# appending job is the only reader of the tuple (updated in place) and
+# then with a second reader in every frame (copied every frame).
+
+set -e
+SYNC=${SYNC:-./sync}
+N=${N:-1000000}
+FRAMES=${FRAMES:-2000}
+TMP=${TMPDIR:-/tmp}
+
+awk -v n="$N" -v frames="$FRAMES" 'BEGIN {
+	printf "a <- [";
+	for (i = 0; i < n; i++) printf "%d ", i;
+	print "];";
+	for (i = 0; i < frames; i++) printf "a <- a + [%d];\n", i;
+}' > "$TMP/sync_append_unique.txt"
+
+awk -v n="$N" -v frames="$FRAMES" 'BEGIN {
+	printf "a <- [";
+	for (i = 0; i < n; i++) printf "%d ", i;
+	print "];";
+	for (i = 0; i < frames; i++) printf "a <- a + [%d], b <- a;\n", i;
+}' > "$TMP/sync_append_shared.txt"
+
+for script in unique shared; do
+	echo "== $script, $N elements, $FRAMES frames"
+	time "$SYNC" "$TMP/sync_append_${script}.txt" > /dev/null
+done
@@ -0,0 +1,27 @@
+#!/bin/bash
+# Times printing a flat tuple of a million integers and a tuple nested
+# one level deep. Run from the repository root after `make`.
+
+set -e
+SYNC=${SYNC:-./sync}
+N=${N:-1000000}
+TMP=${TMPDIR:-/tmp}
+
+awk -v n="$N" 'BEGIN {
+	printf "t <- [";
+	for (i = 0; i < n; i++) printf "%d ", i * 7;
+	print "];";
+	print "_ <- output: [t];";
+}' > "$TMP/sync_flat_tuple.txt"
+
+awk -v n="$N" 'BEGIN {
+	printf "t <- [[";
+	for (i = 0; i < n; i++) printf "%d ", i * 7;
+	print "]];";
+	print "_ <- output: [t];";
+}' > "$TMP/sync_nested_tuple.txt"
+
+for script in flat nested; do
+	echo "== $script tuple, $N elements"
+	time "$SYNC" "$TMP/sync_${script}_tuple.txt" > /dev/null
+done
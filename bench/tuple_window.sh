@@ -0,0 +1,26 @@
+#!/bin/bash
+# Times sliding a window over a large tuple: every frame slices a
+# window out of the tuple and indexes into it, which should neither
+# allocate nor copy.
+
+set -e
+SYNC=${SYNC:-./sync}
+N=${N:-1000000}
+FRAMES=${FRAMES:-20000}
+WINDOW=${WINDOW:-1000}
+TMP=${TMPDIR:-/tmp}
+
+awk -v n="$N" -v frames="$FRAMES" -v window="$WINDOW" 'BEGIN {
+	printf "t <- [";
+	for (i = 0; i < n; i++) printf "%d ", i;
+	print "];";
+	for (i = 0; i < frames; i++) {
+		start = (i * 37) % (n - window);
+		printf "w <- slice: [t %d %d];\n", start, start + window;
+		printf "x <- index: [w %d] + index: [w 0];\n", window - 1;
+	}
+	print "_ <- output: [x];";
+}' > "$TMP/sync_window.txt"
+
+echo "== window of $WINDOW over $N elements, $FRAMES frames"
+time "$SYNC" "$TMP/sync_window.txt" > /dev/null
@@ -7,105 +7,199 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "memory.h"
+
+// Up to N elements of a list are kept in the list itself, sharing space
+// with the pointer to its allocation
+template <typename T, size_t N>
+struct List_Storage {
+	union {
+		T * arr;
+		T local[N];
+	};
+	T * inline_buffer()
+	{
+		return local;
+	}
+};
+
 template <typename T>
-struct List {
+struct List_Storage<T, 0> {
 	T * arr;
+	T * inline_buffer()
+	{
+		return NULL;
+	}
+};
+
+// A list with N > 0 holds up to N elements inline, and only allocates
+// once it outgrows them. Its elements must be reached through data()
+// or [], since arr is only valid while capacity > N. Copying such a list
+// copies its inline elements, so hand it over with move() instead.
+template <typename T, size_t N = 0>
+struct List : List_Storage<T, N> {
 	size_t size;
 	size_t capacity;
 	void alloc();
-	List<T> copy();
+	List<T, N> copy();
+	List<T, N> move();
 	void dealloc();
+	bool is_inline();
+	T * data();
 	void resize(size_t new_capacity);
 	void possibly_grow_to_size(size_t new_size);
 	void push(T to_push);
+	void push_array(const T * items, size_t count);
+	void clear();
 	void possibly_shrink_to_size(size_t query_size);
 	T pop();
 	T at(size_t index);
 	T& operator[](size_t index);
 	static constexpr int   initial_size  = 4;
 	static constexpr float grow_factor   = 2.0;
+	// Lists shrink to half their capacity once a quarter full, so they
+	// must double before they grow again, and never below shrink_floor
+	// elements, so pushes and pops on short lists never allocate
 	static constexpr float shrink_line   = 0.25;
 	static constexpr float shrink_factor = 0.5;
+	static constexpr size_t shrink_floor = N > 64 ? N : 64;
 };
 
-template <typename T>
-void List<T>::alloc()
+template <typename T, size_t N>
+void List<T, N>::alloc()
 {
 	size = 0;
-	capacity = List::initial_size;
-	arr = (T*) malloc(sizeof(T) * capacity);
+	if (N > 0) {
+		capacity = N;
+	} else {
+		capacity = List::initial_size;
+		this->arr = (T*) mem_alloc(sizeof(T) * capacity);
+	}
 }
 
-template <typename T>
-List<T> List<T>::copy()
+template <typename T, size_t N>
+List<T, N> List<T, N>::copy()
 {
-	List<T> list;
-	list.size = size;
-	list.capacity = capacity;
-	list.arr = (T*) malloc(sizeof(T) * capacity);
-	memcpy(list.arr, arr, sizeof(T) * size);
+	List<T, N> list;
+	list.alloc();
+	list.push_array(data(), size);
 	return list;
 }
 
-template <typename T>
-void List<T>::dealloc()
+// Returns the list and leaves this one empty and ready for use, without
+// copying the elements unless they are inline
+template <typename T, size_t N>
+List<T, N> List<T, N>::move()
+{
+	List<T, N> moved = *this;
+	alloc();
+	return moved;
+}
+
+template <typename T, size_t N>
+void List<T, N>::dealloc()
 {
-	free(arr);
+	if (!is_inline()) mem_free(this->arr);
+	if (N == 0) this->arr = NULL;
 	size = 0;
-	capacity = 0;
+	capacity = N;
 }
 
-template <typename T>
-void List<T>::resize(size_t new_capacity)
+template <typename T, size_t N>
+bool List<T, N>::is_inline()
+{
+	return N > 0 && capacity <= N;
+}
+
+// Spelled out rather than calling is_inline(), since this is on every
+// element access and unoptimized builds don't inline calls
+template <typename T, size_t N>
+T * List<T, N>::data()
+{
+	return N > 0 && capacity <= N ? this->inline_buffer() : this->arr;
+}
+
+template <typename T, size_t N>
+void List<T, N>::resize(size_t new_capacity)
 {
 	assert(new_capacity >= size);
-	T * new_arr = (T*) malloc(sizeof(T) * new_capacity);
-	memcpy(new_arr, arr, sizeof(T) * size);
-	free(arr);
-	arr = new_arr;
-	capacity = new_capacity;
+	if (new_capacity <= N) {
+		if (!is_inline()) {
+			T * heap = this->arr;
+			memcpy(this->inline_buffer(), heap, sizeof(T) * size);
+			mem_free(heap);
+		}
+		capacity = N;
+	} else if (is_inline()) {
+		T * heap = (T*) mem_alloc(sizeof(T) * new_capacity);
+		memcpy(heap, this->inline_buffer(), sizeof(T) * size);
+		this->arr = heap;
+		capacity = new_capacity;
+	} else {
+		this->arr = (T*) mem_realloc(this->arr, sizeof(T) * new_capacity);
+		capacity = new_capacity;
+	}
 }
 
-template <typename T>
-void List<T>::possibly_grow_to_size(size_t query_size)
+template <typename T, size_t N>
+void List<T, N>::possibly_grow_to_size(size_t query_size)
 {
 	if (query_size > capacity) {
-		resize(capacity * List::grow_factor);
+		size_t new_capacity = capacity ? capacity * List::grow_factor : List::initial_size;
+		if (new_capacity < query_size) new_capacity = query_size;
+		resize(new_capacity);
 	}
 }
 
-template <typename T>
-void List<T>::push(T to_push)
+template <typename T, size_t N>
+void List<T, N>::push(T to_push)
 {
 	possibly_grow_to_size(size + 1);
-	arr[size++] = to_push;
+	if (N == 0) this->arr[size++] = to_push;
+	else data()[size++] = to_push;
 }
 
-template <typename T>
-void List<T>::possibly_shrink_to_size(size_t query_size)
+template <typename T, size_t N>
+void List<T, N>::push_array(const T * items, size_t count)
 {
-	if (query_size < (int) (capacity * List::shrink_line)) {
-		resize((int) capacity * List::shrink_factor);
+	possibly_grow_to_size(size + count);
+	if (count) memcpy(data() + size, items, sizeof(T) * count);
+	size += count;
+}
+
+template <typename T, size_t N>
+void List<T, N>::clear()
+{
+	size = 0;
+}
+
+template <typename T, size_t N>
+void List<T, N>::possibly_shrink_to_size(size_t query_size)
+{
+	if (capacity > List::shrink_floor && query_size < capacity * List::shrink_line) {
+		size_t new_capacity = capacity * List::shrink_factor;
+		if (new_capacity < List::shrink_floor) new_capacity = List::shrink_floor;
+		resize(new_capacity);
 	}
 }
 
-template <typename T>
-T List<T>::pop()
+template <typename T, size_t N>
+T List<T, N>::pop()
 {
 	possibly_shrink_to_size(size - 1);
-	return arr[--size];
+	return N == 0 ? this->arr[--size] : data()[--size];
 }
 
-template <typename T>
-T List<T>::at(size_t index)
+template <typename T, size_t N>
+T List<T, N>::at(size_t index)
 {
 	assert(index < size);
-	return arr[index];
+	return N == 0 ? this->arr[index] : data()[index];
 }
 
-template <typename T>
-T& List<T>::operator[](size_t index)
+template <typename T, size_t N>
+T& List<T, N>::operator[](size_t index)
 {
 	assert(index < size);
-	return arr[index];
+	return N == 0 ? this->arr[index] : data()[index];
 }
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+
+// Subsystems allocations are attributed to, see src/memory.cc
+enum Memory_Tag {
+	MEM_OTHER,
+	MEM_PARSER,
+	MEM_COMPILER,
+	MEM_JOBS,
+	MEM_VM,
+	MEM_VALUES,
+	MEM_STRINGS,
+	MEM_VARIABLES,
+	MEM_CACHE,
+	MEM_PROFILER,
+	MEM_TAG_COUNT,
+};
+
+// Subsystem running on this thread, which untagged allocations belong to
+extern thread_local Memory_Tag memory_scope;
+
+void * mem_alloc(size_t size, Memory_Tag tag = memory_scope);
+void * mem_calloc(size_t count, size_t size, Memory_Tag tag = memory_scope);
+void * mem_realloc(void * ptr, size_t size, Memory_Tag tag = memory_scope);
+char * mem_strdup(const char * s, Memory_Tag tag = memory_scope);
+void mem_free(void * ptr);
+
+// Attributes the thread's untagged allocations to tag until it goes out
+// of scope
+struct Memory_Scope {
+	Memory_Tag outer;
+	Memory_Scope(Memory_Tag tag)
+	{
+		outer = memory_scope;
+		memory_scope = tag;
+	}
+	~Memory_Scope()
+	{
+		memory_scope = outer;
+	}
+};
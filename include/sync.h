@@ -0,0 +1,40 @@
+#pragma once
+
+// Embedding API, built into libsync.a and libsync.so by make libsync
+//
+// A context holds variables of its own and runs source text against them
+// a frame at a time, as the command line runs a file. Contexts are
+// independent and may run on different threads at once. Their jobs run
+// on one pool of workers shared by the whole process, which serves the
+// contexts waiting on it in turn. Errors fail the frame they happen in,
+// never the process.
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define SYNC_API extern "C" __attribute__((visibility("default")))
+
+struct Sync_Context;
+
+// Sets the number of workers, 0 for one per available CPU. Only has an
+// effect before the first context is created.
+SYNC_API void sync_set_threads(size_t threads);
+
+SYNC_API Sync_Context * sync_create();
+SYNC_API void sync_destroy(Sync_Context * context);
+
+// Where the context's output: calls write, stdout by default
+SYNC_API void sync_set_output(Sync_Context * context, FILE * output);
+
+// Runs every frame in source. Returns 0, or -1 if a frame failed, in
+// which case that frame assigned nothing, the frames after it did not
+// run, and sync_error() describes what went wrong.
+SYNC_API int sync_run(Sync_Context * context, const char * source);
+
+// Writes the printed form of a variable's value into buffer as snprintf
+// would, and returns the length it needed. Returns -1 if the variable is
+// unbound or could not be evaluated.
+SYNC_API int sync_format(Sync_Context * context, const char * variable, char * buffer, size_t size);
+
+// Message of the context's last error
+SYNC_API const char * sync_error(Sync_Context * context);
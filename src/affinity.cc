@@ -0,0 +1,138 @@
+// Worker placement
+//
+// The default worker count is the number of CPUs this process may run
+// on: those in its affinity mask, which a cpuset narrows, capped by any
+// CPU quota set on its cgroup. With --pin, worker i always runs on the
+// i-th of those CPUs. Linux places a page on the node of the CPU that
+// first touches it, so pinned workers also keep the tuples they build
+// in memory local to their own node.
+
+struct Cpu_Placement {
+	// CPUs in the affinity mask, in order
+	List<int> cpus;
+	void init()
+	{
+		cpus.alloc();
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+			for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+				if (CPU_ISSET(cpu, &mask)) cpus.push(cpu);
+			}
+		}
+		if (cpus.size == 0) {
+			long online = sysconf(_SC_NPROCESSORS_ONLN);
+			for (int cpu = 0; cpu < online; cpu++) {
+				cpus.push(cpu);
+			}
+		}
+	}
+	// Workers to start when --threads is not given
+	size_t default_threads()
+	{
+		size_t count = cpus.size;
+		size_t quota = cgroup_cpu_quota();
+		if (quota && quota < count) count = quota;
+		return count ? count : 1;
+	}
+	void pin(pthread_t thread, size_t worker)
+	{
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		CPU_SET(cpus[worker % cpus.size], &mask);
+		int error = pthread_setaffinity_np(thread, sizeof(mask), &mask);
+		if (error) {
+			fatal("Could not pin worker %zu to CPU %d: %s",
+				  worker, cpus[worker % cpus.size], strerror(error));
+		}
+	}
+	// This process's cgroup, from /proc/self/cgroup: the v2 hierarchy's
+	// "0::/path" line if v2, or the v1 line whose controllers include
+	// cpu. Returns false if neither is there.
+	static bool cgroup_path(bool v2, char * path, size_t size)
+	{
+		FILE * file = fopen("/proc/self/cgroup", "r");
+		if (!file) return false;
+		bool found = false;
+		char line[4096];
+		while (!found && fgets(line, sizeof(line), file)) {
+			line[strcspn(line, "\n")] = '\0';
+			// id:controllers:path
+			char * controllers = strchr(line, ':');
+			if (!controllers) continue;
+			controllers++;
+			char * dir = strchr(controllers, ':');
+			if (!dir) continue;
+			*dir++ = '\0';
+			if (v2) {
+				found = strncmp(line, "0:", 2) == 0 && controllers[0] == '\0';
+			} else {
+				for (char * name = strtok(controllers, ","); name; name = strtok(NULL, ",")) {
+					if (strcmp(name, "cpu") == 0) found = true;
+				}
+			}
+			if (found) snprintf(path, size, "%s", dir);
+		}
+		fclose(file);
+		return found;
+	}
+	// Whole CPUs' worth of time a cgroup directory allows, rounded up,
+	// or 0 if it sets no limit or has no such files
+	static size_t cgroup_dir_quota(const char * dir, bool v2)
+	{
+		char name[4200];
+		long quota = -1, period = 0;
+		if (v2) {
+			snprintf(name, sizeof(name), "%s/cpu.max", dir);
+			FILE * file = fopen(name, "r");
+			if (!file) return 0;
+			char max[32];
+			if (fscanf(file, "%31s %ld", max, &period) == 2 && strcmp(max, "max") != 0) {
+				quota = atol(max);
+			}
+			fclose(file);
+		} else {
+			snprintf(name, sizeof(name), "%s/cpu.cfs_quota_us", dir);
+			FILE * file = fopen(name, "r");
+			if (file) {
+				if (fscanf(file, "%ld", &quota) != 1) quota = -1;
+				fclose(file);
+			}
+			snprintf(name, sizeof(name), "%s/cpu.cfs_period_us", dir);
+			file = fopen(name, "r");
+			if (file) {
+				if (fscanf(file, "%ld", &period) != 1) period = 0;
+				fclose(file);
+			}
+		}
+		if (quota <= 0 || period <= 0) return 0;
+		return (quota + period - 1) / period;
+	}
+	// Whole CPUs' worth of time this process's cgroup may use, or 0 if
+	// it is unlimited. Prefers cgroup v2's cpu.max over v1's CFS files.
+	// A cgroup is also held to the limits of the ones above it, so this
+	// is the tightest limit from its own directory up to the root of the
+	// mount. Inside a container the path in /proc/self/cgroup may not
+	// exist under the mount, in which case only the root files count.
+	static size_t cgroup_cpu_quota()
+	{
+		bool v2 = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0;
+		const char * mount = v2 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/cpu";
+		char path[4096];
+		if (!cgroup_path(v2, path, sizeof(path))) path[0] = '\0';
+		size_t tightest = 0;
+		while (true) {
+			char dir[4200];
+			snprintf(dir, sizeof(dir), "%s%s", mount, path);
+			size_t quota = cgroup_dir_quota(dir, v2);
+			if (quota && (!tightest || quota < tightest)) tightest = quota;
+			char * slash = strrchr(path, '/');
+			if (!slash || path[0] == '\0' || strcmp(path, "/") == 0) break;
+			// Up one level, ending with the root itself
+			*slash = '\0';
+		}
+		return tightest;
+	}
+};
+
+Cpu_Placement cpu_placement;
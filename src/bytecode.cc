@@ -1,12 +1,84 @@
 enum Command_Type {
 	CMD_LOAD_CONST,
 	CMD_LOOKUP,
+	CMD_LOOKUP_MOVE,
 	CMD_UNARY_OP,
 	CMD_BINARY_OP,
 	CMD_OUTPUT,
 	CMD_MAKE_TUPLE,
+	CMD_INDEX,
+	CMD_SLICE,
+	CMD_LENGTH,
+	CMD_LOAD_SLOT,
+	// Integer-only forms of the operators, chosen by specialize_types()
+	// when both operands are known to be integers. They are never
+	// written to bytecode files.
+	CMD_INT_NEGATE,
+	CMD_INT_ADD,
+	CMD_INT_SUBTRACT,
+	CMD_INT_MULTIPLY,
+	CMD_INT_DIVIDE,
+	// Superinstructions formed by emit_fused(), during
+	// specialize_types(), from an integer operator and the loads
+	// feeding it
+	CMD_INT_OP_CONST,
+	CMD_INT_OP_VAR,
+	CMD_INT_VAR_OP_VAR,
+	CMD_COUNT,
 };
 
+// Names as written in disassembly, see bytecode.txt
+const char * command_type_name(Command_Type type)
+{
+	switch (type) {
+	case CMD_LOAD_CONST:  return "LOAD_CONST";
+	case CMD_LOOKUP:      return "LOOKUP";
+	case CMD_LOOKUP_MOVE: return "LOOKUP_MOVE";
+	case CMD_UNARY_OP:    return "UNARY_OP";
+	case CMD_BINARY_OP:   return "BINARY_OP";
+	case CMD_OUTPUT:      return "OUTPUT";
+	case CMD_MAKE_TUPLE:  return "MAKE_TUPLE";
+	case CMD_INDEX:       return "INDEX";
+	case CMD_SLICE:       return "SLICE";
+	case CMD_LENGTH:      return "LENGTH";
+	case CMD_LOAD_SLOT:   return "LOAD_SLOT";
+	case CMD_INT_NEGATE:   return "INT_NEGATE";
+	case CMD_INT_ADD:      return "INT_ADD";
+	case CMD_INT_SUBTRACT: return "INT_SUBTRACT";
+	case CMD_INT_MULTIPLY: return "INT_MULTIPLY";
+	case CMD_INT_DIVIDE:   return "INT_DIVIDE";
+	case CMD_INT_OP_CONST:   return "INT_OP_CONST";
+	case CMD_INT_OP_VAR:     return "INT_OP_VAR";
+	case CMD_INT_VAR_OP_VAR: return "INT_VAR_OP_VAR";
+	default:
+		fatal_internal("command_type_name() switch incomplete");
+	}
+	return NULL;
+}
+
+const char * unary_op_name(Unary_Op op)
+{
+	switch (op) {
+	case UNARY_MINUS: return "UNARY_MINUS";
+	default:
+		fatal_internal("unary_op_name() switch incomplete");
+	}
+	return NULL;
+}
+
+const char * binary_op_name(Binary_Op op)
+{
+	switch (op) {
+	case BINARY_PLUS:     return "BINARY_PLUS";
+	case BINARY_MINUS:    return "BINARY_MINUS";
+	case BINARY_MULTIPLY: return "BINARY_MULTIPLY";
+	case BINARY_DIVIDE:   return "BINARY_DIVIDE";
+	default:
+		fatal_internal("binary_op_name() switch incomplete");
+	}
+	return NULL;
+}
+
 struct Command {
 	Command_Type type;
 	union {
@@ -15,7 +87,7 @@ struct Command {
 		} load_const;
 		struct {
 			const char * symbol;
-		} lookup;
+		} lookup; // Also used by CMD_LOOKUP_MOVE
 		struct {
 			Unary_Op op;
 		} unary_op;
@@ -25,6 +97,25 @@ struct Command {
 		struct {
 			size_t length;
 		} make_tuple;
+		struct {
+			size_t slot;
+		} load_slot;
+		// Top of stack op constant
+		struct {
+			Binary_Op op;
+			int constant;
+		} int_op_const;
+		// Top of stack op variable
+		struct {
+			Binary_Op op;
+			const char * symbol;
+		} int_op_var;
+		// Pushes left op right
+		struct {
+			Binary_Op op;
+			const char * left;
+			const char * right;
+		} int_var_op_var;
 	};
 	static Command with_type(Command_Type type)
 	{
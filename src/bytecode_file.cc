@@ -0,0 +1,606 @@
+// Precompiled bytecode files
+//
+// `sync --compile=OUT source` runs the frame passes and the compiler
+// ahead of time and writes every frame's command streams to OUT. Running
+// `sync OUT` maps the file and executes it without lexing or parsing,
+// and `sync --disassemble OUT` prints it in the notation of bytecode.txt.
+// The same layout, held in memory, carries shards of a frame to worker
+// processes, see processes.cc.
+//
+// Layout, every section 4-byte aligned and in host byte order:
+//   Bytecode_Header
+//   Bytecode_Frame[frame_count]      Each frame's jobs are contiguous,
+//   Bytecode_Job[job_count]          precompute jobs first
+//   Bytecode_Command[command_count]
+//   uint32_t symbol_offsets[symbol_count]  Into the string section
+//   Bytecode_Constant[constant_count]
+//   char strings[string_bytes]       NUL-terminated symbol names
+
+#define BYTECODE_MAGIC "SYNCCODE"
+#define BYTECODE_VERSION 1
+
+struct Bytecode_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t frame_count;
+	uint32_t job_count;
+	uint32_t command_count;
+	uint32_t symbol_count;
+	uint32_t constant_count;
+	uint64_t string_bytes;
+};
+
+struct Bytecode_Frame {
+	uint32_t first_job;
+	uint32_t job_count;
+	uint32_t precompute_count;
+	// Slots that are filled before the frame runs rather than by its
+	// own precompute jobs. Only shards sent to worker processes have
+	// any, since they carry the slots their jobs read.
+	uint32_t filled_slots;
+};
+
+struct Bytecode_Job {
+	int32_t left;  // Symbol index, or -1 for _
+	int32_t slot;  // Slot filled by a precompute job, or -1
+	uint32_t first_command;
+	uint32_t command_count;
+};
+
+struct Bytecode_Command {
+	uint32_t type;
+	// Constant index, symbol index, operator, tuple length or slot,
+	// depending on type
+	uint32_t operand;
+};
+
+struct Bytecode_Constant {
+	uint32_t type;
+	int32_t integer;
+};
+
+bool is_bytecode_file(const char * path)
+{
+	FILE * file = fopen(path, "rb");
+	if (!file) return false;
+	char magic[8];
+	bool match = fread(magic, 1, 8, file) == 8 && memcmp(magic, BYTECODE_MAGIC, 8) == 0;
+	fclose(file);
+	return match;
+}
+
+struct Bytecode_Writer {
+	List<Bytecode_Frame> frames;
+	List<Bytecode_Job> jobs;
+	List<Bytecode_Command> commands;
+	List<uint32_t> symbol_offsets;
+	List<Bytecode_Constant> constants;
+	List<char> strings;
+	Symbol_Set symbols;
+	// Open-addressed map from integer constant to pool index, -1 empty
+	List<int64_t> integer_slots;
+	int32_t nil_constant;
+	void init();
+	void dealloc();
+	uint32_t symbol(const char * name);
+	uint32_t constant(Value value);
+	void add_job(Job * job);
+	void add_frame(List<Job*> precompute, List<Job*> frame_jobs, uint32_t filled_slots = 0);
+	void encode(List<char> * out);
+	void write(const char * path);
+};
+
+void Bytecode_Writer::init()
+{
+	frames.alloc();
+	jobs.alloc();
+	commands.alloc();
+	symbol_offsets.alloc();
+	constants.alloc();
+	strings.alloc();
+	symbols.init();
+	integer_slots.alloc();
+	for (int i = 0; i < 1024; i++) integer_slots.push(-1);
+	nil_constant = -1;
+}
+
+void Bytecode_Writer::dealloc()
+{
+	frames.dealloc();
+	jobs.dealloc();
+	commands.dealloc();
+	symbol_offsets.dealloc();
+	constants.dealloc();
+	strings.dealloc();
+	symbols.dealloc();
+	integer_slots.dealloc();
+}
+
+uint32_t Bytecode_Writer::symbol(const char * name)
+{
+	int index = symbols.index_of(name);
+	if (index != -1) return index;
+	symbols.add(name);
+	symbol_offsets.push(strings.size);
+	strings.push_array(name, strlen(name) + 1);
+	return symbol_offsets.size - 1;
+}
+
+uint32_t Bytecode_Writer::constant(Value value)
+{
+	if (value.type == VALUE_NIL) {
+		if (nil_constant == -1) {
+			nil_constant = constants.size;
+			constants.push((Bytecode_Constant) { VALUE_NIL, 0 });
+		}
+		return nil_constant;
+	}
+	if (value.type != VALUE_INTEGER) {
+		fatal_internal("Only nil and integer constants can be written to bytecode");
+	}
+
+	// Slots pack the integer in the high half and the pool index in the
+	// low half, so the table is one flat array.
+	size_t mask = integer_slots.size - 1;
+	size_t i = hash_combine(0, (uint32_t) value.integer) & mask;
+	while (integer_slots[i] != -1) {
+		if ((int32_t) (integer_slots[i] >> 32) == value.integer) {
+			return (uint32_t) integer_slots[i];
+		}
+		i = (i + 1) & mask;
+	}
+	uint32_t index = constants.size;
+	constants.push((Bytecode_Constant) { VALUE_INTEGER, value.integer });
+	integer_slots[i] = (int64_t) (((uint64_t) (uint32_t) value.integer << 32) | index);
+
+	if (constants.size * 2 > integer_slots.size) {
+		List<int64_t> old = integer_slots;
+		integer_slots.alloc();
+		for (size_t j = 0; j < old.size * 2; j++) integer_slots.push(-1);
+		mask = integer_slots.size - 1;
+		for (int j = 0; j < old.size; j++) {
+			if (old[j] == -1) continue;
+			size_t k = hash_combine(0, (uint32_t) (old[j] >> 32)) & mask;
+			while (integer_slots[k] != -1) k = (k + 1) & mask;
+			integer_slots[k] = old[j];
+		}
+		old.dealloc();
+	}
+	return index;
+}
+
+void Bytecode_Writer::add_job(Job * job)
+{
+	job->compile();
+	Bytecode_Job record;
+	record.left = job->left ? (int32_t) symbol(job->left) : -1;
+	record.slot = job->slot;
+	record.first_command = commands.size;
+	record.command_count = job->commands.size;
+	for (int i = 0; i < job->commands.size; i++) {
+		Command cmd = job->commands[i];
+		Bytecode_Command out = { (uint32_t) cmd.type, 0 };
+		switch (cmd.type) {
+		case CMD_LOAD_CONST:
+			out.operand = constant(cmd.load_const.constant);
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			out.operand = symbol(cmd.lookup.symbol);
+			break;
+		case CMD_UNARY_OP:
+			out.operand = cmd.unary_op.op;
+			break;
+		case CMD_BINARY_OP:
+			out.operand = cmd.binary_op.op;
+			break;
+		case CMD_MAKE_TUPLE:
+			out.operand = cmd.make_tuple.length;
+			break;
+		case CMD_LOAD_SLOT:
+			out.operand = cmd.load_slot.slot;
+			break;
+		default:
+			break;
+		}
+		commands.push(out);
+	}
+	jobs.push(record);
+}
+
+void Bytecode_Writer::add_frame(List<Job*> precompute, List<Job*> frame_jobs, uint32_t filled_slots)
+{
+	Bytecode_Frame frame;
+	frame.first_job = jobs.size;
+	frame.job_count = precompute.size + frame_jobs.size;
+	frame.precompute_count = precompute.size;
+	frame.filled_slots = filled_slots;
+	for (int i = 0; i < precompute.size; i++) add_job(precompute[i]);
+	for (int i = 0; i < frame_jobs.size; i++) add_job(frame_jobs[i]);
+	frames.push(frame);
+}
+
+// Appends the whole image to out
+void Bytecode_Writer::encode(List<char> * out)
+{
+	// Pad strings so the image length stays a multiple of four
+	while (strings.size % 4 != 0) strings.push('\0');
+
+	Bytecode_Header header;
+	memcpy(header.magic, BYTECODE_MAGIC, 8);
+	header.version = BYTECODE_VERSION;
+	header.frame_count = frames.size;
+	header.job_count = jobs.size;
+	header.command_count = commands.size;
+	header.symbol_count = symbol_offsets.size;
+	header.constant_count = constants.size;
+	header.string_bytes = strings.size;
+
+	out->push_array((const char *) &header, sizeof(header));
+	out->push_array((const char *) frames.arr, sizeof(Bytecode_Frame) * frames.size);
+	out->push_array((const char *) jobs.arr, sizeof(Bytecode_Job) * jobs.size);
+	out->push_array((const char *) commands.arr, sizeof(Bytecode_Command) * commands.size);
+	out->push_array((const char *) symbol_offsets.arr, sizeof(uint32_t) * symbol_offsets.size);
+	out->push_array((const char *) constants.arr, sizeof(Bytecode_Constant) * constants.size);
+	out->push_array(strings.arr, strings.size);
+}
+
+void Bytecode_Writer::write(const char * path)
+{
+	List<char> image;
+	image.alloc();
+	encode(&image);
+	FILE * file = fopen(path, "wb");
+	if (!file) {
+		fatal("Could not open %s for writing", path);
+	}
+	fwrite(image.arr, 1, image.size, file);
+	image.dealloc();
+	bool failed = ferror(file);
+	if (fclose(file) != 0 || failed) {
+		fatal("Could not write %s", path);
+	}
+}
+
+// A bytecode file mapped into memory. Frames are turned into jobs one
+// at a time as they are run, and symbol names point straight into the
+// mapping, so loading costs nothing up front beyond validation.
+struct Bytecode_Image {
+	void * map;
+	size_t map_size;
+	Bytecode_Header * header;
+	Bytecode_Frame * frames;
+	Bytecode_Job * jobs;
+	Bytecode_Command * commands;
+	uint32_t * symbol_offsets;
+	Bytecode_Constant * constants;
+	const char * strings;
+	void open(const char * path);
+	void open_buffer(const char * data, size_t size, const char * name);
+	void validate(const char * name);
+	void close();
+	const char * symbol(uint32_t index);
+	Value constant(uint32_t index);
+	List<Command> load_commands(Bytecode_Job * job, uint32_t slot_count);
+	void load_frame(size_t index, List<Job*> * precompute, List<Job*> * frame_jobs);
+	void disassemble(FILE * out);
+};
+
+void Bytecode_Image::open(const char * path)
+{
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) {
+		fatal("Could not read %s", path);
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		fatal("Could not read %s", path);
+	}
+	map_size = st.st_size;
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED) {
+		fatal("Could not map %s", path);
+	}
+	validate(path);
+}
+
+// Reads an image already in memory, which must stay there and 4-byte
+// aligned as long as the image is used, and is not the image's to free
+void Bytecode_Image::open_buffer(const char * data, size_t size, const char * name)
+{
+	map = (void *) data;
+	map_size = size;
+	validate(name);
+}
+
+// Checks the header and section sizes and finds the sections. Errors
+// name the image by path.
+void Bytecode_Image::validate(const char * path)
+{
+	if (map_size < sizeof(Bytecode_Header)) {
+		fatal("%s is not a bytecode file", path);
+	}
+	header = (Bytecode_Header *) map;
+	if (memcmp(header->magic, BYTECODE_MAGIC, 8) != 0) {
+		fatal("%s is not a bytecode file", path);
+	}
+	if (header->version != BYTECODE_VERSION) {
+		fatal("%s is bytecode version %u, expected %u",
+			  path, header->version, BYTECODE_VERSION);
+	}
+	uint64_t expected = sizeof(Bytecode_Header)
+		+ (uint64_t) header->frame_count * sizeof(Bytecode_Frame)
+		+ (uint64_t) header->job_count * sizeof(Bytecode_Job)
+		+ (uint64_t) header->command_count * sizeof(Bytecode_Command)
+		+ (uint64_t) header->symbol_count * sizeof(uint32_t)
+		+ (uint64_t) header->constant_count * sizeof(Bytecode_Constant)
+		+ header->string_bytes;
+	if (expected != map_size) {
+		fatal("%s is truncated or corrupt", path);
+	}
+
+	char * cursor = (char *) (header + 1);
+	frames = (Bytecode_Frame *) cursor;
+	cursor += header->frame_count * sizeof(Bytecode_Frame);
+	jobs = (Bytecode_Job *) cursor;
+	cursor += header->job_count * sizeof(Bytecode_Job);
+	commands = (Bytecode_Command *) cursor;
+	cursor += header->command_count * sizeof(Bytecode_Command);
+	symbol_offsets = (uint32_t *) cursor;
+	cursor += header->symbol_count * sizeof(uint32_t);
+	constants = (Bytecode_Constant *) cursor;
+	cursor += header->constant_count * sizeof(Bytecode_Constant);
+	strings = cursor;
+
+	if (header->string_bytes > 0 && strings[header->string_bytes - 1] != '\0') {
+		fatal("%s is truncated or corrupt", path);
+	}
+	for (uint32_t i = 0; i < header->symbol_count; i++) {
+		if (symbol_offsets[i] >= header->string_bytes) {
+			fatal("%s has a symbol outside its string table", path);
+		}
+	}
+}
+
+void Bytecode_Image::close()
+{
+	munmap(map, map_size);
+}
+
+const char * Bytecode_Image::symbol(uint32_t index)
+{
+	if (index >= header->symbol_count) {
+		fatal("Bytecode refers to symbol %u of %u", index, header->symbol_count);
+	}
+	return strings + symbol_offsets[index];
+}
+
+Value Bytecode_Image::constant(uint32_t index)
+{
+	if (index >= header->constant_count) {
+		fatal("Bytecode refers to constant %u of %u", index, header->constant_count);
+	}
+	Bytecode_Constant constant = constants[index];
+	switch (constant.type) {
+	case VALUE_NIL:
+		return Value::with_type(VALUE_NIL);
+	case VALUE_INTEGER:
+		return Value::make_integer(constant.integer);
+	default:
+		fatal("Bytecode constant %u has invalid type %u", index, constant.type);
+	}
+	return Value::with_type(VALUE_NIL);
+}
+
+// Decodes a job's commands, checking every operand and that the stack
+// never underflows and ends holding exactly the job's result, so a
+// corrupt file is reported instead of crashing a worker.
+List<Command> Bytecode_Image::load_commands(Bytecode_Job * job, uint32_t slot_count)
+{
+	if (job->first_command > header->command_count
+		|| job->command_count > header->command_count - job->first_command) {
+		fatal("Bytecode job refers to commands outside the file");
+	}
+	List<Command> list;
+	list.alloc();
+	size_t depth = 0;
+	for (uint32_t i = 0; i < job->command_count; i++) {
+		Bytecode_Command record = commands[job->first_command + i];
+		// Specialized commands depend on runtime types and are never
+		// written, so they are as invalid here as unknown ones
+		if (record.type >= CMD_INT_NEGATE) {
+			fatal("Bytecode has invalid command type %u", record.type);
+		}
+		Command cmd = Command::with_type((Command_Type) record.type);
+		switch (cmd.type) {
+		case CMD_LOAD_CONST:
+			cmd.load_const.constant = constant(record.operand);
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			cmd.lookup.symbol = symbol(record.operand);
+			break;
+		case CMD_UNARY_OP:
+			if (record.operand > UNARY_MINUS) {
+				fatal("Bytecode has invalid unary operator %u", record.operand);
+			}
+			cmd.unary_op.op = (Unary_Op) record.operand;
+			break;
+		case CMD_BINARY_OP:
+			if (record.operand > BINARY_DIVIDE) {
+				fatal("Bytecode has invalid binary operator %u", record.operand);
+			}
+			cmd.binary_op.op = (Binary_Op) record.operand;
+			break;
+		case CMD_MAKE_TUPLE:
+			cmd.make_tuple.length = record.operand;
+			break;
+		case CMD_LOAD_SLOT:
+			if (record.operand >= slot_count) {
+				fatal("Bytecode refers to slot %u of %u", record.operand, slot_count);
+			}
+			cmd.load_slot.slot = record.operand;
+			break;
+		default:
+			break;
+		}
+
+		size_t pops = 0, pushes = 1;
+		switch (cmd.type) {
+		case CMD_UNARY_OP:   pops = 1; break;
+		case CMD_BINARY_OP:  pops = 2; break;
+		case CMD_OUTPUT:     pops = 1; pushes = 0; break;
+		case CMD_MAKE_TUPLE: pops = cmd.make_tuple.length; break;
+		case CMD_INDEX:      pops = 2; break;
+		case CMD_SLICE:      pops = 3; break;
+		case CMD_LENGTH:     pops = 1; break;
+		default: break;
+		}
+		if (pops > depth) {
+			fatal("Bytecode command %u underflows the stack", job->first_command + i);
+		}
+		depth = depth - pops + pushes;
+		list.push(cmd);
+	}
+	if (depth != 1) {
+		fatal("Bytecode job at command %u leaves %zu values on the stack",
+			  job->first_command, depth);
+	}
+	return list;
+}
+
+void Bytecode_Image::load_frame(size_t index, List<Job*> * precompute, List<Job*> * frame_jobs)
+{
+	Bytecode_Frame frame = frames[index];
+	if (frame.first_job > header->job_count
+		|| frame.job_count > header->job_count - frame.first_job
+		|| frame.precompute_count > frame.job_count) {
+		fatal("Bytecode frame %zu refers to jobs outside the file", index);
+	}
+	uint32_t slot_count = frame.precompute_count + frame.filled_slots;
+	if (slot_count < frame.precompute_count) {
+		fatal("Bytecode frame %zu has an invalid slot count", index);
+	}
+	precompute->alloc();
+	frame_jobs->alloc();
+	for (uint32_t i = 0; i < frame.job_count; i++) {
+		Bytecode_Job * record = &jobs[frame.first_job + i];
+		const char * left = record->left == -1 ? NULL : symbol(record->left);
+		bool is_precompute = i < frame.precompute_count;
+		if (is_precompute
+			? record->slot < 0 || (uint32_t) record->slot >= slot_count
+			: record->slot != -1) {
+			fatal("Bytecode frame %zu has an invalid precompute slot", index);
+		}
+		List<Command> job_commands = load_commands(record, slot_count);
+		Job * job = Job::make_compiled(left, record->slot, job_commands);
+		if (is_precompute) {
+			precompute->push(job);
+		} else {
+			frame_jobs->push(job);
+		}
+	}
+}
+
+void Bytecode_Image::disassemble(FILE * out)
+{
+	for (uint32_t f = 0; f < header->frame_count; f++) {
+		List<Job*> precompute, frame_jobs;
+		load_frame(f, &precompute, &frame_jobs);
+		fprintf(out, ";; frame %u\n", f);
+		for (int j = 0; j < precompute.size + frame_jobs.size; j++) {
+			Job * job = j < precompute.size ? precompute[j] : frame_jobs[j - precompute.size];
+			if (job->slot != -1) {
+				fprintf(out, ";; $%d <-\n", job->slot);
+			} else {
+				fprintf(out, ";; %s <-\n", job->left ? job->left : "_");
+			}
+			for (int i = 0; i < job->commands.size; i++) {
+				Command cmd = job->commands[i];
+				fprintf(out, "%s", command_type_name(cmd.type));
+				switch (cmd.type) {
+				case CMD_LOAD_CONST: {
+					char * s = cmd.load_const.constant.to_string();
+					fprintf(out, " %s", s);
+					mem_free(s);
+				} break;
+				case CMD_LOOKUP:
+				case CMD_LOOKUP_MOVE:
+					fprintf(out, " \"%s\"", cmd.lookup.symbol);
+					break;
+				case CMD_UNARY_OP:
+					fprintf(out, " %s", unary_op_name(cmd.unary_op.op));
+					break;
+				case CMD_BINARY_OP:
+					fprintf(out, " %s", binary_op_name(cmd.binary_op.op));
+					break;
+				case CMD_MAKE_TUPLE:
+					fprintf(out, " %zu", cmd.make_tuple.length);
+					break;
+				case CMD_LOAD_SLOT:
+					fprintf(out, " %zu", cmd.load_slot.slot);
+					break;
+				default:
+					break;
+				}
+				fprintf(out, "\n");
+			}
+			job->dealloc();
+		}
+		precompute.dealloc();
+		frame_jobs.dealloc();
+	}
+}
+
+// Compiles a parsed program and writes it to path without running it
+void compile_program(List<List<Job_Spec*>> program, const char * path)
+{
+	Bytecode_Writer writer;
+	writer.init();
+	for (int f = 0; f < program.size; f++) {
+		List<Job*> precompute, jobs;
+		prepare_frame(program[f], &precompute, &jobs);
+		writer.add_frame(precompute, jobs);
+		for (int i = 0; i < precompute.size; i++) {
+			mem_free(precompute[i]->spec);
+			precompute[i]->dealloc();
+		}
+		for (int i = 0; i < jobs.size; i++) {
+			jobs[i]->dealloc();
+		}
+		precompute.dealloc();
+		jobs.dealloc();
+	}
+	writer.write(path);
+	writer.dealloc();
+}
+
+// Runs a bytecode file frame by frame. The mapping is never unmapped,
+// since bound symbols keep pointing into it.
+void run_bytecode_file(const char * path)
+{
+	Bytecode_Image image;
+	image.open(path);
+	for (uint32_t f = 0; f < image.header->frame_count; f++) {
+		List<Job*> precompute, jobs;
+		profiler.frame = f;
+		double start = profiler.now();
+		{
+			Memory_Scope scope(MEM_COMPILER);
+			image.load_frame(f, &precompute, &jobs);
+		}
+		profiler.record("load", NULL, start, profiler.now());
+		exec_context->execute_frame(precompute, jobs);
+		precompute.dealloc();
+		jobs.dealloc();
+	}
+}
+
+void disassemble_bytecode_file(const char * path)
+{
+	Bytecode_Image image;
+	image.open(path);
+	image.disassemble(stdout);
+	image.close();
+}
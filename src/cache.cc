@@ -0,0 +1,235 @@
+// Persistent result cache
+//
+// Maps a key built from a job's expression and the contents of every
+// value it reads to the serialized result of the job, so a re-run of a
+// script only executes jobs whose inputs changed. The cache file is
+// memory-mapped at startup and rewritten at exit with the entries that
+// were hit or added during the run, so stale results don't accumulate.
+//
+// A hit is only trusted if a second hash of the same inputs, built with
+// a different function, matches too. Values still enter both hashes as
+// their 64-bit content_hash(), so two inputs whose contents collide
+// there are taken to be the same; that much is accepted.
+//
+// Results are only stored while their serialized size is in proportion
+// to the job's own work, its commands. Loading a large result takes as
+// long as the cheap operations that build one, and a tuple that grows
+// every frame would otherwise be written out whole each time.
+//
+// File layout: a Cache_File_Header, then entry_count Cache_File_Entry
+// records sorted by key, then the serialized values they point at.
+
+#define CACHE_MAGIC "SYNCCACH"
+#define CACHE_VERSION 2
+
+// Serialized bytes a result may take per command of its job, on top of
+// CACHE_MIN_ENTRY_SIZE
+#define CACHE_BYTES_PER_COMMAND 64
+#define CACHE_MIN_ENTRY_SIZE 256
+
+// Two independent hashes of the same inputs
+struct Cache_Key {
+	uint64_t key;
+	uint64_t check;
+	void init()
+	{
+		key = 0;
+		check = 14695981039346656037ull;
+	}
+	void mix(uint64_t value)
+	{
+		key = hash_combine(key, value);
+		check = hash_bytes(&value, sizeof(value), check);
+	}
+};
+
+struct Cache_File_Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t entry_count;
+};
+
+struct Cache_File_Entry {
+	uint64_t key;
+	uint64_t check;
+	uint64_t offset; // From the start of the data section
+	uint64_t length;
+};
+
+// An entry to write back at exit. Its bytes either point into the
+// mapped file or are owned by the record.
+struct Cache_Record {
+	Cache_Key key;
+	const char * bytes;
+	size_t length;
+	bool owned;
+};
+
+struct Result_Cache {
+	const char * path = NULL;
+	void * map = NULL;
+	size_t map_size = 0;
+	const Cache_File_Entry * file_entries = NULL;
+	size_t file_entry_count = 0;
+	const char * file_data = NULL;
+	size_t file_data_size = 0;
+	pthread_mutex_t mutex;
+	List<Cache_Record> records;
+	void open(const char * path);
+	bool lookup(Cache_Key key, Value * out);
+	void store(Cache_Key key, Value value, size_t commands);
+	void save();
+};
+
+Result_Cache result_cache;
+
+void Result_Cache::open(const char * path)
+{
+	this->path = path;
+	pthread_mutex_init(&mutex, NULL);
+	records.alloc();
+
+	int fd = ::open(path, O_RDONLY);
+	if (fd < 0) return; // First run
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Cache_File_Header)) {
+		close(fd);
+		return;
+	}
+	map_size = st.st_size;
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		return;
+	}
+
+	const Cache_File_Header * header = (const Cache_File_Header *) map;
+	size_t table_size = header->entry_count * sizeof(Cache_File_Entry);
+	if (memcmp(header->magic, CACHE_MAGIC, 8) != 0
+		|| header->version != CACHE_VERSION
+		|| header->entry_count > map_size / sizeof(Cache_File_Entry)
+		|| sizeof(Cache_File_Header) + table_size > map_size) {
+		// Unreadable caches are ignored and overwritten at exit
+		munmap(map, map_size);
+		map = NULL;
+		return;
+	}
+	file_entries = (const Cache_File_Entry *) (header + 1);
+	file_entry_count = header->entry_count;
+	file_data = (const char *) map + sizeof(Cache_File_Header) + table_size;
+	file_data_size = map_size - sizeof(Cache_File_Header) - table_size;
+}
+
+bool Result_Cache::lookup(Cache_Key key, Value * out)
+{
+	__atomic_add_fetch(&stats.cache_lookups, 1, __ATOMIC_RELAXED);
+	size_t low = 0, high = file_entry_count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (file_entries[mid].key < key.key) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	// Entries whose keys collide sit next to each other
+	while (low < file_entry_count && file_entries[low].key == key.key
+		   && file_entries[low].check != key.check) {
+		low++;
+	}
+	if (low == file_entry_count || file_entries[low].key != key.key) return false;
+
+	const Cache_File_Entry * entry = &file_entries[low];
+	if (entry->offset > file_data_size || entry->length > file_data_size - entry->offset) {
+		return false;
+	}
+	const char * cursor = file_data + entry->offset;
+	if (!deserialize_value(&cursor, cursor + entry->length, out)) return false;
+
+	pthread_mutex_lock(&mutex);
+	records.push((Cache_Record) { key, file_data + entry->offset, entry->length, false });
+	pthread_mutex_unlock(&mutex);
+	__atomic_add_fetch(&stats.cache_hits, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+// Stores the result of a job of the given number of commands, unless it
+// is too large to be worth loading instead of running the job
+void Result_Cache::store(Cache_Key key, Value value, size_t commands)
+{
+	size_t budget = CACHE_MIN_ENTRY_SIZE + CACHE_BYTES_PER_COMMAND * commands;
+	if (!serialized_size_within(value, &budget)) {
+		__atomic_add_fetch(&stats.cache_too_large, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	Memory_Scope scope(MEM_CACHE);
+	List<char> bytes;
+	bytes.alloc();
+	serialize_value(value, &bytes);
+	pthread_mutex_lock(&mutex);
+	records.push((Cache_Record) { key, bytes.arr, bytes.size, true });
+	pthread_mutex_unlock(&mutex);
+}
+
+static int compare_records(const void * a, const void * b)
+{
+	Cache_Key x = ((Cache_Record *) a)->key;
+	Cache_Key y = ((Cache_Record *) b)->key;
+	if (x.key != y.key) return x.key < y.key ? -1 : 1;
+	return x.check < y.check ? -1 : x.check > y.check;
+}
+
+// Writes the records gathered this run to a temporary file and renames
+// it over the cache, so an interrupted save leaves the old cache intact.
+void Result_Cache::save()
+{
+	qsort(records.arr, records.size, sizeof(Cache_Record), compare_records);
+	size_t unique = 0;
+	for (int i = 0; i < records.size; i++) {
+		if (unique > 0 && records[unique - 1].key.key == records[i].key.key
+			&& records[unique - 1].key.check == records[i].key.check) {
+			if (records[i].owned) mem_free((void *) records[i].bytes);
+			continue;
+		}
+		records[unique++] = records[i];
+	}
+
+	List<char> tmp_path;
+	tmp_path.alloc();
+	tmp_path.push_array(path, strlen(path));
+	tmp_path.push_array(".tmp", 5);
+	FILE * file = fopen(tmp_path.arr, "wb");
+	if (!file) {
+		fatal("Could not write cache file %s", tmp_path.arr);
+	}
+
+	Cache_File_Header header;
+	memcpy(header.magic, CACHE_MAGIC, 8);
+	header.version = CACHE_VERSION;
+	header.reserved = 0;
+	header.entry_count = unique;
+	fwrite(&header, sizeof(header), 1, file);
+	uint64_t offset = 0;
+	for (size_t i = 0; i < unique; i++) {
+		Cache_File_Entry entry = { records[i].key.key, records[i].key.check, offset, records[i].length };
+		fwrite(&entry, sizeof(entry), 1, file);
+		offset += records[i].length;
+	}
+	for (size_t i = 0; i < unique; i++) {
+		fwrite(records[i].bytes, 1, records[i].length, file);
+	}
+	bool failed = ferror(file);
+	failed = fclose(file) != 0 || failed;
+	if (failed || rename(tmp_path.arr, path) != 0) {
+		fatal("Could not write cache file %s", path);
+	}
+	tmp_path.dealloc();
+
+	for (size_t i = 0; i < unique; i++) {
+		if (records[i].owned) mem_free((void *) records[i].bytes);
+	}
+	records.dealloc();
+	if (map) munmap(map, map_size);
+}
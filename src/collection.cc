@@ -11,7 +11,7 @@ namespace Collector {
 	void * alloc(size_t size)
 	{
 		Allocation allocation;
-		allocation.ptr = malloc(size);
+		allocation.ptr = mem_alloc(size, MEM_VALUES);
 		allocation.mark = false;
 		allocations.push(allocation);
 		return allocation.ptr;
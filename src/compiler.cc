@@ -1,16 +1,50 @@
+// Built-ins that can be evaluated any number of times, or not at all,
+// without changing what the program does
+bool builtin_is_pure(const char * symbol)
+{
+	return strcmp(symbol, "output") != 0;
+}
+
+bool expr_is_pure(Expr * expr)
+{
+	if (expr->type == EXPR_FUNCALL && !builtin_is_pure(expr->funcall.symbol)) {
+		return false;
+	}
+	for (int i = 0; i < expr->child_count(); i++) {
+		if (!expr_is_pure(expr->child(i))) return false;
+	}
+	return true;
+}
+
 struct Compiler {
 	List<Command> commands;
+	// Variable whose binding this job may take ownership of, because
+	// the job rebinds it and is the frame's only reader of it
+	const char * move_symbol;
 	void init()
 	{
 		commands.alloc();
+		move_symbol = NULL;
 	}
 	void dealloc()
 	{
 		commands.dealloc();
 	}
 	void compile_expression(Expr * expr);
+	void compile_builtin_arguments(Expr * funcall, int expected);
 };
 
+void Compiler::compile_builtin_arguments(Expr * funcall, int expected)
+{
+	if (funcall->funcall.arguments.size != expected) {
+		fatal("%s expects %d arguments, got %zu", funcall->funcall.symbol,
+			  expected, funcall->funcall.arguments.size);
+	}
+	for (int i = 0; i < expected; i++) {
+		compile_expression(funcall->funcall.arguments[i]);
+	}
+}
+
 void Compiler::compile_expression(Expr * expr)
 {
 	switch (expr->type) {
@@ -26,7 +60,6 @@ void Compiler::compile_expression(Expr * expr)
 		commands.push(cmd);
 	} break;
 	case EXPR_TUPLE: {
-		Value value = Value::with_type(VALUE_TUPLE);
 		for (int i = 0; i < expr->tuple.size; i++) {
 			compile_expression(expr->tuple[i]);
 		}
@@ -35,10 +68,16 @@ void Compiler::compile_expression(Expr * expr)
 		commands.push(cmd);
 	} break;
 	case EXPR_VARIABLE: {
-		Command cmd = Command::with_type(CMD_LOOKUP);
+		bool move = move_symbol && strcmp(move_symbol, expr->variable) == 0;
+		Command cmd = Command::with_type(move ? CMD_LOOKUP_MOVE : CMD_LOOKUP);
 		cmd.lookup.symbol = expr->variable;
 		commands.push(cmd);
 	} break;
+	case EXPR_SLOT: {
+		Command cmd = Command::with_type(CMD_LOAD_SLOT);
+		cmd.load_slot.slot = expr->slot;
+		commands.push(cmd);
+	} break;
 	case EXPR_UNARY: {
 		compile_expression(expr->unary.expr);
 		Command cmd = Command::with_type(CMD_UNARY_OP);
@@ -62,6 +101,15 @@ void Compiler::compile_expression(Expr * expr)
 			Command result = Command::with_type(CMD_LOAD_CONST);
 			result.load_const.constant = Value::make_integer(expr->funcall.arguments.size);
 			commands.push(result);
+		} else if (strcmp(expr->funcall.symbol, "index") == 0) {
+			compile_builtin_arguments(expr, 2);
+			commands.push(Command::with_type(CMD_INDEX));
+		} else if (strcmp(expr->funcall.symbol, "slice") == 0) {
+			compile_builtin_arguments(expr, 3);
+			commands.push(Command::with_type(CMD_SLICE));
+		} else if (strcmp(expr->funcall.symbol, "length") == 0) {
+			compile_builtin_arguments(expr, 1);
+			commands.push(Command::with_type(CMD_LENGTH));
 		} else {
 			fatal("Function %s unbound", expr->funcall.symbol);
 		}
@@ -0,0 +1,156 @@
+// Frame-level common subexpression elimination
+//
+// Every job in a frame reads the same committed variable space, so any
+// side-effect free subexpression evaluates to the same value wherever
+// it appears in the frame. Subexpressions that appear more than once
+// are hoisted into precompute jobs that run first, and every occurrence
+// is replaced by a reference to the precomputed result.
+
+struct Cse_Entry {
+	Expr * expr;
+	uint64_t hash;
+	size_t count;
+	int slot;
+};
+
+// One per visited expression, in post-order, so the subtree rooted at
+// node i covers nodes [i - size + 1, i].
+struct Cse_Node {
+	Expr * expr;
+	int entry;
+	size_t size;
+};
+
+struct Cse_Pass {
+	List<Cse_Entry> entries;
+	List<int> buckets;
+	List<Cse_Node> nodes;
+	void init();
+	void dealloc();
+	int find_or_add(Expr * expr, uint64_t hash);
+	void grow_buckets();
+	uint64_t visit(Expr * expr, bool * pure);
+	void run(List<Job_Spec*> frame, List<Expr*> * hoisted);
+};
+
+void Cse_Pass::init()
+{
+	entries.alloc();
+	nodes.alloc();
+	buckets.alloc();
+	for (int i = 0; i < 16; i++) buckets.push(-1);
+}
+
+void Cse_Pass::dealloc()
+{
+	entries.dealloc();
+	nodes.dealloc();
+	buckets.dealloc();
+}
+
+void Cse_Pass::grow_buckets()
+{
+	size_t new_size = buckets.size * 2;
+	buckets.clear();
+	for (size_t i = 0; i < new_size; i++) buckets.push(-1);
+	size_t mask = new_size - 1;
+	for (int i = 0; i < entries.size; i++) {
+		size_t b = entries[i].hash & mask;
+		while (buckets[b] != -1) b = (b + 1) & mask;
+		buckets[b] = i;
+	}
+}
+
+int Cse_Pass::find_or_add(Expr * expr, uint64_t hash)
+{
+	size_t mask = buckets.size - 1;
+	size_t b = hash & mask;
+	while (buckets[b] != -1) {
+		Cse_Entry * entry = &entries[buckets[b]];
+		if (entry->hash == hash && entry->expr->equals(expr)) {
+			entry->count++;
+			return buckets[b];
+		}
+		b = (b + 1) & mask;
+	}
+	int index = entries.size;
+	entries.push((Cse_Entry) { expr, hash, 1, -1 });
+	buckets[b] = index;
+	if (entries.size * 2 > buckets.size) grow_buckets();
+	return index;
+}
+
+// Records expr and its subtrees in post-order and returns expr's hash.
+// Leaves are never worth hoisting, nor is anything with side effects.
+uint64_t Cse_Pass::visit(Expr * expr, bool * pure)
+{
+	size_t start = nodes.size;
+	uint64_t hash = expr->local_hash();
+	*pure = !(expr->type == EXPR_FUNCALL && !builtin_is_pure(expr->funcall.symbol));
+	for (int i = 0; i < expr->child_count(); i++) {
+		bool child_pure;
+		hash = hash_combine(hash, visit(expr->child(i), &child_pure));
+		*pure = *pure && child_pure;
+	}
+	bool candidate = *pure && expr->child_count() > 0;
+	Cse_Node node;
+	node.expr = expr;
+	node.entry = candidate ? find_or_add(expr, hash) : -1;
+	node.size = nodes.size - start + 1;
+	nodes.push(node);
+	return hash;
+}
+
+// Rewrites the frame's expressions in place and appends the hoisted
+// subexpressions to hoisted, indexed by slot.
+void Cse_Pass::run(List<Job_Spec*> frame, List<Expr*> * hoisted)
+{
+	List<size_t> roots;
+	roots.alloc();
+	for (int i = 0; i < frame.size; i++) {
+		bool pure;
+		visit(frame[i]->right, &pure);
+		roots.push(nodes.size - 1);
+	}
+
+	// Walk each job's nodes from the root down, so only the largest
+	// shared subtrees are hoisted and their insides are skipped.
+	size_t end = 0;
+	for (int j = 0; j < roots.size; j++) {
+		size_t begin = end;
+		end = roots[j] + 1;
+		for (size_t i = end; i > begin;) {
+			Cse_Node node = nodes[i - 1];
+			if (node.entry == -1 || entries[node.entry].count < 2) {
+				i--;
+				continue;
+			}
+			Cse_Entry * entry = &entries[node.entry];
+			if (entry->slot == -1) {
+				size_t size = Expr::size_for(node.expr->type);
+				Expr * copy = (Expr*) mem_alloc(size);
+				memcpy(copy, node.expr, size);
+				entry->slot = hoisted->size;
+				hoisted->push(copy);
+				__atomic_add_fetch(&stats.cse_hoisted, 1, __ATOMIC_RELAXED);
+			}
+			node.expr->type = EXPR_SLOT;
+			node.expr->slot = entry->slot;
+			__atomic_add_fetch(&stats.cse_hits, 1, __ATOMIC_RELAXED);
+			i -= node.size;
+		}
+	}
+	roots.dealloc();
+}
+
+// Returns the precompute expressions for the frame, indexed by slot.
+List<Expr*> eliminate_common_subexpressions(List<Job_Spec*> frame)
+{
+	List<Expr*> hoisted;
+	hoisted.alloc();
+	Cse_Pass pass;
+	pass.init();
+	pass.run(frame, &hoisted);
+	pass.dealloc();
+	return hoisted;
+}
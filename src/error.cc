@@ -15,11 +15,23 @@
 #define INVERTED(x) SET_INVERTED x RESET
 #define RED(x)  SET_RED x RESET
 
+// A thread that sets fatal_recovery gets errors back through it instead
+// of the process exiting, with the message left in fatal_message. The
+// server sets it so that a failing frame only fails its own session.
+// Internal errors always exit.
+thread_local jmp_buf * fatal_recovery = NULL;
+thread_local char fatal_message[512];
+
 void fatal(const char * fmt, ...)
 {
 	va_list args;
 	va_start(args, fmt);
 
+	if (fatal_recovery) {
+		vsnprintf(fatal_message, sizeof(fatal_message), fmt, args);
+		va_end(args);
+		longjmp(*fatal_recovery, 1);
+	}
 	fprintf(stderr, RED(BOLD("encountered error")) ":\n");
 	vfprintf(stderr, fmt, args);
 	printf("\n");
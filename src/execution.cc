@@ -1,23 +1,158 @@
+// A job is built either from a parsed Job_Spec, which run_job compiles
+// on the worker that picks it up, or from commands loaded precompiled
+// out of a bytecode file, in which case spec is NULL.
 struct Job {
 	Job_Spec * spec;
+	// Variable the result is assigned to, or NULL for _
+	const char * left;
+	// Index into Execution_Context::slots for precompute jobs, which
+	// store their result there instead of assigning it, or -1
+	int slot;
+	List<Command> commands;
+	bool compiled;
+	// Set by find_movable_bindings() when this job may consume the
+	// current binding of the symbol it assigns
+	const char * move_symbol;
+	// Set by run_job() when specialize_types() proves every value the
+	// job handles is an integer
+	bool integer_only;
+	size_t integer_depth;
+	// Estimated by estimate_cost() when jobs are scheduled by cost, and
+	// the position the job had in its frame
+	size_t cost;
+	size_t order;
+	static Job * make(Job_Spec * spec, int slot)
+	{
+		Job * job = (Job*) mem_alloc(sizeof(Job), MEM_JOBS);
+		job->spec = spec;
+		job->left = spec->left;
+		job->slot = slot;
+		job->compiled = false;
+		job->move_symbol = NULL;
+		job->integer_only = false;
+		job->cost = 0;
+		return job;
+	}
+	static Job * make_compiled(const char * left, int slot, List<Command> commands)
+	{
+		Job * job = (Job*) mem_alloc(sizeof(Job), MEM_JOBS);
+		job->spec = NULL;
+		job->left = left;
+		job->slot = slot;
+		job->commands = commands;
+		job->compiled = true;
+		job->move_symbol = NULL;
+		job->integer_only = false;
+		job->cost = 0;
+		return job;
+	}
+	void compile();
+	void collect_reads(List<const char *> * out);
+	bool is_pure();
+	bool reads_slots();
+	void dealloc()
+	{
+		if (compiled) commands.dealloc();
+		mem_free(this);
+	}
 };
 
-struct Job_Queue_Node {
-	Job * job;
-	Job_Queue_Node * prev;
-};
+void Job::compile()
+{
+	if (!compiled) {
+		Memory_Scope scope(MEM_COMPILER);
+		Compiler compiler;
+		compiler.init();
+		compiler.move_symbol = move_symbol;
+		compiler.compile_expression(spec->right);
+		commands = compiler.commands;
+		compiled = true;
+	} else if (move_symbol) {
+		for (int i = 0; i < commands.size; i++) {
+			if (commands[i].type == CMD_LOOKUP
+				&& strcmp(commands[i].lookup.symbol, move_symbol) == 0) {
+				commands[i].type = CMD_LOOKUP_MOVE;
+			}
+		}
+	}
+}
 
+void Job::collect_reads(List<const char *> * out)
+{
+	if (!compiled) {
+		spec->right->collect_variables(out);
+		return;
+	}
+	// Superinstructions read variables too, once fusion has run
+	for (int i = 0; i < commands.size; i++) {
+		Command * cmd = &commands.arr[i];
+		switch (cmd->type) {
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			out->push(cmd->lookup.symbol);
+			break;
+		case CMD_INT_OP_VAR:
+			out->push(cmd->int_op_var.symbol);
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			out->push(cmd->int_var_op_var.left);
+			out->push(cmd->int_var_op_var.right);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+bool Job::is_pure()
+{
+	if (!compiled) return expr_is_pure(spec->right);
+	for (int i = 0; i < commands.size; i++) {
+		if (commands[i].type == CMD_OUTPUT) return false;
+	}
+	return true;
+}
+
+static bool expr_reads_slots(Expr * expr)
+{
+	if (expr->type == EXPR_SLOT) return true;
+	for (int i = 0; i < expr->child_count(); i++) {
+		if (expr_reads_slots(expr->child(i))) return true;
+	}
+	return false;
+}
+
+bool Job::reads_slots()
+{
+	if (!compiled) return expr_reads_slots(spec->right);
+	for (int i = 0; i < commands.size; i++) {
+		if (commands[i].type == CMD_LOAD_SLOT) return true;
+	}
+	return false;
+}
+
+#define JOB_BATCH_SIZE 64
+// Batches are cut short once they would cost more than this, so a
+// worker never holds on to much more work than the others can steal
+#define JOB_BATCH_COST 1024
+
+// Jobs are handed out in the order they were added, several at a time
+// while their estimated cost stays small, so cheap jobs don't pay a
+// lock round-trip each
 struct Job_Queue {
 	pthread_mutex_t mutex;
-	Job_Queue_Node * head = NULL;
-	Job_Queue_Node * tail = NULL;
-	Job_Queue()
+	List<Job*> jobs;
+	size_t next;
+	void init()
 	{
 		pthread_mutex_init(&mutex, NULL);
+		jobs.alloc();
+		next = 0;
 	}
-	~Job_Queue()
+	void dealloc()
 	{
 		pthread_mutex_destroy(&mutex);
+		jobs.dealloc();
 	}
 	void lock()
 	{
@@ -29,149 +164,500 @@ struct Job_Queue {
 	}
 	void add(Job * job)
 	{
-		if (!head || !tail) {
-			assert(!head && !tail);
-			Job_Queue_Node * node = (Job_Queue_Node*) malloc(sizeof(Job_Queue_Node));
-			node->job = job;
-			node->prev = NULL;
-			head = node;
-			tail = node;
-		} else {
-			Job_Queue_Node * node = (Job_Queue_Node*) malloc(sizeof(Job_Queue_Node));
-			node->job = job;
-			node->prev = NULL;
-			tail->prev = node;
-			tail = node;
-		}
+		jobs.push(job);
 	}
-	Job * take()
+	// Moves the next job and as many after it as fit in a batch of at
+	// most max to out, and returns how many were taken
+	size_t take(Job ** out, size_t max)
 	{
 		assert(!empty());
-		Job * ret = head->job;
-		head = head->prev;
-		if (!head) {
-			tail = NULL;
-		}
-		return ret;
+		size_t count = 0;
+		size_t cost = 0;
+		do {
+			cost += jobs.arr[next]->cost;
+			out[count++] = jobs.arr[next++];
+		} while (next < jobs.size && count < max
+				 && cost + jobs.arr[next]->cost <= JOB_BATCH_COST);
+		return count;
 	}
 	bool empty()
 	{
-		if (!head || !tail) {
-			assert(!head && !tail);
-			return true;
-		}
-		return false;
+		return next == jobs.size;
+	}
+	void clear()
+	{
+		jobs.clear();
+		next = 0;
 	}
 };
 
-struct Variable_Space {
-	List<const char *> keys;
-	List<Value> values;
-	void init()
-	{
-		keys.alloc();
-		values.alloc();
+// Rough cost of running a job: one per node or command, plus the width
+// of every tuple it reads, since most tuple operations walk their
+// operands. Only used to order and batch jobs, so it needn't be exact.
+static size_t expr_cost(Expr * expr, Variable_Space * space)
+{
+	size_t cost = 1;
+	if (expr->type == EXPR_VARIABLE) {
+		Value * value = space->find(expr->variable);
+		if (value && value->type == VALUE_TUPLE) cost += value->tuple.length;
 	}
-	void bind(const char * key, Value value)
-	{
-		for (int i = 0; i < keys.size; i++) {
-			if (strcmp(keys[i], key) == 0) {
-				values[i] = value;
-				return;
-			}
+	for (int i = 0; i < expr->child_count(); i++) {
+		cost += expr_cost(expr->child(i), space);
+	}
+	return cost;
+}
+
+size_t estimate_cost(Job * job, Variable_Space * space)
+{
+	if (!job->compiled) return expr_cost(job->spec->right, space);
+	size_t cost = job->commands.size;
+	for (int i = 0; i < job->commands.size; i++) {
+		Command * cmd = &job->commands.arr[i];
+		if (cmd->type != CMD_LOOKUP && cmd->type != CMD_LOOKUP_MOVE) continue;
+		Value * value = space->find(cmd->lookup.symbol);
+		if (value && value->type == VALUE_TUPLE) cost += value->tuple.length;
+	}
+	return cost;
+}
+
+static int compare_job_costs(const void * a, const void * b)
+{
+	Job * left = *(Job**) a;
+	Job * right = *(Job**) b;
+	if (left->cost != right->cost) return left->cost < right->cost ? 1 : -1;
+	// Equal costs keep source order
+	return left->order < right->order ? -1 : left->order > right->order;
+}
+
+struct Execution_Context;
+void * scan_and_execute_from_queue(void *);
+size_t start_workers(double * fan_out_ns, double * ns_per_cost);
+void run_on_workers(Execution_Context * context);
+size_t send_to_processes(List<Job*> jobs);
+void receive_from_processes();
+bool make_thunk(Job * job, Value * out);
+Value run_register_vm(List<Command> commands, List<Assignment> * env);
+
+struct Variable_Reference {
+	const char * symbol;
+	size_t job_index;
+};
+
+static int compare_references(const void * a, const void * b)
+{
+	return strcmp(((Variable_Reference*) a)->symbol,
+				  ((Variable_Reference*) b)->symbol);
+}
+
+// A job that rebinds a variable nobody else in the frame reads can take
+// the old binding's reference instead of sharing it, which leaves a
+// tuple uniquely owned so the job can update it in place.
+void find_movable_bindings(List<Job*> jobs)
+{
+	List<Variable_Reference> references;
+	references.alloc();
+	List<const char *> symbols;
+	symbols.alloc();
+	for (int i = 0; i < jobs.size; i++) {
+		jobs[i]->move_symbol = NULL;
+		symbols.clear();
+		jobs[i]->collect_reads(&symbols);
+		for (int j = 0; j < symbols.size; j++) {
+			references.push((Variable_Reference) { symbols[j], (size_t) i });
 		}
-		keys.push(strdup(key));
-		values.push(value);
 	}
-	bool is_bound(const char * key)
-	{
-		for (int i = 0; i < keys.size; i++) {
-			if (strcmp(keys[i], key) == 0) {
-				return true;
-			}
+	symbols.dealloc();
+
+	qsort(references.arr, references.size, sizeof(Variable_Reference), compare_references);
+	for (int i = 0; i < references.size; i++) {
+		bool alone = (i == 0 || strcmp(references[i - 1].symbol, references[i].symbol) != 0)
+			&& (i == references.size - 1 || strcmp(references[i + 1].symbol, references[i].symbol) != 0);
+		if (!alone) continue;
+		Job * job = jobs[references[i].job_index];
+		if (job->left && strcmp(job->left, references[i].symbol) == 0) {
+			job->move_symbol = job->left;
 		}
-		return false;
 	}
-	Value lookup(const char * key)
-	{
-		for (int i = 0; i < keys.size; i++) {
-			if (strcmp(keys[i], key) == 0) {
-				return values[i];
-			}
+	references.dealloc();
+}
+
+// Turns a parsed frame into jobs, hoisting shared subexpressions into
+// precompute jobs. Jobs that --lazy will defer are left out of CSE, so
+// their subexpressions are never evaluated ahead of time.
+void prepare_frame(List<Job_Spec*> frame, List<Job*> * precompute, List<Job*> * jobs)
+{
+	Memory_Scope scope(MEM_COMPILER);
+	precompute->alloc();
+	jobs->alloc();
+	List<Job_Spec*> eager;
+	eager.alloc();
+	for (int i = 0; i < frame.size; i++) {
+		Job_Spec * spec = frame[i];
+		if (options.lazy && spec->left && expr_is_pure(spec->right)) {
+			jobs->push(Job::make(spec, -1));
+		} else {
+			eager.push(spec);
 		}
-		fatal("Tried to lookup unbound variable %s", key);
 	}
-};
+	if (options.cse) {
+		List<Expr*> hoisted = eliminate_common_subexpressions(eager);
+		for (int i = 0; i < hoisted.size; i++) {
+			Job_Spec * spec = (Job_Spec*) mem_alloc(sizeof(Job_Spec));
+			spec->left = NULL;
+			spec->right = hoisted[i];
+			precompute->push(Job::make(spec, i));
+		}
+		hoisted.dealloc();
+	}
+	for (int i = 0; i < eager.size; i++) {
+		jobs->push(Job::make(eager[i], -1));
+	}
+	eager.dealloc();
+}
 
-struct Assignment {
-	const char * symbol;
-	Value value;
+// A job may run against the previous frame's version while that
+// frame's commit is still building the next one if it reads nothing the
+// commit writes, and has no effect that would be seen out of order. A
+// read of an unbound variable would fail ahead of the frame's output,
+// so those wait too. Such jobs never move bindings, since the commit
+// reads the same version.
+static bool can_run_during_commit(Job * job, Assignment_Table * committing, Variable_Space * space)
+{
+	if (!job->is_pure() || job->reads_slots()) return false;
+	if (options.lazy && job->left) return false;
+	List<const char *> symbols;
+	symbols.alloc();
+	job->collect_reads(&symbols);
+	bool independent = true;
+	for (int i = 0; i < symbols.size && independent; i++) {
+		if (committing->contains(symbols[i]) || !space->is_bound(symbols[i])) {
+			independent = false;
+		}
+	}
+	symbols.dealloc();
+	if (job->compiled) {
+		for (int i = 0; i < job->commands.size; i++) {
+			if (job->commands[i].type == CMD_LOOKUP_MOVE) return false;
+		}
+	}
+	return independent;
+}
+
+struct Background_Commit {
+	Assignment_Table * table;
+	Variable_Version * base;
+	Variable_Version * result;
 };
 
-void * scan_and_execute_from_queue(void *);
+static void * run_background_commit(void * arg)
+{
+	Background_Commit * commit = (Background_Commit*) arg;
+	profile_slot = profiler.enabled ? profiler.commit_slot() : 0;
+	double start = profiler.now();
+	commit->result = commit_assignments(commit->table, commit->base, 1);
+	profiler.record("commit", NULL, start, profiler.now());
+	return NULL;
+}
 
 struct Execution_Context {
 	Job_Queue job_queue;
 	size_t cpu_count;
 	Variable_Space var_space;
+	// Assignments are double-buffered: while one frame publishes to
+	// one table, the other may still be committing the frame before
+	Assignment_Table tables[2];
+	Assignment_Table * assignments;
+	// Last frame's assignments if they are not committed yet, or NULL
+	Assignment_Table * pending;
+	// Results of the current frame's precompute jobs
+	List<Value> slots;
+	Parallelism_Policy parallelism;
+	// Where output: writes, which the server points at each session
+	FILE * output;
+	// Set when errors in jobs should fail the frame rather than exit,
+	// see run_job_recovering(). The first one is kept in error. Jobs in
+	// such contexts never move bindings, which a failed frame could not
+	// put back once they had been updated in place.
+	bool recover_errors;
+	bool failed;
+	char error[sizeof(fatal_message)];
+	// Only touched by the worker pool, under its lock: whether the
+	// context is waiting for the workers, and how many batches of its
+	// are running
+	bool queued;
+	size_t running_batches;
 	
 	void init()
 	{
+		output = stdout;
+		recover_errors = false;
+		failed = false;
+		queued = false;
+		running_batches = 0;
 		var_space.init();
-		cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+		tables[0].init();
+		tables[1].init();
+		assignments = &tables[0];
+		pending = NULL;
+		slots.alloc();
+		job_queue.init();
+		double fan_out_ns, ns_per_cost;
+		cpu_count = start_workers(&fan_out_ns, &ns_per_cost);
+		parallelism.init(cpu_count, fan_out_ns, ns_per_cost);
+	}
+	// Releases the variables and everything else the context holds. Its
+	// last frame must have been finished.
+	void dealloc()
+	{
+		var_space.current->release();
+		tables[0].dealloc();
+		tables[1].dealloc();
+		slots.dealloc();
+		job_queue.dealloc();
 	}
-	void run_threads_for_jobs(List<Job*> jobs) {
+	// Runs jobs, which publish their assignments to the assignment table
+	// as they go. With --processes, wide batches are partly sent to the
+	// worker processes and the rest run here meanwhile.
+	void run_threads_for_jobs(List<Job*> jobs, bool allow_moves = true) {
+		if (allow_moves && !recover_errors) find_movable_bindings(jobs);
+		size_t sent = send_to_processes(jobs);
+		jobs.size -= sent;
+		if (jobs.size > 0) run_jobs_here(jobs);
+		if (sent > 0) receive_from_processes();
+	}
+	// Cheap batches run on the calling thread, the rest across the
+	// worker threads
+	void run_jobs_here(List<Job*> jobs)
+	{
+		size_t total_cost = 0;
+		if (cpu_count > 1) {
+			for (int i = 0; i < jobs.size; i++) {
+				jobs[i]->cost = estimate_cost(jobs[i], &var_space);
+				jobs[i]->order = i;
+				total_cost += jobs[i]->cost;
+			}
+		}
+		bool fan_out = parallelism.should_fan_out(total_cost);
+		// With several workers, starting the costliest jobs first keeps
+		// one of them from finishing the frame alone. Only jobs too big
+		// to batch are moved, the rest keep their order behind them.
+		if (fan_out && options.schedule) {
+			List<Job*> small;
+			small.alloc();
+			size_t large = 0;
+			for (int i = 0; i < jobs.size; i++) {
+				Job * job = jobs[i];
+				if (job->cost > JOB_BATCH_COST) {
+					jobs[large++] = job;
+				} else {
+					small.push(job);
+				}
+			}
+			qsort(jobs.arr, large, sizeof(Job*), compare_job_costs);
+			memcpy(&jobs.arr[large], small.arr, sizeof(Job*) * small.size);
+			small.dealloc();
+		}
 		job_queue.lock();
 		for (int i = 0; i < jobs.size; i++) {
 			job_queue.add(jobs[i]);
 		}
 		job_queue.unlock();
-		
-		pthread_t * threads = (pthread_t*) malloc(sizeof(pthread_t) * cpu_count);
-		List<Assignment> all_assignments;
-		all_assignments.alloc();
-		
-		for (int i = 0; i < cpu_count; i++) {
-			pthread_create(threads + i, NULL, scan_and_execute_from_queue, NULL);
-		}
-		
-		for (int i = 0; i < cpu_count; i++) {
-			List<Assignment> * assignments;
-			pthread_join(threads[i], (void**) &assignments);
-			for (int i = 0; i < assignments->size; i++) {
-				all_assignments.push(assignments->at(i));
+
+		if (!fan_out) {
+			double start = monotonic_ns();
+			scan_and_execute_from_queue(NULL);
+			if (cpu_count > 1) parallelism.record_inline(total_cost, monotonic_ns() - start);
+			job_queue.clear();
+			__atomic_add_fetch(&stats.inline_batches, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		__atomic_add_fetch(&stats.worker_batches, 1, __ATOMIC_RELAXED);
+		double start = profiler.now();
+		double fan_out_start = monotonic_ns();
+		run_on_workers(this);
+		parallelism.record_fan_out(total_cost, monotonic_ns() - fan_out_start);
+		job_queue.clear();
+		if (profiler.enabled) {
+			double end = profiler.now();
+			profiler.record("batch", NULL, start, end, jobs.size);
+			// Time each worker that took part spent waiting for the
+			// slowest to finish
+			for (int i = 0; i < cpu_count; i++) {
+				double finished = profiler.buffers[i + 1].finished;
+				if (finished > start) profiler.record_for(i + 1, "barrier", finished, end);
 			}
-			assignments->dealloc();
 		}
-
-		List<const char *> symbols_seen;
-		symbols_seen.alloc();
-		for (int i = 0; i < all_assignments.size; i++) {
-			for (int j = 0; j < symbols_seen.size; j++) {
-				if (strcmp(symbols_seen[j], all_assignments[i].symbol) == 0) {
-					fatal("Tried to assign to variable '%s' multiple times in one frame",
-						  symbols_seen[j]);
+	}
+	// Commits the previous frame. If it is large and some of the jobs can
+	// run without it, they run on the old version while the new one is
+	// built, and are moved from jobs to early.
+	void commit_pending(List<Job*> * jobs, List<Job*> * early)
+	{
+		if (!pending) return;
+		Assignment_Table * table = pending;
+		pending = NULL;
+		if (jobs && table->count >= PARALLEL_COMMIT_THRESHOLD && cpu_count > 1) {
+			size_t kept = 0;
+			for (int i = 0; i < jobs->size; i++) {
+				Job * job = (*jobs)[i];
+				if (can_run_during_commit(job, table, &var_space)) {
+					early->push(job);
+				} else {
+					(*jobs)[kept++] = job;
 				}
 			}
-			symbols_seen.push(all_assignments[i].symbol);
+			jobs->size = kept;
+		}
+		if (early->size == 0) {
+			double start = profiler.now();
+			var_space.current = commit_assignments(table, var_space.current, cpu_count);
+			profiler.record("commit", NULL, start, profiler.now());
+			return;
+		}
+		Background_Commit commit = { table, var_space.snapshot(), NULL };
+		pthread_t writer;
+		pthread_create(&writer, NULL, run_background_commit, &commit);
+		run_threads_for_jobs(*early, false);
+		pthread_join(writer, NULL);
+		var_space.publish(commit.result);
+		__atomic_add_fetch(&stats.overlapped_jobs, early->size, __ATOMIC_RELAXED);
+	}
+	// Called by workers. Only the first error of a frame is kept.
+	void fail(const char * message)
+	{
+		bool expected = false;
+		if (!__atomic_compare_exchange_n(&failed, &expected, true, false,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			return;
+		}
+		snprintf(error, sizeof(error), "%s", message);
+	}
+	// Raises the error a job failed with once the jobs have all run,
+	// as the main thread would have
+	void raise_job_error()
+	{
+		if (failed) fatal("%s", error);
+	}
+	// Drops everything the frame that just failed had published, so it
+	// has no effect on the variables. Frames before it stay committed.
+	void discard_frame()
+	{
+		job_queue.clear();
+		assignments->discard();
+		for (int i = 0; i < slots.size; i++) {
+			slots[i].release();
+		}
+		slots.clear();
+		failed = false;
+	}
+	// Commits the last frame run, once there are no more to overlap with
+	void finish()
+	{
+		List<Job*> early;
+		early.alloc();
+		commit_pending(NULL, &early);
+		early.dealloc();
+	}
+	// Runs one frame: precompute jobs fill the frame's slots first, then
+	// the remaining jobs run. Their assignments are committed when the
+	// next frame starts, or by finish(). Takes ownership of the jobs.
+	void execute_frame(List<Job*> precompute, List<Job*> jobs)
+	{
+		Memory_Scope scope(MEM_JOBS);
+		// Only meaningful with a single context, like the rest of the
+		// profile
+		if (profiler.enabled) profiler.frame = stats.frames;
+		double start = profiler.now();
+		double bench_start = options.bench ? monotonic_ns() : 0;
+		size_t job_count = precompute.size + jobs.size;
+		__atomic_add_fetch(&stats.frames, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.jobs, jobs.size, __ATOMIC_RELAXED);
+		List<Job*> early;
+		early.alloc();
+		commit_pending(&jobs, &early);
+		raise_job_error();
+
+		// Deferred jobs capture their inputs before any eager job can
+		// move a binding out of the variable space.
+		List<Job*> eager;
+		eager.alloc();
+		for (int i = 0; i < jobs.size; i++) {
+			Job * job = jobs[i];
+			Value thunk;
+			if (options.lazy && job->left && job->is_pure() && !job->reads_slots()
+				&& make_thunk(job, &thunk)) {
+				assignments->publish(job->left, thunk);
+				job->dealloc();
+			} else {
+				eager.push(job);
+			}
 		}
-		symbols_seen.dealloc();
 
-		for (int i = 0; i < all_assignments.size; i++) {
-			var_space.bind(all_assignments[i].symbol,
-						   all_assignments[i].value);
+		if (precompute.size > 0) {
+			for (int i = 0; i < precompute.size; i++) {
+				slots.push(Value::with_type(VALUE_NIL));
+			}
+			run_threads_for_jobs(precompute);
+			raise_job_error();
 		}
-		
-		all_assignments.dealloc();
+		run_threads_for_jobs(eager);
+		raise_job_error();
+
+		if (assignments->conflict) {
+			fatal("Tried to assign to variable '%s' multiple times in one frame",
+				  assignments->conflict);
+		}
+		pending = assignments;
+		assignments = assignments == &tables[0] ? &tables[1] : &tables[0];
+
+		for (int i = 0; i < precompute.size; i++) {
+			mem_free(precompute[i]->spec);
+			precompute[i]->dealloc();
+		}
+		for (int i = 0; i < early.size; i++) {
+			early[i]->dealloc();
+		}
+		early.dealloc();
+		for (int i = 0; i < eager.size; i++) {
+			eager[i]->dealloc();
+		}
+		eager.dealloc();
+		for (int i = 0; i < slots.size; i++) {
+			slots[i].release();
+		}
+		slots.clear();
+		profiler.end_frame(start, profiler.now(), job_count);
+		if (options.bench) {
+			bench_timer.record_frame(monotonic_ns() - bench_start);
+		}
+		if (memory_stats.enabled) memory_stats.end_frame(stats.frames - 1);
+	}
+	void run_frame(List<Job_Spec*> frame)
+	{
+		List<Job*> precompute, jobs;
+		double start = profiler.now();
+		prepare_frame(frame, &precompute, &jobs);
+		profiler.record("prepare", NULL, start, profiler.now());
+		execute_frame(precompute, jobs);
+		precompute.dealloc();
+		jobs.dealloc();
 	}
 };
 
-Execution_Context exec_context;
+// Context of the frame the thread is running jobs for. Set by whoever
+// runs frames, and by pool workers for each batch they take.
+thread_local Execution_Context * exec_context = NULL;
+
+// Stack slots held in the VM itself, enough for nearly every job, so
+// running a job needs no allocation for its stack
+#define VM_INLINE_STACK 16
 
 struct VM {
-	List<Value> stack;
+	List<Value, VM_INLINE_STACK> stack;
 	List<Command> commands;
 	size_t counter = 0;
+	// Bindings captured by a thunk, read instead of the variable space
+	List<Assignment> * env = NULL;
 	void init(List<Command> commands)
 	{
 		stack.alloc();
@@ -181,130 +667,870 @@ struct VM {
 	{
 		stack.dealloc();
 	}
+	Value lookup(const char * symbol);
 	void execute();
+	int execute_integer(size_t depth);
+};
+
+// Forcing a thunk forces the unforced thunks it captured first, one
+// level of native recursion each, so chains of them are kept this short
+#define THUNK_MAX_DEPTH 256
+
+// A deferred job result. It holds the bindings its expression reads as
+// they were when its frame ran, and is evaluated at most once, by
+// whichever thread first looks it up.
+struct Thunk {
+	size_t refcount;
+	pthread_mutex_t mutex;
+	List<Command> commands;
+	List<Assignment> env;
+	// Longest chain of unforced thunks below this one when it was made
+	size_t depth;
+	bool forced;
+	Value result;
 };
 
+void thunk_retain(Thunk * thunk)
+{
+	__atomic_add_fetch(&thunk->refcount, 1, __ATOMIC_RELAXED);
+}
+
+// Thunks freed here release the thunks they captured, which can be a
+// chain as long as the script, so they are freed from a worklist rather
+// than by recursion
+void thunk_release(Thunk * thunk)
+{
+	if (__atomic_sub_fetch(&thunk->refcount, 1, __ATOMIC_ACQ_REL) != 0) return;
+	List<Thunk*> dead;
+	dead.alloc();
+	dead.push(thunk);
+	while (dead.size > 0) {
+		thunk = dead.pop();
+		for (int i = 0; i < thunk->env.size; i++) {
+			Value value = thunk->env[i].value;
+			if (value.type == VALUE_THUNK) {
+				if (__atomic_sub_fetch(&value.thunk->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+					dead.push(value.thunk);
+				}
+			} else {
+				value.release();
+			}
+		}
+		thunk->env.dealloc();
+		thunk->commands.dealloc();
+		if (thunk->forced) thunk->result.release();
+		pthread_mutex_destroy(&thunk->mutex);
+		mem_free(thunk);
+	}
+	dead.dealloc();
+}
+
+// Defers the job, taking over its commands, compiling them first if
+// needed. Captured thunks that have already been forced are replaced by
+// their results. Returns false, leaving the job as it was, if the thunk
+// would end a chain longer than THUNK_MAX_DEPTH; the job then runs
+// eagerly, forcing the chain below it while it is still short.
+bool make_thunk(Job * job, Value * out)
+{
+	job->compile();
+	List<Assignment> env;
+	env.alloc();
+	size_t depth = 0;
+
+	List<const char *> symbols;
+	symbols.alloc();
+	job->collect_reads(&symbols);
+	for (int i = 0; i < symbols.size; i++) {
+		bool captured = false;
+		for (int j = 0; j < env.size; j++) {
+			if (strcmp(env[j].symbol, symbols[i]) == 0) captured = true;
+		}
+		if (captured) continue;
+		Value value = exec_context->var_space.lookup(symbols[i]);
+		if (value.type == VALUE_THUNK) {
+			Thunk * below = value.thunk;
+			if (__atomic_load_n(&below->forced, __ATOMIC_ACQUIRE)) {
+				value = below->result;
+			} else if (below->depth + 1 > depth) {
+				depth = below->depth + 1;
+			}
+		}
+		value.retain();
+		env.push((Assignment) { symbols[i], value });
+	}
+	symbols.dealloc();
+	if (depth > THUNK_MAX_DEPTH) {
+		for (int i = 0; i < env.size; i++) {
+			env[i].value.release();
+		}
+		env.dealloc();
+		return false;
+	}
+
+	Thunk * thunk = (Thunk*) mem_alloc(sizeof(Thunk), MEM_JOBS);
+	thunk->refcount = 1;
+	pthread_mutex_init(&thunk->mutex, NULL);
+	thunk->forced = false;
+	thunk->env = env;
+	thunk->depth = depth;
+	thunk->commands = job->commands;
+	job->compiled = false;
+
+	__atomic_add_fetch(&stats.thunks_created, 1, __ATOMIC_RELAXED);
+	*out = Value::with_type(VALUE_THUNK);
+	out->thunk = thunk;
+	return true;
+}
+
+// Returns an owned reference to the thunk's result, evaluating it first
+// if nothing has yet. The captured bindings are dropped once it has run.
+Value force_thunk(Thunk * thunk)
+{
+	pthread_mutex_lock(&thunk->mutex);
+	// A thunk that fails is left unforced, and fails again when next
+	// looked up
+	jmp_buf recovery;
+	jmp_buf * outer = fatal_recovery;
+	if (outer) {
+		if (setjmp(recovery)) {
+			fatal_recovery = outer;
+			pthread_mutex_unlock(&thunk->mutex);
+			longjmp(*outer, 1);
+		}
+		fatal_recovery = &recovery;
+	}
+	if (!thunk->forced) {
+		__atomic_add_fetch(&stats.vm_commands_unfused, thunk->commands.size, __ATOMIC_RELAXED);
+		if (options.vm == VM_REGISTER) {
+			thunk->result = run_register_vm(thunk->commands, &thunk->env);
+		} else {
+			__atomic_add_fetch(&stats.vm_commands, thunk->commands.size, __ATOMIC_RELAXED);
+			VM vm;
+			vm.init(thunk->commands);
+			vm.env = &thunk->env;
+			vm.execute();
+			assert(vm.stack.size == 1);
+			thunk->result = vm.stack.pop();
+			vm.dealloc();
+		}
+		thunk->result.share();
+
+		for (int i = 0; i < thunk->env.size; i++) {
+			thunk->env[i].value.release();
+		}
+		thunk->env.clear();
+		// Read without the lock by make_thunk()
+		__atomic_store_n(&thunk->forced, true, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&stats.thunks_forced, 1, __ATOMIC_RELAXED);
+	}
+	fatal_recovery = outer;
+	Value result = thunk->result;
+	result.retain();
+	pthread_mutex_unlock(&thunk->mutex);
+	return result;
+}
+
+// Returns an owned reference to the value bound to symbol, forcing it
+// if it was deferred. Thunks pass the bindings they captured as env.
+Value lookup_binding(const char * symbol, List<Assignment> * env)
+{
+	Value value;
+	if (env) {
+		bool found = false;
+		for (int i = 0; i < env->size; i++) {
+			if (strcmp((*env)[i].symbol, symbol) == 0) {
+				value = (*env)[i].value;
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			fatal_internal("Thunk did not capture variable %s", symbol);
+		}
+	} else {
+		value = exec_context->var_space.lookup(symbol);
+	}
+	if (value.type == VALUE_THUNK) {
+		return force_thunk(value.thunk);
+	}
+	value.retain();
+	return value;
+}
+
+Value VM::lookup(const char * symbol)
+{
+	return lookup_binding(symbol, env);
+}
+
 void VM::execute()
 {
+#ifdef SYNC_VM_STATS
+	vm_stats.begin_job(commands.size, stack.capacity);
+#endif
 	while (counter < commands.size) {
 		Command cmd = commands[counter++];
+#ifdef SYNC_VM_STATS
+		vm_stats.dispatch(&cmd, stack.size, stack.capacity);
+#endif
 		switch (cmd.type) {
 		case CMD_LOAD_CONST:
 			stack.push(cmd.load_const.constant);
 			break;
 		case CMD_LOOKUP:
-			stack.push(exec_context.var_space.lookup(cmd.lookup.symbol));
+			stack.push(lookup(cmd.lookup.symbol));
 			break;
-		case CMD_UNARY_OP: {
-			switch (cmd.unary_op.op) {
-			case UNARY_MINUS: {
-				Value pop = stack.pop();
-				assert(pop.type == VALUE_INTEGER);
-				pop.integer *= -1;
-				stack.push(pop);
-			} break;
-			default:
-				fatal_internal("Invalid unary operator reached VM::execute()");
+		case CMD_LOOKUP_MOVE: {
+			Value value = exec_context->var_space.take(cmd.lookup.symbol);
+			if (value.type == VALUE_THUNK) {
+				Value result = force_thunk(value.thunk);
+				value.release();
+				value = result;
 			}
+			stack.push(value);
+		} break;
+		case CMD_UNARY_OP: {
+			Value operand = stack.pop();
+			stack.push(apply_unary(cmd.unary_op.op, operand));
 		} break;
 		case CMD_BINARY_OP: {
-			switch (cmd.binary_op.op) {
-			case BINARY_PLUS: {
-				Value right = stack.pop();
-				Value left = stack.pop();
-				assert(right.type == VALUE_INTEGER &&
-					   left.type == VALUE_INTEGER);
-				Value result = Value::make_integer(left.integer + right.integer);
-				stack.push(result);
-			} break;
-			case BINARY_MINUS: {
-				Value right = stack.pop();
-				Value left = stack.pop();
-				assert(right.type == VALUE_INTEGER &&
-					   left.type == VALUE_INTEGER);
-				Value result = Value::make_integer(left.integer - right.integer);
-				stack.push(result);
-			} break;
-			case BINARY_MULTIPLY: {
-				Value right = stack.pop();
-				Value left = stack.pop();
-				assert(right.type == VALUE_INTEGER &&
-					   left.type == VALUE_INTEGER);
-				Value result = Value::make_integer(left.integer * right.integer);
-				stack.push(result);
-			} break;
-			case BINARY_DIVIDE: {
-				Value right = stack.pop();
-				Value left = stack.pop();
-				assert(right.type == VALUE_INTEGER &&
-					   left.type == VALUE_INTEGER);
-				Value result = Value::make_integer(left.integer / right.integer);
-				stack.push(result);
-			} break;
-			default:
-				fatal_internal("Invalid binary operator reached VM::execute()");
-			}
+			Value right = stack.pop();
+			Value left = stack.pop();
+			stack.push(apply_binary(cmd.binary_op.op, left, right));
 		} break;
 		case CMD_OUTPUT: {
-			char * s = stack.pop().to_string();
-			printf("%s\n", s);
-			free(s);
+			// Each thread keeps one builder around so output never
+			// allocates once it has grown to fit the largest line.
+			static thread_local String_Builder line;
+			line.clear();
+			Value value = stack.pop();
+			value.format(&line);
+			value.release();
+			line.append_char('\n');
+			fwrite(line.builder.arr, 1, line.builder.size, exec_context->output);
 		} break;
 		case CMD_MAKE_TUPLE: {
 			size_t length = cmd.make_tuple.length;
-			Value * elements = (Value*) malloc(sizeof(Value) * length);
+			Tuple * tuple = Tuple::make(length);
 			for (int i = length - 1; i >= 0; i--) {
-				elements[i] = stack.pop();
+				tuple->elements[i] = stack.pop();
 			}
-			Value value = Value::with_type(VALUE_TUPLE);
-			value.tuple.length = length;
-			value.tuple.elements = elements;
+			stack.push(Value::make_tuple(tuple));
+		} break;
+		case CMD_LOAD_SLOT: {
+			Value value = exec_context->slots[cmd.load_slot.slot];
+			value.retain();
 			stack.push(value);
 		} break;
+		case CMD_INDEX: {
+			Value index = stack.pop();
+			Value tuple = stack.pop();
+			stack.push(index_tuple(tuple, index));
+		} break;
+		case CMD_SLICE: {
+			Value end = stack.pop();
+			Value start = stack.pop();
+			Value tuple = stack.pop();
+			stack.push(slice_tuple(tuple, start, end));
+		} break;
+		case CMD_LENGTH:
+			stack.push(tuple_length(stack.pop()));
+			break;
+		case CMD_INT_NEGATE: {
+			Value * top = &stack.data()[stack.size - 1];
+			top->integer = -top->integer;
+		} break;
+		case CMD_INT_ADD: {
+			int right = stack.data()[--stack.size].integer;
+			stack.data()[stack.size - 1].integer += right;
+		} break;
+		case CMD_INT_SUBTRACT: {
+			int right = stack.data()[--stack.size].integer;
+			stack.data()[stack.size - 1].integer -= right;
+		} break;
+		case CMD_INT_MULTIPLY: {
+			int right = stack.data()[--stack.size].integer;
+			stack.data()[stack.size - 1].integer *= right;
+		} break;
+		case CMD_INT_DIVIDE: {
+			int right = stack.data()[--stack.size].integer;
+			stack.data()[stack.size - 1].integer /= right;
+		} break;
+		case CMD_INT_OP_CONST: {
+			Value * top = &stack.data()[stack.size - 1];
+			top->integer = integer_binary(cmd.int_op_const.op, top->integer,
+										  cmd.int_op_const.constant);
+		} break;
+		case CMD_INT_OP_VAR: {
+			Value * top = &stack.data()[stack.size - 1];
+			top->integer = integer_binary(cmd.int_op_var.op, top->integer,
+										  lookup(cmd.int_op_var.symbol).integer);
+		} break;
+		case CMD_INT_VAR_OP_VAR: {
+			int left = lookup(cmd.int_var_op_var.left).integer;
+			int right = lookup(cmd.int_var_op_var.right).integer;
+			stack.push(Value::make_integer(integer_binary(cmd.int_var_op_var.op, left, right)));
+		} break;
 		default:
 			fatal_internal("Invalid instruction reached VM::execute()");
 		}
 	}
 }
 
-bool run_job(Job * job, Assignment * assignment)
+// Runs a job that specialize_types() proved integer-only on a stack of
+// untagged ints, at most depth deep, and returns its result
+int VM::execute_integer(size_t depth)
 {
-	Compiler compiler;
-	compiler.init();
-	const char * assign_symbol = job->spec->left;
-	compiler.compile_expression(job->spec->right);
-	
-	VM vm;
-	vm.init(compiler.commands);
-	vm.execute();
-	assert(vm.stack.size == 1);
-	Value result = vm.stack.pop();
+	int local[64];
+	int * ints = depth <= 64 ? local : (int*) mem_alloc(sizeof(int) * depth, MEM_VM);
+	size_t size = 0;
+#ifdef SYNC_VM_STATS
+	vm_stats.begin_job(commands.size, 0);
+#endif
+	while (counter < commands.size) {
+		Command * cmd = &commands.arr[counter++];
+#ifdef SYNC_VM_STATS
+		vm_stats.dispatch(cmd, size, 0);
+#endif
+		switch (cmd->type) {
+		case CMD_LOAD_CONST:
+			ints[size++] = cmd->load_const.constant.integer;
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			// An integer binding can be read in place even when the job
+			// was allowed to move it
+			ints[size++] = exec_context->var_space.lookup(cmd->lookup.symbol).integer;
+			break;
+		case CMD_LOAD_SLOT:
+			ints[size++] = exec_context->slots[cmd->load_slot.slot].integer;
+			break;
+		case CMD_INT_NEGATE:
+			ints[size - 1] = -ints[size - 1];
+			break;
+		case CMD_INT_ADD: {
+			int right = ints[--size];
+			ints[size - 1] += right;
+		} break;
+		case CMD_INT_SUBTRACT: {
+			int right = ints[--size];
+			ints[size - 1] -= right;
+		} break;
+		case CMD_INT_MULTIPLY: {
+			int right = ints[--size];
+			ints[size - 1] *= right;
+		} break;
+		case CMD_INT_DIVIDE: {
+			int right = ints[--size];
+			ints[size - 1] /= right;
+		} break;
+		case CMD_INT_OP_CONST:
+			ints[size - 1] = integer_binary(cmd->int_op_const.op, ints[size - 1],
+											cmd->int_op_const.constant);
+			break;
+		case CMD_INT_OP_VAR: {
+			int right = exec_context->var_space.lookup(cmd->int_op_var.symbol).integer;
+			ints[size - 1] = integer_binary(cmd->int_op_var.op, ints[size - 1], right);
+		} break;
+		case CMD_INT_VAR_OP_VAR: {
+			int left = exec_context->var_space.lookup(cmd->int_var_op_var.left).integer;
+			int right = exec_context->var_space.lookup(cmd->int_var_op_var.right).integer;
+			ints[size++] = integer_binary(cmd->int_var_op_var.op, left, right);
+		} break;
+		default:
+			fatal_internal("Invalid instruction reached VM::execute_integer()");
+		}
+	}
+	assert(size == 1);
+	int result = ints[0];
+	if (ints != local) mem_free(ints);
+	return result;
+}
+
+void hash_commands(List<Command> commands, Cache_Key * key)
+{
+	key->mix(commands.size);
+	for (int i = 0; i < commands.size; i++) {
+		Command cmd = commands[i];
+		key->mix(cmd.type);
+		switch (cmd.type) {
+		case CMD_LOAD_CONST:
+			key->mix(cmd.load_const.constant.content_hash());
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			key->mix(hash_string(cmd.lookup.symbol));
+			break;
+		case CMD_UNARY_OP:
+			key->mix(cmd.unary_op.op);
+			break;
+		case CMD_BINARY_OP:
+			key->mix(cmd.binary_op.op);
+			break;
+		case CMD_MAKE_TUPLE:
+			key->mix(cmd.make_tuple.length);
+			break;
+		case CMD_LOAD_SLOT:
+			key->mix(cmd.load_slot.slot);
+			break;
+		case CMD_INT_OP_CONST:
+			key->mix(cmd.int_op_const.op);
+			key->mix((uint32_t) cmd.int_op_const.constant);
+			break;
+		case CMD_INT_OP_VAR:
+			key->mix(cmd.int_op_var.op);
+			key->mix(hash_string(cmd.int_op_var.symbol));
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			key->mix(cmd.int_var_op_var.op);
+			key->mix(hash_string(cmd.int_var_op_var.left));
+			key->mix(hash_string(cmd.int_var_op_var.right));
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+// Mixes the value bound to symbol into key. Returns false if it has not
+// been forced yet.
+static bool hash_binding(Cache_Key * key, const char * symbol)
+{
+	Value value = exec_context->var_space.lookup(symbol);
+	if (value.type == VALUE_THUNK) return false;
+	key->mix(value.content_hash());
+	return true;
+}
+
+// Builds the cache key of a compiled job from its commands and the
+// current contents of everything it reads. Returns false for jobs that
+// must run regardless: those with side effects, those whose result is
+// thrown away, and those that read a value that has not been forced.
+bool job_cache_key(Job * job, Cache_Key * key)
+{
+	if (!job->left && job->slot == -1) return false;
+	key->init();
+	hash_commands(job->commands, key);
+	for (int i = 0; i < job->commands.size; i++) {
+		Command cmd = job->commands[i];
+		switch (cmd.type) {
+		case CMD_OUTPUT:
+			return false;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			if (!hash_binding(key, cmd.lookup.symbol)) return false;
+			break;
+		case CMD_INT_OP_VAR:
+			if (!hash_binding(key, cmd.int_op_var.symbol)) return false;
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			if (!hash_binding(key, cmd.int_var_op_var.left)
+				|| !hash_binding(key, cmd.int_var_op_var.right)) {
+				return false;
+			}
+			break;
+		case CMD_LOAD_SLOT:
+			key->mix(exec_context->slots[cmd.load_slot.slot].content_hash());
+			break;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+// Runs an integer-only job as native code. Returns false, having done
+// nothing, if the job isn't eligible or reads something that is not an
+// integer, such as a tuple or a value that is yet to be forced.
+bool run_job_native(Job * job, Value * result)
+{
+	uint64_t hash;
+	size_t input_count;
+	if (!jit_shape_hash(job->commands, &hash, &input_count)) return false;
+	int local[64];
+	int * inputs = input_count <= 64 ? local : (int*) mem_alloc(sizeof(int) * input_count, MEM_VM);
+	size_t count = 0;
+	for (size_t i = 0; i < job->commands.size; i++) {
+		Command * cmd = &job->commands.arr[i];
+		// Superinstructions read up to two values
+		Value values[2];
+		size_t read = 1;
+		switch (cmd->type) {
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			values[0] = exec_context->var_space.lookup(cmd->lookup.symbol);
+			break;
+		case CMD_LOAD_SLOT:
+			values[0] = exec_context->slots[cmd->load_slot.slot];
+			break;
+		case CMD_INT_OP_VAR:
+			values[0] = exec_context->var_space.lookup(cmd->int_op_var.symbol);
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			values[0] = exec_context->var_space.lookup(cmd->int_var_op_var.left);
+			values[1] = exec_context->var_space.lookup(cmd->int_var_op_var.right);
+			read = 2;
+			break;
+		default:
+			continue;
+		}
+		for (size_t j = 0; j < read; j++) {
+			if (values[j].type != VALUE_INTEGER) {
+				if (inputs != local) mem_free(inputs);
+				return false;
+			}
+			inputs[count++] = values[j].integer;
+		}
+	}
+	Jit_Function function = jit_cache.get(job->commands, hash);
+	*result = Value::make_integer(function(inputs));
+	if (inputs != local) mem_free(inputs);
+	__atomic_add_fetch(&stats.jit_jobs, 1, __ATOMIC_RELAXED);
+	return true;
+}
 
-	vm.dealloc();
-	compiler.dealloc();
+// Types read by a job are those in the variable space at the start of
+// its frame, or in a slot filled before it started. Unbound variables
+// are left to fail when the job actually looks them up.
+static bool is_integer_input(Command * cmd)
+{
+	if (cmd->type == CMD_LOAD_SLOT) {
+		return exec_context->slots[cmd->load_slot.slot].type == VALUE_INTEGER;
+	}
+	Value * value = exec_context->var_space.find(cmd->lookup.symbol);
+	return value && value->type == VALUE_INTEGER;
+}
 
+bool run_job(Job * job, Assignment * assignment)
+{
+	Memory_Scope scope(MEM_VM);
+	const char * assign_symbol = job->left;
+	double start = profiler.now();
+	job->compile();
+	size_t unfused = job->commands.size;
+	// Keyed on the commands as compiled, before specialization and
+	// fusion, which is also what worker processes are sent, so a result
+	// has the same key whichever path ran it
+	Cache_Key cache_key;
+	bool cacheable = options.cache_path && job_cache_key(job, &cache_key);
+	if (options.specialize) {
+		// Superinstructions are stack VM commands; the register VM
+		// folds operands into its instructions itself
+		bool fuse = options.fuse && options.vm == VM_STACK;
+		job->integer_only = specialize_types(&job->commands, is_integer_input,
+											 fuse, &job->integer_depth);
+		if (job->integer_only) __atomic_add_fetch(&stats.integer_jobs, 1, __ATOMIC_RELAXED);
+	}
+	const char * profile_name = job->slot != -1 ? "(precompute)" : assign_symbol;
+	profiler.record("compile", profile_name, start, profiler.now());
+	Value result;
+	bool done = cacheable && result_cache.lookup(cache_key, &result);
+	if (!done && options.jit) {
+		done = run_job_native(job, &result);
+		if (done && cacheable) result_cache.store(cache_key, result, unfused);
+	}
+	if (!done && options.vm == VM_REGISTER) {
+		__atomic_add_fetch(&stats.vm_commands_unfused, unfused, __ATOMIC_RELAXED);
+		result = run_register_vm(job->commands, NULL);
+		if (cacheable) result_cache.store(cache_key, result, unfused);
+	} else if (!done) {
+		__atomic_add_fetch(&stats.vm_commands_unfused, unfused, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats.vm_commands, job->commands.size, __ATOMIC_RELAXED);
+		VM vm;
+		vm.init(job->commands);
+		if (job->integer_only) {
+			result = Value::make_integer(vm.execute_integer(job->integer_depth));
+		} else {
+			vm.execute();
+			assert(vm.stack.size == 1);
+			result = vm.stack.pop();
+		}
+		vm.dealloc();
+		if (cacheable) result_cache.store(cache_key, result, unfused);
+	}
+	profiler.record("job", profile_name, start, profiler.now());
+
+	if (job->slot != -1) {
+		result.share();
+		exec_context->slots[job->slot] = result;
+		return false;
+	}
 	if (assign_symbol) {
 		*assignment = (Assignment) { assign_symbol, result };
+	} else {
+		result.release();
 	}
 	return (bool) assign_symbol;
 }
 
-void * scan_and_execute_from_queue(void *)
+// In contexts that recover from errors, such as server sessions, an
+// error in a job fails its frame rather than the process: it is kept
+// for the main thread to raise, and the worker goes on with the rest of
+// its jobs, whose results the frame then drops.
+static bool run_job_recovering(Job * job, Assignment * assignment)
+{
+	if (!exec_context->recover_errors) return run_job(job, assignment);
+	jmp_buf recovery;
+	jmp_buf * outer = fatal_recovery;
+	Memory_Tag scope = memory_scope;
+	if (setjmp(recovery)) {
+		fatal_recovery = outer;
+		memory_scope = scope;
+		exec_context->fail(fatal_message);
+		return false;
+	}
+	fatal_recovery = &recovery;
+	bool assigned = run_job(job, assignment);
+	fatal_recovery = outer;
+	return assigned;
+}
+
+// Takes the next batch off the context's queue and runs it. Returns how
+// many jobs ran, 0 once the queue is empty.
+static size_t run_batch(Execution_Context * context)
+{
+	Job * batch[JOB_BATCH_SIZE];
+	double waited = profiler.now();
+	context->job_queue.lock();
+	if (profiler.enabled) {
+		// Uncontended locks aren't worth a span
+		double locked = profiler.now();
+		if (locked - waited > 1000) profiler.record("queue", NULL, waited, locked);
+	}
+	if (context->job_queue.empty()) {
+		context->job_queue.unlock();
+		return 0;
+	}
+	size_t count = context->job_queue.take(batch, options.schedule ? JOB_BATCH_SIZE : 1);
+	context->job_queue.unlock();
+	__atomic_add_fetch(&stats.dequeues, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats.dequeued_jobs, count, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < count; i++) {
+		Assignment assign;
+		if (run_job_recovering(batch[i], &assign)) {
+			context->assignments->publish(assign.symbol, assign.value);
+		}
+	}
+	return count;
+}
+
+// Runs the current context's queue to the end on the calling thread
+void * scan_and_execute_from_queue(void * slot)
+{
+	profile_slot = (size_t) slot;
+	double start = profiler.now();
+	uint32_t ran = 0;
+	while (size_t count = run_batch(exec_context)) {
+		ran += count;
+	}
+	if (profiler.enabled) {
+		double end = profiler.now();
+		profiler.record("worker", NULL, start, end, ran);
+		profiler.buffers[profile_slot].finished = end;
+	}
+	return NULL;
+}
+
+// Worker threads shared by every execution context in the process,
+// started along with the first context. A context hands its queue over
+// and waits until it has run. Workers serve the contexts waiting on them
+// in turn, a batch at a time, so a large frame in one context doesn't
+// hold up the others.
+struct Worker_Pool {
+	// Held while the first context starts the workers
+	pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	// Signaled when a context is queued, and when one's jobs have all run
+	pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+	pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+	bool started = false;
+	size_t size;
+	// Time from handing a queue over to the workers until they are done
+	// with it, less the jobs themselves
+	double fan_out_ns;
+	// Time per unit of estimated cost of a small synthetic batch run on
+	// one thread, the starting point of every context's estimate
+	double ns_per_cost;
+	List<Execution_Context*> queued;
+	// Position of the next context served in queued
+	size_t turn;
+	size_t start();
+	void calibrate();
+	void run(Execution_Context * context);
+	void serve();
+	void finish_batch(Execution_Context * context, size_t ran);
+};
+
+Worker_Pool worker_pool;
+
+static void * run_pool_worker(void * slot)
 {
-	List<Assignment> * assignments = (List<Assignment> *) malloc(sizeof(List<Assignment>));
-	assignments->alloc();
+	// Worker i records into profiler slot i + 1
+	profile_slot = (size_t) slot;
+	worker_pool.serve();
+	return NULL;
+}
+
+// Starts the workers on first use, and returns how many there are
+size_t Worker_Pool::start()
+{
+	pthread_mutex_lock(&start_mutex);
+	if (started) {
+		pthread_mutex_unlock(&start_mutex);
+		return size;
+	}
+	started = true;
+	cpu_placement.init();
+	size = options.threads ? options.threads : cpu_placement.default_threads();
+	queued.alloc();
+	turn = 0;
+	fan_out_ns = 0;
+	if (size > 1) {
+		pthread_t * threads = (pthread_t*) mem_alloc(sizeof(pthread_t) * size);
+		for (size_t i = 0; i < size; i++) {
+			pthread_create(&threads[i], NULL, run_pool_worker, (void*) (i + 1));
+			if (options.pin) cpu_placement.pin(threads[i], i);
+			pthread_detach(threads[i]);
+		}
+		mem_free(threads);
+	}
+	ns_per_cost = 0;
+	if (size > 1 && options.inline_threshold < 0) calibrate();
+	pthread_mutex_unlock(&start_mutex);
+	return size;
+}
+
+// Commands of a synthetic job: builds a small tuple and does some
+// integer arithmetic on its length, like a typical small job
+static List<Command> calibration_commands(int seed)
+{
+	List<Command> commands;
+	commands.alloc();
+	for (int i = 0; i < 8; i++) {
+		Command cmd = Command::with_type(CMD_LOAD_CONST);
+		cmd.load_const.constant = Value::make_integer(seed + i);
+		commands.push(cmd);
+	}
+	Command tuple = Command::with_type(CMD_MAKE_TUPLE);
+	tuple.make_tuple.length = 8;
+	commands.push(tuple);
+	commands.push(Command::with_type(CMD_LENGTH));
+	for (int i = 0; i < 4; i++) {
+		Command constant = Command::with_type(CMD_LOAD_CONST);
+		constant.load_const.constant = Value::make_integer(seed);
+		commands.push(constant);
+		Command op = Command::with_type(CMD_BINARY_OP);
+		op.binary_op.op = i % 2 ? BINARY_PLUS : BINARY_MULTIPLY;
+		commands.push(op);
+	}
+	return commands;
+}
+
+// Times handing an empty queue over, which is all the overhead a batch
+// run on the workers has, and running a small synthetic batch on this
+// thread, which gives the time a unit of estimated cost takes
+void Worker_Pool::calibrate()
+{
+	static Execution_Context probe;
+	probe.job_queue.init();
+	for (int round = 0; round < 5; round++) {
+		double start = monotonic_ns();
+		run(&probe);
+		double elapsed = monotonic_ns() - start;
+		if (round == 0 || elapsed < fan_out_ns) fan_out_ns = elapsed;
+	}
+
+	// The synthetic jobs must not show up in --stats
+	Stats saved = stats;
+	Execution_Context * outer = exec_context;
+	exec_context = &probe;
+	for (int round = 0; round < 3; round++) {
+		List<Job*> jobs;
+		jobs.alloc();
+		size_t cost = 0;
+		for (int i = 0; i < 256; i++) {
+			Job * job = Job::make_compiled(NULL, -1, calibration_commands(i));
+			job->cost = job->commands.size;
+			cost += job->cost;
+			jobs.push(job);
+			probe.job_queue.add(job);
+		}
+		double start = monotonic_ns();
+		while (run_batch(&probe)) {}
+		double sample = (monotonic_ns() - start) / cost;
+		if (round == 0 || sample < ns_per_cost) ns_per_cost = sample;
+		probe.job_queue.clear();
+		for (int i = 0; i < jobs.size; i++) {
+			jobs[i]->dealloc();
+		}
+		jobs.dealloc();
+	}
+	exec_context = outer;
+	stats = saved;
+}
+
+void Worker_Pool::run(Execution_Context * context)
+{
+	pthread_mutex_lock(&mutex);
+	context->queued = true;
+	queued.push(context);
+	pthread_cond_broadcast(&work);
+	while (context->queued || context->running_batches > 0) {
+		pthread_cond_wait(&done, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void Worker_Pool::serve()
+{
+	pthread_mutex_lock(&mutex);
 	while (true) {
-		exec_context.job_queue.lock();
-		if (exec_context.job_queue.empty()) {
-			exec_context.job_queue.unlock();
-			break;
+		while (queued.size == 0) {
+			pthread_cond_wait(&work, &mutex);
 		}
-		Job * job = exec_context.job_queue.take();
-		exec_context.job_queue.unlock();
-		Assignment assign;
-		if (run_job(job, &assign)) {
-			assignments->push(assign);
+		Execution_Context * context = queued[turn++ % queued.size];
+		context->running_batches++;
+		pthread_mutex_unlock(&mutex);
+		exec_context = context;
+		double start = profiler.now();
+		size_t ran = run_batch(context);
+		if (ran && profiler.enabled) {
+			double end = profiler.now();
+			profiler.record("worker", NULL, start, end, ran);
+			profiler.buffers[profile_slot].finished = end;
+		}
+		pthread_mutex_lock(&mutex);
+		finish_batch(context, ran);
+	}
+}
+
+// Called with the lock held. Once a context's queue is empty it stops
+// being served, and once its last batch is done its thread wakes up.
+void Worker_Pool::finish_batch(Execution_Context * context, size_t ran)
+{
+	context->running_batches--;
+	if (ran == 0 && context->queued) {
+		context->queued = false;
+		int i = 0;
+		while (queued[i] != context) i++;
+		for (; i + 1 < queued.size; i++) {
+			queued[i] = queued[i + 1];
 		}
+		queued.pop();
+	}
+	if (!context->queued && context->running_batches == 0) {
+		pthread_cond_broadcast(&done);
 	}
-	return assignments;
+}
+
+size_t start_workers(double * fan_out_ns, double * ns_per_cost)
+{
+	size_t size = worker_pool.start();
+	*fan_out_ns = worker_pool.fan_out_ns;
+	*ns_per_cost = worker_pool.ns_per_cost;
+	return size;
+}
+
+void run_on_workers(Execution_Context * context)
+{
+	worker_pool.run(context);
 }
@@ -0,0 +1,45 @@
+// Superinstructions
+//
+// After type specialization, most integer arithmetic is a load feeding
+// an operator: `x + 1` is LOOKUP, LOAD_CONST, INT_ADD. Fusing the load,
+// or two lookups, into the operator makes the pair or triple cost a
+// single dispatch in the VM and keeps the loaded operands off the stack.
+// This runs inside specialize_types() as each operator is specialized,
+// so it adds no pass of its own over the commands.
+
+static bool is_lookup(Command_Type type)
+{
+	return type == CMD_LOOKUP || type == CMD_LOOKUP_MOVE;
+}
+
+// Appends the specialized integer operator op to the commands already
+// written to out[0..*size), folding it into the loads that end them
+// when it can. Operands of an integer operator are proven integers, so
+// a moving lookup can be fused like a plain one.
+void emit_fused(Command * out, size_t * size, Binary_Op op, Command_Type specialized)
+{
+	size_t n = *size;
+	if (n >= 2 && is_lookup(out[n - 2].type) && is_lookup(out[n - 1].type)) {
+		Command fused = Command::with_type(CMD_INT_VAR_OP_VAR);
+		fused.int_var_op_var.op = op;
+		fused.int_var_op_var.left = out[n - 2].lookup.symbol;
+		fused.int_var_op_var.right = out[n - 1].lookup.symbol;
+		out[n - 2] = fused;
+		*size = n - 1;
+	} else if (n >= 1 && is_lookup(out[n - 1].type)) {
+		Command fused = Command::with_type(CMD_INT_OP_VAR);
+		fused.int_op_var.op = op;
+		fused.int_op_var.symbol = out[n - 1].lookup.symbol;
+		out[n - 1] = fused;
+	} else if (n >= 1 && out[n - 1].type == CMD_LOAD_CONST
+			   && out[n - 1].load_const.constant.type == VALUE_INTEGER) {
+		Command fused = Command::with_type(CMD_INT_OP_CONST);
+		fused.int_op_const.op = op;
+		fused.int_op_const.constant = out[n - 1].load_const.constant.integer;
+		out[n - 1] = fused;
+	} else {
+		Command cmd = Command::with_type(specialized);
+		cmd.binary_op.op = op;
+		out[(*size)++] = cmd;
+	}
+}
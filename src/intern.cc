@@ -0,0 +1,155 @@
+// Tuple interning
+//
+// With --intern-tuples, each tuple about to be committed to the variable
+// space is swapped for an equal one already in the intern table, if there
+// is one, so equal tuples built by different jobs or frames end up
+// sharing one payload. Elements are interned before the tuples holding
+// them, which makes two interned payloads equal only if they are the
+// same payload, so comparing candidates mostly compares pointers.
+//
+// The table holds a reference to every tuple in it, so interned payloads
+// are never unique and never reused in place. The table is shared by
+// every execution context, and a commit holds its lock while interning.
+// Tuples nothing else references any more are dropped once the table
+// has doubled since it was last swept.
+//
+// Slices are left as they are, since they point into their parent's
+// payload.
+
+#define INTERN_MIN_SWEEP 1024
+
+static bool same_contents(Value a, Value b)
+{
+	if (a.type != b.type) return false;
+	switch (a.type) {
+	case VALUE_NIL:
+		return true;
+	case VALUE_INTEGER:
+		return a.integer == b.integer;
+	case VALUE_TUPLE: {
+		if (a.tuple.length != b.tuple.length) return false;
+		if (a.tuple.data == b.tuple.data && a.tuple.offset == b.tuple.offset) return true;
+		if (a.tuple.is_whole() && b.tuple.is_whole()
+			&& a.tuple.data->interned && b.tuple.data->interned) {
+			return false;
+		}
+		Value * left = a.tuple.elements();
+		Value * right = b.tuple.elements();
+		for (size_t i = 0; i < a.tuple.length; i++) {
+			if (!same_contents(left[i], right[i])) return false;
+		}
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+struct Tuple_Interner {
+	pthread_mutex_t mutex;
+	// Open addressing, NULL for empty slots, a power of two in size
+	List<Tuple*> slots;
+	size_t count;
+	size_t next_sweep;
+	// Tuples looked up, and how many of those were replaced by one
+	// already interned
+	size_t lookups;
+	size_t hits;
+	size_t bytes_saved;
+	void init()
+	{
+		Memory_Scope scope(MEM_VALUES);
+		pthread_mutex_init(&mutex, NULL);
+		slots.alloc();
+		for (int i = 0; i < 64; i++) {
+			slots.push(NULL);
+		}
+		count = 0;
+		next_sweep = INTERN_MIN_SWEEP;
+	}
+	// Returns the slot holding a tuple equal to value, or the empty one
+	// it would go in
+	Tuple ** find(Value value, uint64_t hash)
+	{
+		size_t mask = slots.size - 1;
+		size_t i = hash & mask;
+		while (slots.arr[i]) {
+			Tuple * other = slots.arr[i];
+			if (other->hash == hash && same_contents(value, Value::make_tuple(other))) break;
+			i = (i + 1) & mask;
+		}
+		return &slots.arr[i];
+	}
+	// Rebuilds the table with room for count tuples, dropping the ones
+	// only the table still references when sweep is set
+	void rebuild(size_t size, bool sweep)
+	{
+		List<Tuple*> old = slots;
+		slots.alloc();
+		for (size_t i = 0; i < size; i++) {
+			slots.push(NULL);
+		}
+		count = 0;
+		for (int i = 0; i < old.size; i++) {
+			Tuple * tuple = old[i];
+			if (!tuple) continue;
+			Value value = Value::make_tuple(tuple);
+			if (sweep && value.is_unique()) {
+				value.release();
+				continue;
+			}
+			*find(value, tuple->hash) = tuple;
+			count++;
+		}
+		old.dealloc();
+	}
+	// Takes ownership of value and returns the value to commit in its place
+	Value intern(Value value)
+	{
+		if (value.type != VALUE_TUPLE) return value;
+		Tuple * data = value.tuple.data;
+		if (data->interned || !value.tuple.is_whole()) return value;
+		Memory_Scope scope(MEM_VALUES);
+		// Nothing but this commit can see an unshared payload, so its
+		// elements can be swapped for equal ones. Shared ones, such as
+		// results of shared subexpressions or forced thunks, may be read
+		// by jobs meanwhile and keep their elements.
+		if (!data->shared) {
+			for (size_t i = 0; i < data->length; i++) {
+				data->elements[i] = intern(data->elements[i]);
+			}
+		}
+		lookups++;
+		uint64_t hash = value.content_hash();
+		Tuple ** slot = find(value, hash);
+		if (*slot) {
+			hits++;
+			if (value.is_unique()) bytes_saved += sizeof(Tuple) + sizeof(Value) * data->capacity;
+			value.release();
+			Value interned = Value::make_tuple(*slot);
+			interned.retain();
+			return interned;
+		}
+		value.share();
+		data->interned = true;
+		// The table's reference
+		value.retain();
+		*slot = data;
+		count++;
+		if (count * 2 > slots.size) rebuild(slots.size * 2, false);
+		if (count >= next_sweep) {
+			rebuild(slots.size, true);
+			next_sweep = count * 2 > INTERN_MIN_SWEEP ? count * 2 : INTERN_MIN_SWEEP;
+		}
+		return value;
+	}
+	void report()
+	{
+		double ratio = lookups ? 100.0 * hits / lookups : 0.0;
+		fprintf(stderr, "interned: %zu of %zu committed tuples were duplicates (%.1f%% dedup), "
+				"%zu distinct tuples kept, ", hits, lookups, ratio, count);
+		print_bytes(stderr, "%s not kept twice\n", bytes_saved);
+	}
+};
+
+Tuple_Interner tuple_interner;
@@ -0,0 +1,407 @@
+// Native code for integer-only jobs
+//
+// With --jit, a job whose commands only load integer constants, look up
+// variables or slots, and apply operators to integers is translated into
+// x86-64 machine code. Every command becomes a fixed template over the
+// machine stack, so the generated function mirrors the VM instruction
+// for instruction. Values read by the job are passed in as an array of
+// ints (rdi), one per lookup in command order, and the result comes
+// back in eax.
+//
+// Functions are cached by the shape of the program, meaning its
+// commands with variable names and slot numbers left out, so every job
+// computing `x + 1` for any x runs the same code and each shape is only
+// compiled once per run.
+
+#if defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+typedef int (*Jit_Function)(const int * inputs);
+
+static bool is_input(Command_Type type)
+{
+	return type == CMD_LOOKUP || type == CMD_LOOKUP_MOVE || type == CMD_LOAD_SLOT;
+}
+
+// Checks whether a program can be compiled and, if so, hashes its
+// shape and counts the values it reads. This runs for every job, so it
+// is a single pass over the array.
+bool jit_shape_hash(List<Command> commands, uint64_t * out, size_t * input_count)
+{
+	if (!JIT_SUPPORTED || commands.size == 0) return false;
+	uint64_t hash = hash_combine(0, commands.size);
+	size_t inputs = 0;
+	for (size_t i = 0; i < commands.size; i++) {
+		Command * cmd = &commands.arr[i];
+		switch (cmd->type) {
+		case CMD_LOAD_CONST:
+			if (cmd->load_const.constant.type != VALUE_INTEGER) return false;
+			hash = hash_combine(hash, ((uint64_t) CMD_LOAD_CONST << 32)
+								| (uint32_t) cmd->load_const.constant.integer);
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+		case CMD_LOAD_SLOT:
+			inputs++;
+			hash = hash_combine(hash, CMD_LOOKUP);
+			break;
+		case CMD_UNARY_OP:
+			hash = hash_combine(hash, ((uint64_t) CMD_UNARY_OP << 32) | cmd->unary_op.op);
+			break;
+		case CMD_BINARY_OP:
+			hash = hash_combine(hash, ((uint64_t) CMD_BINARY_OP << 32) | cmd->binary_op.op);
+			break;
+		case CMD_INT_NEGATE:
+		case CMD_INT_ADD:
+		case CMD_INT_SUBTRACT:
+		case CMD_INT_MULTIPLY:
+		case CMD_INT_DIVIDE:
+			hash = hash_combine(hash, cmd->type);
+			break;
+		case CMD_INT_OP_CONST:
+			hash = hash_combine(hash, ((uint64_t) cmd->int_op_const.op << 32)
+								| (uint32_t) cmd->int_op_const.constant);
+			hash = hash_combine(hash, cmd->type);
+			break;
+		case CMD_INT_OP_VAR:
+			inputs++;
+			hash = hash_combine(hash, ((uint64_t) CMD_INT_OP_VAR << 32) | cmd->int_op_var.op);
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			inputs += 2;
+			hash = hash_combine(hash, ((uint64_t) CMD_INT_VAR_OP_VAR << 32)
+								| cmd->int_var_op_var.op);
+			break;
+		default:
+			return false;
+		}
+	}
+	*out = hash;
+	*input_count = inputs;
+	return true;
+}
+
+// Whether two eligible programs compile to the same code
+static bool same_shape(List<Command> a, List<Command> b)
+{
+	if (a.size != b.size) return false;
+	for (size_t i = 0; i < a.size; i++) {
+		Command * x = &a.arr[i];
+		Command * y = &b.arr[i];
+		if (is_input(x->type) || is_input(y->type)) {
+			if (is_input(x->type) != is_input(y->type)) return false;
+			continue;
+		}
+		if (x->type != y->type) return false;
+		switch (x->type) {
+		case CMD_LOAD_CONST:
+			if (x->load_const.constant.integer != y->load_const.constant.integer) return false;
+			break;
+		case CMD_UNARY_OP:
+			if (x->unary_op.op != y->unary_op.op) return false;
+			break;
+		case CMD_BINARY_OP:
+			if (x->binary_op.op != y->binary_op.op) return false;
+			break;
+		case CMD_INT_OP_CONST:
+			if (x->int_op_const.op != y->int_op_const.op
+				|| x->int_op_const.constant != y->int_op_const.constant) return false;
+			break;
+		case CMD_INT_OP_VAR:
+			if (x->int_op_var.op != y->int_op_var.op) return false;
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			if (x->int_var_op_var.op != y->int_var_op_var.op) return false;
+			break;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+struct Jit_Emitter {
+	List<uint8_t> code;
+	void bytes(const uint8_t * data, size_t length)
+	{
+		code.push_array(data, length);
+	}
+	void imm32(int32_t value)
+	{
+		bytes((const uint8_t *) &value, 4);
+	}
+	void arithmetic(Binary_Op op);
+	void emit(List<Command> commands);
+};
+
+// eax = eax op ecx
+void Jit_Emitter::arithmetic(Binary_Op op)
+{
+	static const uint8_t add[] = { 0x01, 0xC8 };        // add eax, ecx
+	static const uint8_t sub[] = { 0x29, 0xC8 };        // sub eax, ecx
+	static const uint8_t imul[] = { 0x0F, 0xAF, 0xC1 }; // imul eax, ecx
+	static const uint8_t idiv[] = { 0x99, 0xF7, 0xF9 }; // cdq; idiv ecx
+	switch (op) {
+	case BINARY_PLUS:     bytes(add, sizeof(add)); break;
+	case BINARY_MINUS:    bytes(sub, sizeof(sub)); break;
+	case BINARY_MULTIPLY: bytes(imul, sizeof(imul)); break;
+	case BINARY_DIVIDE:   bytes(idiv, sizeof(idiv)); break;
+	default:
+		fatal_internal("Jit_Emitter::arithmetic() switch incomplete");
+	}
+}
+
+void Jit_Emitter::emit(List<Command> commands)
+{
+	static const uint8_t push_imm32[] = { 0x68 };
+	static const uint8_t push_rax[] = { 0x50 };
+	static const uint8_t pop_rax[] = { 0x58 };
+	static const uint8_t pop_rcx_rax[] = { 0x59, 0x58 };
+	static const uint8_t load_eax[] = { 0x8B, 0x87 };  // mov eax, [rdi + disp32]
+	static const uint8_t load_ecx[] = { 0x8B, 0x8F };  // mov ecx, [rdi + disp32]
+	static const uint8_t mov_ecx[] = { 0xB9 };         // mov ecx, imm32
+	static const uint8_t neg[] = { 0x58, 0xF7, 0xD8, 0x50 }; // pop rax; neg eax; push rax
+	static const uint8_t ret[] = { 0x58, 0xC3 };       // pop rax; ret
+
+	// Byte offset of the next input in the array passed in rdi
+	int32_t input = 0;
+	for (int i = 0; i < commands.size; i++) {
+		Command cmd = commands[i];
+		switch (cmd.type) {
+		case CMD_LOAD_CONST:
+			bytes(push_imm32, sizeof(push_imm32));
+			imm32(cmd.load_const.constant.integer);
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+		case CMD_LOAD_SLOT:
+			bytes(load_eax, sizeof(load_eax));
+			imm32(input);
+			input += sizeof(int);
+			bytes(push_rax, sizeof(push_rax));
+			break;
+		case CMD_UNARY_OP:
+		case CMD_INT_NEGATE:
+			bytes(neg, sizeof(neg));
+			break;
+		case CMD_BINARY_OP:
+			bytes(pop_rcx_rax, sizeof(pop_rcx_rax));
+			arithmetic(cmd.binary_op.op);
+			bytes(push_rax, sizeof(push_rax));
+			break;
+		case CMD_INT_ADD:
+		case CMD_INT_SUBTRACT:
+		case CMD_INT_MULTIPLY:
+		case CMD_INT_DIVIDE:
+			// Specialized commands keep the operator in binary_op
+			bytes(pop_rcx_rax, sizeof(pop_rcx_rax));
+			arithmetic(cmd.binary_op.op);
+			bytes(push_rax, sizeof(push_rax));
+			break;
+		case CMD_INT_OP_CONST:
+			bytes(pop_rax, sizeof(pop_rax));
+			bytes(mov_ecx, sizeof(mov_ecx));
+			imm32(cmd.int_op_const.constant);
+			arithmetic(cmd.int_op_const.op);
+			bytes(push_rax, sizeof(push_rax));
+			break;
+		case CMD_INT_OP_VAR:
+			bytes(pop_rax, sizeof(pop_rax));
+			bytes(load_ecx, sizeof(load_ecx));
+			imm32(input);
+			input += sizeof(int);
+			arithmetic(cmd.int_op_var.op);
+			bytes(push_rax, sizeof(push_rax));
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			bytes(load_eax, sizeof(load_eax));
+			imm32(input);
+			bytes(load_ecx, sizeof(load_ecx));
+			imm32(input + sizeof(int));
+			input += 2 * sizeof(int);
+			arithmetic(cmd.int_var_op_var.op);
+			bytes(push_rax, sizeof(push_rax));
+			break;
+		default:
+			fatal_internal("Ineligible command reached Jit_Emitter::emit()");
+		}
+	}
+	bytes(ret, sizeof(ret));
+}
+
+struct Jit_Entry {
+	uint64_t hash;
+	List<Command> shape; // Copy of the first program compiled
+	Jit_Function function;
+};
+
+// Open-addressed, function NULL when empty. Entries are only ever
+// filled in, never changed, and function is written last, so a table can
+// be read while another thread adds to it.
+struct Jit_Table {
+	size_t size;
+	Jit_Entry entries[];
+	static Jit_Table * make(size_t size);
+	Jit_Entry * find(List<Command> commands, uint64_t hash);
+};
+
+// Executable memory shared by many functions. Each chunk is a memfd
+// mapped twice, once writable to emit into and once executable to run
+// from, so no page is ever writable and executable at once and code can
+// be added next to functions other threads are running. Chunks are
+// mapped on first use, which is after worker processes have been forked,
+// as a chunk mapped before a fork would be shared with the child.
+struct Jit_Arena {
+	uint8_t * write;
+	uint8_t * exec;
+	size_t used;
+	size_t size;
+	void * alloc(const uint8_t * code, size_t length, size_t page_size);
+};
+
+// Lookups of compiled shapes take no lock: the current table is
+// published atomically and only replaced, never changed in place, when
+// it grows. The mutex serializes compiling and adding a shape.
+struct Jit_Cache {
+	pthread_mutex_t mutex;
+	Jit_Table * table;
+	List<Jit_Table*> retired; // Grown out of, but may still be read
+	size_t used;
+	size_t page_size;
+	Jit_Arena arena;
+	void init();
+	void grow();
+	Jit_Function compile(List<Command> commands);
+	Jit_Function get(List<Command> commands, uint64_t hash);
+};
+
+Jit_Cache jit_cache;
+
+Jit_Table * Jit_Table::make(size_t size)
+{
+	Jit_Table * table = (Jit_Table*) mem_calloc(1, sizeof(Jit_Table) + size * sizeof(Jit_Entry), MEM_CACHE);
+	table->size = size;
+	return table;
+}
+
+Jit_Entry * Jit_Table::find(List<Command> commands, uint64_t hash)
+{
+	size_t mask = size - 1;
+	size_t i = hash & mask;
+	while (__atomic_load_n(&entries[i].function, __ATOMIC_ACQUIRE)) {
+		if (entries[i].hash == hash && same_shape(entries[i].shape, commands)) break;
+		i = (i + 1) & mask;
+	}
+	return &entries[i];
+}
+
+void Jit_Cache::init()
+{
+	pthread_mutex_init(&mutex, NULL);
+	table = Jit_Table::make(64);
+	retired.alloc();
+	used = 0;
+	page_size = sysconf(_SC_PAGESIZE);
+	arena = (Jit_Arena) { NULL, NULL, 0, 0 };
+}
+
+// Copies the entries into a table twice the size and publishes it. The
+// old table is kept, as lookups may still be reading it.
+void Jit_Cache::grow()
+{
+	Jit_Table * old = table;
+	Jit_Table * grown = Jit_Table::make(old->size * 2);
+	for (size_t i = 0; i < old->size; i++) {
+		if (old->entries[i].function) {
+			*grown->find(old->entries[i].shape, old->entries[i].hash) = old->entries[i];
+		}
+	}
+	__atomic_store_n(&table, grown, __ATOMIC_RELEASE);
+	retired.push(old);
+}
+
+// Copies code into the arena, mapping a new chunk when it doesn't fit
+// into the current one. Returns NULL if the system has no memfd, in
+// which case the caller maps pages of its own.
+void * Jit_Arena::alloc(const uint8_t * code, size_t length, size_t page_size)
+{
+	const size_t align = 16;
+	size_t offset = (used + align - 1) & ~(align - 1);
+	if (!exec || offset + length > size) {
+		size_t chunk = 16 * page_size;
+		if (length > chunk) chunk = (length + page_size - 1) & ~(page_size - 1);
+		int fd = memfd_create("sync-jit", MFD_CLOEXEC);
+		if (fd < 0) return NULL;
+		if (ftruncate(fd, chunk) != 0) {
+			fatal("Could not allocate memory for generated code");
+		}
+		void * w = mmap(NULL, chunk, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		void * x = mmap(NULL, chunk, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+		close(fd);
+		if (w == MAP_FAILED || x == MAP_FAILED) {
+			fatal("Could not allocate memory for generated code");
+		}
+		// The unused tail of the previous chunk is given up
+		write = (uint8_t*) w;
+		exec = (uint8_t*) x;
+		size = chunk;
+		offset = 0;
+	}
+	memcpy(write + offset, code, length);
+	used = offset + length;
+	return exec + offset;
+}
+
+// Emits the program into the shared arena or, without one, into pages of
+// its own that are made executable only once written
+Jit_Function Jit_Cache::compile(List<Command> commands)
+{
+	Jit_Emitter emitter;
+	emitter.code.alloc();
+	emitter.emit(commands);
+	void * function = arena.alloc(emitter.code.arr, emitter.code.size, page_size);
+	if (!function) {
+		size_t size = (emitter.code.size + page_size - 1) & ~(page_size - 1);
+		void * pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pages == MAP_FAILED) {
+			fatal("Could not allocate memory for generated code");
+		}
+		memcpy(pages, emitter.code.arr, emitter.code.size);
+		if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0) {
+			fatal("Could not make generated code executable");
+		}
+		function = pages;
+	}
+	emitter.code.dealloc();
+	stats.jit_compiled++;
+	return (Jit_Function) function;
+}
+
+// Returns the native function for an eligible program given its shape
+// hash, compiling it the first time the shape is seen. Only a miss takes
+// the lock.
+Jit_Function Jit_Cache::get(List<Command> commands, uint64_t hash)
+{
+	Jit_Table * current = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+	Jit_Entry * entry = current->find(commands, hash);
+	Jit_Function function = __atomic_load_n(&entry->function, __ATOMIC_ACQUIRE);
+	if (function) return function;
+
+	pthread_mutex_lock(&mutex);
+	// Another thread may have compiled it in the meantime
+	entry = table->find(commands, hash);
+	function = entry->function;
+	if (!function) {
+		function = compile(commands);
+		entry->hash = hash;
+		entry->shape = commands.copy();
+		__atomic_store_n(&entry->function, function, __ATOMIC_RELEASE);
+		if (++used * 2 > table->size) grow();
+	}
+	pthread_mutex_unlock(&mutex);
+	return function;
+}
@@ -40,7 +40,7 @@ char * itoa(int integer)
 {
 	char buf[512];
 	sprintf(buf, "%d", integer);
-	return strdup(buf);
+	return mem_strdup(buf, MEM_PARSER);
 }
 
 char * Token::type_to_string(Token_Type type)
@@ -50,17 +50,17 @@ char * Token::type_to_string(Token_Type type)
 	}
 	switch (type) {
 	case TOKEN_EOF:
-		return strdup("EOF");
+		return mem_strdup("EOF", MEM_PARSER);
 	case TOKEN_PLACEHOLDER:
-		return strdup("_");
+		return mem_strdup("_", MEM_PARSER);
 	case TOKEN_NIL:
-		return strdup("nil");
+		return mem_strdup("nil", MEM_PARSER);
 	case TOKEN_SYMBOL:
-		return strdup("<symbol>");
+		return mem_strdup("<symbol>", MEM_PARSER);
 	case TOKEN_INTEGER_LITERAL:
-		return strdup("<integer>");
+		return mem_strdup("<integer>", MEM_PARSER);
 	case TOKEN_LEFT_ARROW:
-		return strdup("<-");
+		return mem_strdup("<-", MEM_PARSER);
 	default:
 		fatal("Token::type_to_string() switch incomplete");
 	}
@@ -72,11 +72,11 @@ char * Token::to_string()
 		char buf[2];
 		buf[0] = type;
 		buf[1] = '\0';
-		return strdup(buf);
+		return mem_strdup(buf, MEM_PARSER);
 	}
 	switch (type) {
 	case TOKEN_SYMBOL: {
-		return strdup(values.symbol);
+		return mem_strdup(values.symbol, MEM_PARSER);
 	}
 	case TOKEN_INTEGER_LITERAL: {
 		return itoa(values.integer);
@@ -156,7 +156,7 @@ Token Lexer::next_token()
 		
 		Token token;
 		token.type = TOKEN_SYMBOL;
-		token.values.symbol = strdup(buf);
+		token.values.symbol = mem_strdup(buf, MEM_PARSER);
 		return token;
 	}
 
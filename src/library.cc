@@ -0,0 +1,81 @@
+// Embedding API, see include/sync.h
+
+struct Sync_Context {
+	Execution_Context context;
+	char error[sizeof(fatal_message)];
+};
+
+// Makes context the calling thread's for the duration of an API call,
+// and puts back whichever the thread had before
+struct Context_Scope {
+	Execution_Context * outer;
+	Context_Scope(Execution_Context * context)
+	{
+		outer = exec_context;
+		exec_context = context;
+	}
+	~Context_Scope()
+	{
+		exec_context = outer;
+	}
+};
+
+SYNC_API void sync_set_threads(size_t threads)
+{
+	options.threads = threads;
+}
+
+SYNC_API Sync_Context * sync_create()
+{
+	Sync_Context * context = (Sync_Context*) mem_calloc(1, sizeof(Sync_Context), MEM_JOBS);
+	Context_Scope scope(&context->context);
+	exec_context->init();
+	exec_context->recover_errors = true;
+	return context;
+}
+
+SYNC_API void sync_destroy(Sync_Context * context)
+{
+	Context_Scope scope(&context->context);
+	exec_context->dealloc();
+	mem_free(context);
+}
+
+SYNC_API void sync_set_output(Sync_Context * context, FILE * output)
+{
+	context->context.output = output;
+}
+
+SYNC_API int sync_run(Sync_Context * context, const char * source)
+{
+	Context_Scope scope(&context->context);
+	if (run_source(source, NULL)) return 0;
+	snprintf(context->error, sizeof(context->error), "%s", fatal_message);
+	return -1;
+}
+
+SYNC_API int sync_format(Sync_Context * context, const char * variable, char * buffer, size_t size)
+{
+	Context_Scope scope(&context->context);
+	jmp_buf recovery;
+	jmp_buf * outer = fatal_recovery;
+	if (setjmp(recovery)) {
+		fatal_recovery = outer;
+		snprintf(context->error, sizeof(context->error), "%s", fatal_message);
+		return -1;
+	}
+	fatal_recovery = &recovery;
+	// Forces the variable if it was deferred, which may fail
+	Value value = lookup_binding(variable, NULL);
+	fatal_recovery = outer;
+	char * text = value.to_string();
+	value.release();
+	int length = snprintf(buffer, size, "%s", text);
+	mem_free(text);
+	return length;
+}
+
+SYNC_API const char * sync_error(Sync_Context * context)
+{
+	return context->error;
+}
@@ -0,0 +1,68 @@
+// Dead job elimination
+//
+// Walks the whole program backwards keeping the set of variables that
+// some later frame still reads. A side-effect free job whose variable
+// is not in that set, or that is bound to _, can never be observed and
+// is dropped before its frame runs. Jobs that would trip the duplicate
+// assignment check are kept so the error still surfaces.
+
+// Removes dead jobs from every frame in place and returns how many
+// were removed.
+size_t eliminate_dead_jobs(List<List<Job_Spec*>> program)
+{
+	size_t removed = 0;
+	Symbol_Set live, assigned, duplicated;
+	live.init();
+	assigned.init();
+	duplicated.init();
+	List<const char *> reads;
+	reads.alloc();
+
+	for (size_t f = program.size; f > 0; f--) {
+		List<Job_Spec*> * frame = &program[f - 1];
+
+		assigned.clear();
+		duplicated.clear();
+		for (int i = 0; i < frame->size; i++) {
+			const char * left = (*frame)[i]->left;
+			if (!left) continue;
+			if (assigned.contains(left)) {
+				duplicated.add(left);
+			} else {
+				assigned.add(left);
+			}
+		}
+
+		size_t kept = 0;
+		for (int i = 0; i < frame->size; i++) {
+			Job_Spec * spec = (*frame)[i];
+			bool observed = spec->left
+				&& (live.contains(spec->left) || duplicated.contains(spec->left));
+			if (!observed && expr_is_pure(spec->right)) {
+				removed++;
+				continue;
+			}
+			(*frame)[kept++] = spec;
+		}
+		frame->size = kept;
+
+		// A frame's jobs all read the previous frame's bindings, so its
+		// own assignments are killed before its reads are added.
+		for (int i = 0; i < frame->size; i++) {
+			if ((*frame)[i]->left) live.remove((*frame)[i]->left);
+		}
+		for (int i = 0; i < frame->size; i++) {
+			reads.clear();
+			(*frame)[i]->right->collect_variables(&reads);
+			for (int j = 0; j < reads.size; j++) {
+				live.add(reads[j]);
+			}
+		}
+	}
+
+	reads.dealloc();
+	live.dealloc();
+	assigned.dealloc();
+	duplicated.dealloc();
+	return removed;
+}
@@ -1,25 +1,4 @@
-#include <assert.h>
-#include <ctype.h>
-#include <pthread.h>
-#include <stdarg.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-
-#include "list.h" // Necessary evil
-
-// Unity build
-#include "utility.cc"
-#include "error.cc"
-#include "string_builder.cc"
-#include "lexer.cc"
-#include "collection.cc"
-#include "value.cc"
-#include "parser.cc"
-#include "bytecode.cc"
-#include "compiler.cc"
-#include "execution.cc"
+#include "unity.cc"
 
 namespace Collector {
 	void mark_value(Value value)
@@ -33,38 +12,143 @@ namespace Collector {
 			allocations[i].mark = false;
 		}
 		// Go through execution context and mark what you find
-		for (int i = 0; i < exec_context.var_space.values.size; i++) {
-			mark_value(exec_context.var_space.values[i]);
+		for (int p = 0; p < VARIABLE_PARTITIONS; p++) {
+			List<Binding> * bindings = &exec_context->var_space.current->partitions[p]->bindings;
+			for (int i = 0; i < bindings->size; i++) {
+				if (bindings->arr[i].key) mark_value(bindings->arr[i].value);
+			}
 		}
 	}
 };
 
+void finish_run()
+{
+	exec_context->finish();
+	if (options.profile_path) {
+		profiler.write_trace(options.profile_path);
+		profiler.report();
+	}
+#ifdef SYNC_VM_STATS
+	if (options.vm_stats) {
+		vm_stats.report();
+	}
+#endif
+	if (options.cache_path) {
+		result_cache.save();
+		stats.report_cache();
+	}
+	if (options.stats) {
+		stats.report();
+	}
+	if (options.intern_tuples) {
+		tuple_interner.report();
+	}
+	if (options.mem_stats) {
+		memory_stats.report();
+	}
+	if (options.bench) {
+		bench_timer.report();
+	}
+}
+
 int main(int argc, char ** argv)
 {
-	if (argc != 2) {
-		printf("Provide one source file\n");
-		return 1;
+	parse_options(argc, argv);
+	// Before anything is allocated, see memory.cc
+	if (options.mem_stats) {
+		memory_stats.init(options.mem_stats_frames);
+	}
+	if (options.bench) {
+		bench_timer.init();
 	}
 
 	Collector::init();
-	exec_context.init();
-	exec_context.var_space.bind("test", Value::make_integer(12));
+	if (options.jit) {
+		jit_cache.init();
+	}
+	if (options.cache_path) {
+		result_cache.open(options.cache_path);
+	}
+	// Once the caches jobs use are ready, and before the worker threads,
+	// which would not survive the fork
+	if (options.processes) {
+		process_pool.start(options.processes);
+	}
+	static Execution_Context main_context;
+	exec_context = &main_context;
+	exec_context->init();
+	if (options.profile_path) {
+		profiler.init(exec_context->cpu_count);
+	}
+#ifdef SYNC_VM_STATS
+	if (options.vm_stats) {
+		vm_stats.init(exec_context->cpu_count);
+	}
+#endif
+	if (options.intern_tuples) {
+		tuple_interner.init();
+	}
+	exec_context->var_space.bind("test", Value::make_integer(12));
+
+	if (options.serve) {
+		serve();
+		finish_run();
+		return 0;
+	}
+
+	if (is_bytecode_file(options.source_path)) {
+		if (options.disassemble) {
+			disassemble_bytecode_file(options.source_path);
+			return 0;
+		}
+		if (options.compile_path) {
+			fatal("%s is already compiled", options.source_path);
+		}
+		run_bytecode_file(options.source_path);
+		finish_run();
+		return 0;
+	}
+	if (options.disassemble) {
+		fatal("--disassemble expects a file written by --compile");
+	}
 	
-	const char * source = load_string_from_file(argv[1]);
+	const char * source = load_string_from_file(options.source_path);
+	if (!source) {
+		fatal("Could not read %s", options.source_path);
+	}
 	Lexer lexer(source);
 	Parser parser(&lexer);
 	
-	while (!parser.at_end()) {
-		List<Job_Spec*> frame_spec = parser.parse_frame_spec();
-		List<Job*> jobs;
-		jobs.alloc();
-		for (int i = 0; i < frame_spec.size; i++) {
-			Job * job = (Job*) malloc(sizeof(Job));
-			job->spec = frame_spec[i];
-			jobs.push(job);
+	if (options.skip_dead || options.compile_path) {
+		// Liveness and compilation need every frame up front
+		List<List<Job_Spec*>> program;
+		program.alloc();
+		while (!parser.at_end()) {
+			profiler.frame = program.size;
+			double start = profiler.now();
+			program.push(parser.parse_frame_spec());
+			profiler.record("parse", NULL, start, profiler.now());
+		}
+		if (options.skip_dead) {
+			stats.dead_jobs += eliminate_dead_jobs(program);
+		}
+		if (options.compile_path) {
+			compile_program(program, options.compile_path);
+			return 0;
+		}
+		for (int i = 0; i < program.size; i++) {
+			exec_context->run_frame(program[i]);
+		}
+	} else {
+		while (!parser.at_end()) {
+			profiler.frame = stats.frames;
+			double start = profiler.now();
+			List<Job_Spec*> frame_spec = parser.parse_frame_spec();
+			profiler.record("parse", NULL, start, profiler.now());
+			exec_context->run_frame(frame_spec);
 		}
-		exec_context.run_threads_for_jobs(jobs);
 	}
-	
+
+	finish_run();
 	return 0;
 }
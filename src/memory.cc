@@ -0,0 +1,200 @@
+// Memory accounting
+//
+// Everything the interpreter allocates goes through mem_alloc and
+// mem_free, attributed to a subsystem: either the tag passed in, or the
+// one the allocating thread is running, as set by a Memory_Scope. List
+// storage is attributed the second way.
+//
+// With --mem-stats, every allocation is preceded by a header holding its
+// size and tag, so that freeing it takes it off the right subsystem, and
+// live bytes, peak bytes and allocations are counted per subsystem and
+// printed at exit; --mem-stats=frames also prints them after every
+// frame. Without it, the functions call malloc and free and nothing else.
+// Tracking is switched on before the first allocation and never off.
+
+#define MEMORY_HEADER_SIZE 16
+
+struct Memory_Header {
+	size_t size;
+	Memory_Tag tag;
+};
+
+static_assert(sizeof(Memory_Header) <= MEMORY_HEADER_SIZE, "Memory header too large");
+
+static const char * memory_tag_names[MEM_TAG_COUNT] = {
+	"other",
+	"parser",
+	"compiler",
+	"jobs",
+	"vm",
+	"values",
+	"strings",
+	"variables",
+	"cache",
+	"profiler",
+};
+
+thread_local Memory_Tag memory_scope = MEM_OTHER;
+
+struct Memory_Counters {
+	size_t live;
+	size_t peak;
+	size_t allocations;
+	size_t allocated;
+};
+
+struct Memory_Stats {
+	bool enabled = false;
+	bool per_frame = false;
+	Memory_Counters tags[MEM_TAG_COUNT];
+	size_t live;
+	size_t peak;
+	// Peak since the last frame ended, and the frame with the highest
+	size_t frame_peak;
+	size_t peak_frame;
+	size_t peak_frame_bytes;
+	// Totals when the last frame ended
+	size_t frame_allocations;
+	size_t frame_allocated;
+	void init(bool per_frame)
+	{
+		enabled = true;
+		this->per_frame = per_frame;
+	}
+	static void raise_to(size_t * peak, size_t value)
+	{
+		size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+		while (value > seen && !__atomic_compare_exchange_n(peak, &seen, value, true,
+															__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	}
+	void add(Memory_Tag tag, size_t size)
+	{
+		Memory_Counters * counters = &tags[tag];
+		raise_to(&counters->peak, __atomic_add_fetch(&counters->live, size, __ATOMIC_RELAXED));
+		__atomic_add_fetch(&counters->allocations, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counters->allocated, size, __ATOMIC_RELAXED);
+		size_t total = __atomic_add_fetch(&live, size, __ATOMIC_RELAXED);
+		raise_to(&peak, total);
+		raise_to(&frame_peak, total);
+	}
+	void remove(Memory_Tag tag, size_t size)
+	{
+		__atomic_sub_fetch(&tags[tag].live, size, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&live, size, __ATOMIC_RELAXED);
+	}
+	// Called by the main thread once a frame's jobs have all finished
+	void end_frame(size_t frame);
+	void report();
+};
+
+Memory_Stats memory_stats;
+
+void * mem_alloc(size_t size, Memory_Tag tag)
+{
+	if (!memory_stats.enabled) return malloc(size);
+	char * block = (char*) malloc(MEMORY_HEADER_SIZE + size);
+	if (!block) return NULL;
+	*(Memory_Header*) block = (Memory_Header) { size, tag };
+	memory_stats.add(tag, size);
+	return block + MEMORY_HEADER_SIZE;
+}
+
+void * mem_calloc(size_t count, size_t size, Memory_Tag tag)
+{
+	void * ptr = mem_alloc(count * size, tag);
+	if (ptr) memset(ptr, 0, count * size);
+	return ptr;
+}
+
+// A reallocated block stays with the subsystem that first allocated it
+void * mem_realloc(void * ptr, size_t size, Memory_Tag tag)
+{
+	if (!memory_stats.enabled) return realloc(ptr, size);
+	if (!ptr) return mem_alloc(size, tag);
+	char * block = (char*) ptr - MEMORY_HEADER_SIZE;
+	Memory_Header header = *(Memory_Header*) block;
+	block = (char*) realloc(block, MEMORY_HEADER_SIZE + size);
+	if (!block) return NULL;
+	((Memory_Header*) block)->size = size;
+	memory_stats.remove(header.tag, header.size);
+	memory_stats.add(header.tag, size);
+	return block + MEMORY_HEADER_SIZE;
+}
+
+char * mem_strdup(const char * s, Memory_Tag tag)
+{
+	size_t size = strlen(s) + 1;
+	char * copy = (char*) mem_alloc(size, tag);
+	memcpy(copy, s, size);
+	return copy;
+}
+
+void mem_free(void * ptr)
+{
+	if (!memory_stats.enabled || !ptr) {
+		free(ptr);
+		return;
+	}
+	char * block = (char*) ptr - MEMORY_HEADER_SIZE;
+	Memory_Header * header = (Memory_Header*) block;
+	memory_stats.remove(header->tag, header->size);
+	free(block);
+}
+
+static void print_bytes(FILE * file, const char * format, size_t bytes)
+{
+	char text[32];
+	if (bytes >= 1 << 30) snprintf(text, sizeof(text), "%.1f GB", bytes / (double) (1 << 30));
+	else if (bytes >= 1 << 20) snprintf(text, sizeof(text), "%.1f MB", bytes / (double) (1 << 20));
+	else if (bytes >= 1 << 10) snprintf(text, sizeof(text), "%.1f KB", bytes / (double) (1 << 10));
+	else snprintf(text, sizeof(text), "%zu B", bytes);
+	fprintf(file, format, text);
+}
+
+void Memory_Stats::end_frame(size_t frame)
+{
+	if (!enabled) return;
+	if (frame_peak > peak_frame_bytes) {
+		peak_frame_bytes = frame_peak;
+		peak_frame = frame;
+	}
+	if (per_frame) {
+		size_t allocations = 0, allocated = 0;
+		for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+			allocations += tags[tag].allocations;
+			allocated += tags[tag].allocated;
+		}
+		fprintf(stderr, "memory: frame %-6zu", frame);
+		print_bytes(stderr, " %10s live,", live);
+		print_bytes(stderr, " %10s peak,", frame_peak);
+		fprintf(stderr, " %zu allocations of", allocations - frame_allocations);
+		print_bytes(stderr, " %s;", allocated - frame_allocated);
+		for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+			if (tags[tag].live == 0) continue;
+			fprintf(stderr, " %s", memory_tag_names[tag]);
+			print_bytes(stderr, " %s", tags[tag].live);
+		}
+		fprintf(stderr, "\n");
+		frame_allocations = allocations;
+		frame_allocated = allocated;
+	}
+	frame_peak = live;
+}
+
+void Memory_Stats::report()
+{
+	print_bytes(stderr, "memory: %s live at exit, ", live);
+	print_bytes(stderr, "%s at peak", peak);
+	if (peak_frame_bytes) fprintf(stderr, " (during frame %zu)", peak_frame);
+	fprintf(stderr, "\n  %-10s %10s %10s %12s %10s\n",
+			"subsystem", "live", "peak", "allocations", "allocated");
+	for (int tag = 0; tag < MEM_TAG_COUNT; tag++) {
+		Memory_Counters * counters = &tags[tag];
+		if (counters->allocations == 0) continue;
+		fprintf(stderr, "  %-10s", memory_tag_names[tag]);
+		print_bytes(stderr, " %10s", counters->live);
+		print_bytes(stderr, " %10s", counters->peak);
+		fprintf(stderr, " %12zu", counters->allocations);
+		print_bytes(stderr, " %10s\n", counters->allocated);
+	}
+}
@@ -0,0 +1,229 @@
+// Operators
+//
+// All of these consume the references they are handed and return an
+// owned result. When an operand tuple is uniquely owned its payload is
+// reused for the result instead of being copied.
+
+Value apply_unary(Unary_Op op, Value operand);
+Value apply_binary(Binary_Op op, Value left, Value right);
+
+const char * value_type_name(Value_Type type)
+{
+	switch (type) {
+	case VALUE_NIL:
+		return "nil";
+	case VALUE_INTEGER:
+		return "integer";
+	case VALUE_TUPLE:
+		return "tuple";
+	case VALUE_THUNK:
+		return "thunk";
+	default:
+		fatal_internal("value_type_name() type switch incomplete");
+	}
+	return NULL;
+}
+
+const char * binary_op_symbol(Binary_Op op)
+{
+	switch (op) {
+	case BINARY_PLUS:
+		return "+";
+	case BINARY_MINUS:
+		return "-";
+	case BINARY_MULTIPLY:
+		return "*";
+	case BINARY_DIVIDE:
+		return "/";
+	default:
+		fatal_internal("binary_op_symbol() switch incomplete");
+	}
+	return NULL;
+}
+
+int integer_binary(Binary_Op op, int left, int right)
+{
+	switch (op) {
+	case BINARY_PLUS:
+		return left + right;
+	case BINARY_MINUS:
+		return left - right;
+	case BINARY_MULTIPLY:
+		return left * right;
+	case BINARY_DIVIDE:
+		return left / right;
+	default:
+		fatal_internal("Invalid binary operator reached integer_binary()");
+	}
+	return 0;
+}
+
+// Returns a payload the caller may overwrite element by element: the
+// operand's own payload when it can be claimed, otherwise a fresh one
+// of the same length whose elements are still uninitialized.
+static Tuple * writable_tuple_for(Value * operand)
+{
+	Tuple * claimed = operand->claim_payload();
+	if (claimed) return claimed;
+	return Tuple::make(operand->tuple.length);
+}
+
+// Takes an owned reference to element i of the operand. When the
+// payload is being reused the element is moved out, otherwise shared.
+static Value take_element(Value operand, Tuple * dest, size_t i)
+{
+	Value element = operand.tuple.elements()[i];
+	if (operand.tuple.data != dest) element.retain();
+	return element;
+}
+
+static Value map_unary(Unary_Op op, Value operand)
+{
+	Tuple * dest = writable_tuple_for(&operand);
+	for (size_t i = 0; i < operand.tuple.length; i++) {
+		dest->elements[i] = apply_unary(op, take_element(operand, dest, i));
+	}
+	if (dest != operand.tuple.data) operand.release();
+	return Value::make_tuple(dest);
+}
+
+// Applies op between every element of a tuple and a scalar, keeping the
+// scalar on the side it was written on.
+static Value broadcast(Binary_Op op, Value tuple, Value scalar, bool scalar_on_left)
+{
+	Tuple * dest = writable_tuple_for(&tuple);
+	for (size_t i = 0; i < tuple.tuple.length; i++) {
+		Value element = take_element(tuple, dest, i);
+		dest->elements[i] = scalar_on_left
+			? apply_binary(op, scalar, element)
+			: apply_binary(op, element, scalar);
+	}
+	if (dest != tuple.tuple.data) tuple.release();
+	return Value::make_tuple(dest);
+}
+
+// Appends right onto left. A uniquely owned left grows in place, so a
+// loop of the form `a <- a + [x]` only ever copies the new elements.
+static Value concatenate(Value left, Value right)
+{
+	size_t left_length = left.tuple.length;
+	size_t right_length = right.tuple.length;
+	bool same_payload = left.tuple.data == right.tuple.data;
+
+	Tuple * dest = same_payload ? NULL : left.claim_payload();
+	if (dest) {
+		dest->reserve(left_length + right_length);
+	} else {
+		dest = Tuple::make(left_length + right_length);
+		Value * elements = left.tuple.elements();
+		for (size_t i = 0; i < left_length; i++) {
+			dest->elements[i] = elements[i];
+			dest->elements[i].retain();
+		}
+		left.release();
+	}
+
+	Tuple * stolen = same_payload ? NULL : right.claim_payload();
+	if (stolen) {
+		memcpy(dest->elements + left_length, stolen->elements, sizeof(Value) * right_length);
+		stolen->free_shell();
+	} else {
+		Value * elements = right.tuple.elements();
+		for (size_t i = 0; i < right_length; i++) {
+			dest->elements[left_length + i] = elements[i];
+			dest->elements[left_length + i].retain();
+		}
+		right.release();
+	}
+	dest->length = left_length + right_length;
+	return Value::make_tuple(dest);
+}
+
+static void expect_index_type(const char * builtin, Value value, Value_Type type)
+{
+	if (value.type != type) {
+		fatal("%s expected %s, got %s", builtin,
+			  value_type_name(type), value_type_name(value.type));
+	}
+}
+
+// Returns the element at index without copying it. Nested tuples come
+// back as a new reference to the element's own payload.
+Value index_tuple(Value tuple, Value index)
+{
+	expect_index_type("index", tuple, VALUE_TUPLE);
+	expect_index_type("index", index, VALUE_INTEGER);
+	if (index.integer < 0 || index.integer >= tuple.tuple.length) {
+		fatal("Index %d out of range for tuple of length %u",
+			  index.integer, tuple.tuple.length);
+	}
+	Value element = tuple.tuple.elements()[index.integer];
+	element.retain();
+	tuple.release();
+	return element;
+}
+
+// Returns elements [start, end) as a view into the same payload. The
+// reference held on the operand is handed over to the view, so slicing
+// neither allocates nor touches the reference count.
+Value slice_tuple(Value tuple, Value start, Value end)
+{
+	expect_index_type("slice", tuple, VALUE_TUPLE);
+	expect_index_type("slice", start, VALUE_INTEGER);
+	expect_index_type("slice", end, VALUE_INTEGER);
+	if (start.integer < 0 || end.integer < start.integer || end.integer > tuple.tuple.length) {
+		fatal("Slice [%d, %d) out of range for tuple of length %u",
+			  start.integer, end.integer, tuple.tuple.length);
+	}
+	return Value::make_view(tuple.tuple.data,
+							tuple.tuple.offset + start.integer,
+							end.integer - start.integer);
+}
+
+Value tuple_length(Value tuple)
+{
+	expect_index_type("length", tuple, VALUE_TUPLE);
+	int length = tuple.tuple.length;
+	tuple.release();
+	return Value::make_integer(length);
+}
+
+Value apply_unary(Unary_Op op, Value operand)
+{
+	switch (op) {
+	case UNARY_MINUS: {
+		switch (operand.type) {
+		case VALUE_INTEGER:
+			return Value::make_integer(-operand.integer);
+		case VALUE_TUPLE:
+			return map_unary(op, operand);
+		default:
+			fatal("Cannot negate a value of type %s", value_type_name(operand.type));
+		}
+	} break;
+	default:
+		fatal_internal("Invalid unary operator reached apply_unary()");
+	}
+	return Value::with_type(VALUE_NIL);
+}
+
+Value apply_binary(Binary_Op op, Value left, Value right)
+{
+	if (left.type == VALUE_INTEGER && right.type == VALUE_INTEGER) {
+		return Value::make_integer(integer_binary(op, left.integer, right.integer));
+	}
+	if (left.type == VALUE_TUPLE && right.type == VALUE_TUPLE) {
+		if (op == BINARY_PLUS) {
+			return concatenate(left, right);
+		}
+	} else if (left.type == VALUE_TUPLE && right.type == VALUE_INTEGER) {
+		return broadcast(op, left, right, false);
+	} else if (left.type == VALUE_INTEGER && right.type == VALUE_TUPLE) {
+		return broadcast(op, right, left, true);
+	}
+	fatal("Operator %s is not defined between %s and %s",
+		  binary_op_symbol(op),
+		  value_type_name(left.type),
+		  value_type_name(right.type));
+	return Value::with_type(VALUE_NIL);
+}
@@ -0,0 +1,197 @@
+// Command line options
+
+enum Vm_Kind {
+	VM_STACK,
+	VM_REGISTER,
+};
+
+// Estimated cost of the jobs a batch would send to worker processes
+// below which it runs in this process alone, see processes.cc
+#define PROCESS_THRESHOLD 65536
+
+struct Options {
+	char * source_path = NULL;
+	bool cse = true;
+	bool stats = false;
+	bool skip_dead = false;
+	bool lazy = false;
+	const char * cache_path = NULL;
+	const char * compile_path = NULL;
+	bool disassemble = false;
+	bool jit = false;
+	bool specialize = true;
+	bool fuse = true;
+	bool schedule = true;
+	Vm_Kind vm = VM_STACK;
+	// Number of workers, or 0 to use every CPU available
+	size_t threads = 0;
+	bool pin = false;
+	// Estimated cost below which jobs run without the workers, or -1 to
+	// calibrate it at startup
+	long inline_threshold = -1;
+	const char * profile_path = NULL;
+	bool vm_stats = false;
+	bool bench = false;
+	bool mem_stats = false;
+	bool mem_stats_frames = false;
+	bool intern_tuples = false;
+	// Run frames as they arrive, from stdin or, if serve_path is set,
+	// from every client of the Unix socket there
+	bool serve = false;
+	const char * serve_path = NULL;
+	// Number of worker processes wide batches are split across, if any,
+	// and the estimated cost a batch's jobs must reach to be split
+	size_t processes = 0;
+	long process_threshold = PROCESS_THRESHOLD;
+};
+
+Options options;
+
+void print_usage()
+{
+	printf("Usage: sync [options] <source file>\n"
+		   "       sync [options] --serve[=PATH]\n"
+		   "  --no-cse     Don't share identical subexpressions between jobs\n"
+		   "  --stats      Print optimization statistics at exit\n"
+		   "  --skip-dead  Drop jobs whose results are never read\n"
+		   "  --lazy       Only evaluate assignments once they are looked up\n"
+		   "  --cache=PATH Reuse results of unchanged jobs from earlier runs\n"
+		   "  --no-specialize  Don't specialize operators on integers\n"
+		   "  --no-fuse    Don't combine integer operators with their operands\n"
+		   "  --no-schedule  Run jobs one at a time in source order\n"
+		   "  --vm=KIND    Run jobs on the 'stack' (default) or 'register' VM\n"
+		   "  --jit        Run integer-only jobs as native code\n"
+		   "  --threads=N  Run N workers instead of one per available CPU\n"
+		   "  --pin        Keep each worker on its own CPU\n"
+		   "  --inline-threshold=N  Run batches of jobs estimated to cost less\n"
+		   "               than N on the main thread (default: calibrated)\n"
+		   "  --profile=PATH  Write a Chrome trace of the run to PATH and\n"
+		   "               print the slowest frames and jobs at exit\n"
+		   "  --bench      Print throughput and frame latencies as JSON at exit\n"
+		   "  --mem-stats  Print memory use by subsystem at exit\n"
+		   "  --mem-stats=frames  Also print it after every frame\n"
+		   "  --intern-tuples  Share one copy of equal tuples between variables\n"
+		   "  --vm-stats   Count the commands the VM runs (make vm-stats builds only)\n"
+		   "  --processes=N  Split wide batches of jobs across N worker processes\n"
+		   "  --process-threshold=N  Only split batches estimated to cost at\n"
+		   "               least N (default: %d)\n"
+		   "  --serve      Run frames read from stdin as they arrive, answering\n"
+		   "               each with ok or error: and a message\n"
+		   "  --serve=PATH  Do the same for every client of a Unix socket at\n"
+		   "               PATH, each with variables of its own\n"
+		   "  --compile=OUT  Write the compiled program to OUT instead of running it\n"
+		   "  --disassemble  Print the commands in a compiled program\n"
+		   "A source file written by --compile is run without being parsed.\n",
+		   PROCESS_THRESHOLD);
+}
+
+void parse_options(int argc, char ** argv)
+{
+	for (int i = 1; i < argc; i++) {
+		char * arg = argv[i];
+		if (strcmp(arg, "--no-cse") == 0) {
+			options.cse = false;
+		} else if (strcmp(arg, "--stats") == 0) {
+			options.stats = true;
+		} else if (strcmp(arg, "--skip-dead") == 0) {
+			options.skip_dead = true;
+		} else if (strcmp(arg, "--lazy") == 0) {
+			options.lazy = true;
+		} else if (strncmp(arg, "--cache=", 8) == 0) {
+			options.cache_path = arg + 8;
+		} else if (strcmp(arg, "--no-specialize") == 0) {
+			options.specialize = false;
+		} else if (strcmp(arg, "--no-fuse") == 0) {
+			options.fuse = false;
+		} else if (strcmp(arg, "--no-schedule") == 0) {
+			options.schedule = false;
+		} else if (strncmp(arg, "--vm=", 5) == 0) {
+			if (strcmp(arg + 5, "stack") == 0) {
+				options.vm = VM_STACK;
+			} else if (strcmp(arg + 5, "register") == 0) {
+				options.vm = VM_REGISTER;
+			} else {
+				fatal("Unknown VM '%s', expected 'stack' or 'register'", arg + 5);
+			}
+		} else if (strcmp(arg, "--jit") == 0) {
+			options.jit = true;
+		} else if (strncmp(arg, "--threads=", 10) == 0) {
+			char * end;
+			long threads = strtol(arg + 10, &end, 10);
+			if (end == arg + 10 || *end || threads < 1) {
+				fatal("Expected a positive number of threads, got '%s'", arg + 10);
+			}
+			options.threads = threads;
+		} else if (strncmp(arg, "--inline-threshold=", 19) == 0) {
+			char * end;
+			long threshold = strtol(arg + 19, &end, 10);
+			if (end == arg + 19 || *end || threshold < 0) {
+				fatal("Expected a non-negative inline threshold, got '%s'", arg + 19);
+			}
+			options.inline_threshold = threshold;
+		} else if (strncmp(arg, "--processes=", 12) == 0) {
+			char * end;
+			long processes = strtol(arg + 12, &end, 10);
+			if (end == arg + 12 || *end || processes < 1) {
+				fatal("Expected a positive number of processes, got '%s'", arg + 12);
+			}
+			options.processes = processes;
+		} else if (strncmp(arg, "--process-threshold=", 20) == 0) {
+			char * end;
+			long threshold = strtol(arg + 20, &end, 10);
+			if (end == arg + 20 || *end || threshold < 0) {
+				fatal("Expected a non-negative process threshold, got '%s'", arg + 20);
+			}
+			options.process_threshold = threshold;
+		} else if (strcmp(arg, "--pin") == 0) {
+			options.pin = true;
+		} else if (strncmp(arg, "--profile=", 10) == 0) {
+			options.profile_path = arg + 10;
+		} else if (strcmp(arg, "--bench") == 0) {
+			options.bench = true;
+		} else if (strcmp(arg, "--mem-stats") == 0) {
+			options.mem_stats = true;
+		} else if (strcmp(arg, "--mem-stats=frames") == 0) {
+			options.mem_stats = true;
+			options.mem_stats_frames = true;
+		} else if (strcmp(arg, "--intern-tuples") == 0) {
+			options.intern_tuples = true;
+		} else if (strcmp(arg, "--vm-stats") == 0) {
+#ifndef SYNC_VM_STATS
+			fatal("--vm-stats needs a build with -DSYNC_VM_STATS, such as make vm-stats");
+#endif
+			options.vm_stats = true;
+		} else if (strncmp(arg, "--compile=", 10) == 0) {
+			options.compile_path = arg + 10;
+		} else if (strcmp(arg, "--disassemble") == 0) {
+			options.disassemble = true;
+		} else if (strcmp(arg, "--serve") == 0) {
+			options.serve = true;
+		} else if (strncmp(arg, "--serve=", 8) == 0) {
+			options.serve = true;
+			options.serve_path = arg + 8;
+		} else if (strcmp(arg, "--help") == 0) {
+			print_usage();
+			exit(0);
+		} else if (arg[0] == '-' && arg[1] == '-') {
+			fatal("Unknown option %s", arg);
+		} else if (options.source_path) {
+			fatal("Provide one source file");
+		} else {
+			options.source_path = arg;
+		}
+	}
+	if (options.serve) {
+		if (options.source_path) {
+			fatal("--serve reads frames as they arrive, not from a source file");
+		}
+		if (options.skip_dead || options.compile_path || options.disassemble) {
+			fatal("--serve can't be combined with options that need the whole program");
+		}
+		return;
+	}
+	if (!options.source_path) {
+		print_usage();
+		exit(1);
+	}
+}
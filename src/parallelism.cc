@@ -0,0 +1,57 @@
+// Inline execution policy
+//
+// Handing a batch to the workers and waiting for them costs tens of
+// microseconds, far more than a frame of a few small jobs takes to run.
+// Batches of jobs whose estimated cost is below a threshold run on the
+// calling thread instead. The threshold is the cost above which
+// spreading the work over the workers saves more time than handing it
+// over takes. Handing over and a small synthetic batch are timed once
+// when the workers start, and the time per unit of estimated cost is
+// then tracked from every batch, inline or not.
+
+struct Parallelism_Policy {
+	size_t workers;
+	// Time to hand a batch to the workers and have it back, see
+	// Worker_Pool::start()
+	double fan_out_ns;
+	// Moving average over batches, starting from the calibration in
+	// Worker_Pool::calibrate(). 0 when there is a single worker or the
+	// threshold is fixed.
+	double ns_per_cost;
+	void init(size_t workers, double fan_out_ns, double ns_per_cost)
+	{
+		this->workers = workers;
+		this->fan_out_ns = fan_out_ns;
+		this->ns_per_cost = ns_per_cost;
+	}
+	// Estimated cost below which a batch runs inline
+	size_t threshold()
+	{
+		if (options.inline_threshold >= 0) return options.inline_threshold;
+		if (ns_per_cost == 0) return SIZE_MAX;
+		// n workers save (1 - 1/n) of the time the batch would take alone
+		double saved_per_cost = ns_per_cost * (1.0 - 1.0 / workers);
+		return (size_t) (fan_out_ns / saved_per_cost);
+	}
+	bool should_fan_out(size_t cost)
+	{
+		return workers > 1 && cost >= threshold();
+	}
+	void record(double sample)
+	{
+		ns_per_cost = ns_per_cost == 0 ? sample : 0.875 * ns_per_cost + 0.125 * sample;
+	}
+	void record_inline(size_t cost, double elapsed_ns)
+	{
+		if (cost == 0) return;
+		record(elapsed_ns / cost);
+	}
+	// A batch on n workers takes the hand-off plus a nth of the time it
+	// would take alone. Batches that took less than the hand-off say
+	// nothing about the jobs.
+	void record_fan_out(size_t cost, double elapsed_ns)
+	{
+		if (cost == 0 || elapsed_ns <= fan_out_ns) return;
+		record((elapsed_ns - fan_out_ns) * workers / cost);
+	}
+};
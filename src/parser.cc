@@ -6,6 +6,7 @@ enum Expr_Type {
 	EXPR_UNARY,
 	EXPR_BINARY,
 	EXPR_FUNCALL,
+	EXPR_SLOT,
 };
 
 enum Unary_Op {
@@ -19,11 +20,15 @@ enum Binary_Op {
 	BINARY_DIVIDE,
 };
 
+// Children of tuples and calls kept in the node itself. Two covers most
+// calls and short tuples while keeping Expr at 48 bytes.
+#define EXPR_INLINE_CHILDREN 2
+
 struct Expr {
 	Expr_Type type;
 	union {
 		int integer;
-		List<Expr*> tuple;
+		List<Expr*, EXPR_INLINE_CHILDREN> tuple;
 		const char * variable;
 		struct {
 			Unary_Op op;
@@ -36,22 +41,180 @@ struct Expr {
 		} binary;
 		struct {
 			const char * symbol;
-			List<Expr*> arguments;
+			List<Expr*, EXPR_INLINE_CHILDREN> arguments;
 		} funcall;
+		// Result of a subexpression precomputed earlier in the frame
+		size_t slot;
 	};
+	// Bytes an expression of the given type takes up: the type and the
+	// union member it uses, and at least a slot, which CSE can turn any
+	// expression into
+	static size_t size_for(Expr_Type type)
+	{
+		static Expr probe;
+		size_t header = (char*) &probe.slot - (char*) &probe;
+		size_t payload = sizeof(probe.slot);
+		switch (type) {
+		case EXPR_TUPLE:
+			payload = sizeof(probe.tuple);
+			break;
+		case EXPR_UNARY:
+			payload = sizeof(probe.unary);
+			break;
+		case EXPR_BINARY:
+			payload = sizeof(probe.binary);
+			break;
+		case EXPR_FUNCALL:
+			payload = sizeof(probe.funcall);
+			break;
+		default:
+			break;
+		}
+		return header + payload;
+	}
 	static Expr * with_type(Expr_Type type)
 	{
-		Expr * expr = (Expr*) malloc(sizeof(Expr));
+		Expr * expr = (Expr*) mem_alloc(size_for(type), MEM_PARSER);
 		expr->type = type;
 		return expr;
 	}
+	int child_count()
+	{
+		switch (type) {
+		case EXPR_TUPLE:
+			return tuple.size;
+		case EXPR_UNARY:
+			return 1;
+		case EXPR_BINARY:
+			return 2;
+		case EXPR_FUNCALL:
+			return funcall.arguments.size;
+		default:
+			return 0;
+		}
+	}
+	Expr * child(int i)
+	{
+		switch (type) {
+		case EXPR_TUPLE:
+			return tuple[i];
+		case EXPR_UNARY:
+			return unary.expr;
+		case EXPR_BINARY:
+			return i == 0 ? binary.left : binary.right;
+		case EXPR_FUNCALL:
+			return funcall.arguments[i];
+		default:
+			fatal_internal("Expr::child() called on a leaf expression");
+		}
+		return NULL;
+	}
+	// Hash of this node's own fields, not including its children
+	uint64_t local_hash()
+	{
+		uint64_t hash = hash_combine(type, child_count());
+		switch (type) {
+		case EXPR_INTEGER:
+			return hash_combine(hash, (uint32_t) integer);
+		case EXPR_VARIABLE:
+			return hash_combine(hash, hash_string(variable));
+		case EXPR_UNARY:
+			return hash_combine(hash, unary.op);
+		case EXPR_BINARY:
+			return hash_combine(hash, binary.op);
+		case EXPR_FUNCALL:
+			return hash_combine(hash, hash_string(funcall.symbol));
+		case EXPR_SLOT:
+			return hash_combine(hash, slot);
+		default:
+			return hash;
+		}
+	}
+	uint64_t hash()
+	{
+		uint64_t hash = local_hash();
+		for (int i = 0; i < child_count(); i++) {
+			hash = hash_combine(hash, child(i)->hash());
+		}
+		return hash;
+	}
+	bool equals(Expr * other)
+	{
+		if (this == other) return true;
+		if (type != other->type || child_count() != other->child_count()) return false;
+		switch (type) {
+		case EXPR_INTEGER:
+			if (integer != other->integer) return false;
+			break;
+		case EXPR_VARIABLE:
+			if (strcmp(variable, other->variable) != 0) return false;
+			break;
+		case EXPR_UNARY:
+			if (unary.op != other->unary.op) return false;
+			break;
+		case EXPR_BINARY:
+			if (binary.op != other->binary.op) return false;
+			break;
+		case EXPR_FUNCALL:
+			if (strcmp(funcall.symbol, other->funcall.symbol) != 0) return false;
+			break;
+		case EXPR_SLOT:
+			if (slot != other->slot) return false;
+			break;
+		default:
+			break;
+		}
+		for (int i = 0; i < child_count(); i++) {
+			if (!child(i)->equals(other->child(i))) return false;
+		}
+		return true;
+	}
+	// Appends every variable read by this expression, once per
+	// occurrence, in evaluation order.
+	void collect_variables(List<const char *> * out)
+	{
+		switch (type) {
+		case EXPR_NIL:
+		case EXPR_INTEGER:
+		case EXPR_SLOT:
+			break;
+		case EXPR_TUPLE:
+			for (int i = 0; i < tuple.size; i++) {
+				tuple[i]->collect_variables(out);
+			}
+			break;
+		case EXPR_VARIABLE:
+			out->push(variable);
+			break;
+		case EXPR_UNARY:
+			unary.expr->collect_variables(out);
+			break;
+		case EXPR_BINARY:
+			binary.left->collect_variables(out);
+			binary.right->collect_variables(out);
+			break;
+		case EXPR_FUNCALL:
+			for (int i = 0; i < funcall.arguments.size; i++) {
+				funcall.arguments[i]->collect_variables(out);
+			}
+			break;
+		default:
+			fatal_internal("Expr::collect_variables() type switch incomplete");
+		}
+	}
 	char * to_string()
 	{
 		switch (type) {
 		case EXPR_INTEGER:
 			return itoa(integer);
 		case EXPR_VARIABLE:
-			return strdup(variable);
+			return mem_strdup(variable);
+		case EXPR_SLOT: {
+			String_Builder builder;
+			builder.append_char('$');
+			builder.append_integer(slot);
+			return builder.final_string();
+		}
 		case EXPR_UNARY: {
 			String_Builder builder;
 			builder.append("(");
@@ -64,7 +227,7 @@ struct Expr {
 			}
 			char * expr_s = unary.expr->to_string();
 			builder.append(expr_s);
-			free(expr_s);
+			mem_free(expr_s);
 			builder.append(")");
 			return builder.final_string();
 		}
@@ -74,7 +237,7 @@ struct Expr {
 			{
 				char * left_s = binary.left->to_string();
 				builder.append(left_s);
-				free(left_s);
+				mem_free(left_s);
 			}
 			switch (binary.op) {
 			case BINARY_PLUS:
@@ -93,7 +256,7 @@ struct Expr {
 			{
 				char * right_s = binary.right->to_string();
 				builder.append(right_s);
-				free(right_s);
+				mem_free(right_s);
 			}
 			builder.append(")");
 			return builder.final_string();
@@ -106,7 +269,7 @@ struct Expr {
 			for (int i = 0; i < funcall.arguments.size; i++) {
 				char * s = funcall.arguments[i]->to_string();
 				builder.append(s);
-				free(s);
+				mem_free(s);
 				if (i < funcall.arguments.size - 1) {
 					builder.append(" . ");
 				}
@@ -137,7 +300,7 @@ struct Job_Spec {
 		{
 			char * right_s = right->to_string();
 			builder.append(right_s);
-			free(right_s);
+			mem_free(right_s);
 		}
 		builder.append("]");
 		return builder.final_string();
@@ -247,7 +410,7 @@ Expr * Parser::parse_atom()
 
 Expr * Parser::parse_tuple()
 {
-	List<Expr*> tuple;
+	List<Expr*, EXPR_INLINE_CHILDREN> tuple;
 	tuple.alloc();
 	expect((Token_Type) '[');
 	while (true) {
@@ -258,7 +421,7 @@ Expr * Parser::parse_tuple()
 		tuple.push(parse_expression());
 	}
 	Expr * expr = Expr::with_type(EXPR_TUPLE);
-	expr->tuple = tuple;
+	expr->tuple = tuple.move();
 	return expr;
 }
 
@@ -271,7 +434,9 @@ Expr * Parser::parse_expr_0()
 			advance();
 			Expr * expr = Expr::with_type(EXPR_FUNCALL);
 			expr->funcall.symbol = symbol_tok.values.symbol;
-			expr->funcall.arguments = parse_tuple()->tuple; // @temporary
+			Expr * arguments = parse_tuple(); // @temporary
+			expr->funcall.arguments = arguments->tuple.move();
+			mem_free(arguments);
 			return expr;
 		} else {
 			// Variable
@@ -353,7 +518,7 @@ Job_Spec * Parser::parse_job_spec()
 	expect(TOKEN_LEFT_ARROW);
 	Expr * right = parse_expression();
 	
-	Job_Spec * spec = (Job_Spec*) malloc(sizeof(Job_Spec));
+	Job_Spec * spec = (Job_Spec*) mem_alloc(sizeof(Job_Spec), MEM_PARSER);
 	spec->left = symbol;
 	spec->right = right;
 	return spec;
@@ -361,6 +526,7 @@ Job_Spec * Parser::parse_job_spec()
 
 List<Job_Spec*> Parser::parse_frame_spec()
 {
+	Memory_Scope scope(MEM_PARSER);
 	List<Job_Spec*> frame_spec;
 	frame_spec.alloc();
 	while (true) {
@@ -0,0 +1,487 @@
+// Worker processes
+//
+// With --processes=N, N worker processes are forked at startup, each
+// connected to the interpreter by a socket pair, and wide batches of jobs
+// are split into shards across them. A shard is a one-frame bytecode
+// image of its jobs, as --compile would write it, followed by the value
+// of every variable and slot those jobs read. A worker runs its shard on
+// one thread and answers with the result of each job in order, which is
+// published to the frame's assignment table like any other, so repeated
+// assignments are caught and the frame is committed as usual. The jobs
+// left behind run on the worker threads meanwhile.
+//
+// Only jobs that assign a variable, have no side effects and read no
+// deferred values are sent, and only once those in a batch are estimated
+// to cost at least --process-threshold. With --cache, the interpreter
+// looks them up before sending them and stores the results that come
+// back. Nothing but the socket pairs relies on the workers sharing a
+// machine with the interpreter.
+//
+// Messages are a uint64_t length followed by that many bytes, in host
+// byte order. A shard is
+//   uint64_t image_bytes, then the image
+//   uint32_t binding_count, then per binding the uint32_t index of its
+//                           symbol in the image and its value
+//   uint32_t slot_count, then per slot its uint32_t index and its value
+// with values as serialize_value() writes them. The answer is a 0 byte
+// followed by the value of every job, or a 1 byte followed by the
+// NUL-terminated message of the error the shard failed with.
+
+static bool write_all(int fd, const char * data, size_t size)
+{
+	while (size > 0) {
+		// A worker that died must not take the interpreter down by SIGPIPE
+		ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static bool read_all(int fd, char * data, size_t size)
+{
+	while (size > 0) {
+		ssize_t got = read(fd, data, size);
+		if (got < 0 && errno == EINTR) continue;
+		if (got <= 0) return false;
+		data += got;
+		size -= got;
+	}
+	return true;
+}
+
+static bool send_message(int fd, List<char> * message)
+{
+	uint64_t length = message->size;
+	return write_all(fd, (const char *) &length, sizeof(length))
+		&& write_all(fd, message->arr, message->size);
+}
+
+// Returns false once the other end has hung up
+static bool receive_message(int fd, List<char> * message)
+{
+	uint64_t length;
+	if (!read_all(fd, (char *) &length, sizeof(length))) return false;
+	message->clear();
+	message->possibly_grow_to_size(length);
+	message->size = length;
+	return read_all(fd, message->arr, length);
+}
+
+static bool read_bytes(const char ** cursor, const char * end, void * out, size_t size)
+{
+	if ((size_t) (end - *cursor) < size) return false;
+	memcpy(out, *cursor, size);
+	*cursor += size;
+	return true;
+}
+
+static void push_u32(List<char> * out, uint32_t value)
+{
+	out->push_array((const char *) &value, sizeof(value));
+}
+
+// Runs the shard in request against the calling thread's context, which
+// is left with no variables or slots afterwards, and writes the answer
+static void run_shard(List<char> * request, List<char> * answer)
+{
+	Execution_Context * context = exec_context;
+	// Static so that they are still current after a longjmp. Workers run
+	// one shard at a time.
+	static List<Job*> precompute, jobs;
+	answer->clear();
+	jmp_buf recovery;
+	Memory_Tag scope = memory_scope;
+	if (setjmp(recovery)) {
+		// Only a corrupt shard gets here, since jobs recover on their own
+		memory_scope = scope;
+		answer->clear();
+		answer->push(1);
+		answer->push_array(fatal_message, strlen(fatal_message) + 1);
+	} else {
+		fatal_recovery = &recovery;
+		const char * cursor = request->arr;
+		const char * end = request->arr + request->size;
+		uint64_t image_bytes;
+		if (!read_bytes(&cursor, end, &image_bytes, sizeof(image_bytes))
+			|| image_bytes > (uint64_t) (end - cursor)) {
+			fatal("Worker process got a truncated shard");
+		}
+		Bytecode_Image image;
+		image.open_buffer(cursor, image_bytes, "shard");
+		cursor += image_bytes;
+		if (image.header->frame_count != 1 || image.frames[0].precompute_count != 0) {
+			fatal("Worker process got a shard that is not one frame of jobs");
+		}
+		image.load_frame(0, &precompute, &jobs);
+
+		uint32_t count;
+		if (!read_bytes(&cursor, end, &count, sizeof(count))) {
+			fatal("Worker process got a truncated shard");
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t symbol;
+			Value value;
+			if (!read_bytes(&cursor, end, &symbol, sizeof(symbol))
+				|| !deserialize_value(&cursor, end, &value)) {
+				fatal("Worker process got a shard with a corrupt binding");
+			}
+			context->var_space.bind(image.symbol(symbol), value);
+		}
+		for (uint32_t i = 0; i < image.frames[0].filled_slots; i++) {
+			context->slots.push(Value::with_type(VALUE_NIL));
+		}
+		if (!read_bytes(&cursor, end, &count, sizeof(count))) {
+			fatal("Worker process got a truncated shard");
+		}
+		for (uint32_t i = 0; i < count; i++) {
+			uint32_t slot;
+			Value value;
+			if (!read_bytes(&cursor, end, &slot, sizeof(slot))
+				|| slot >= context->slots.size
+				|| !deserialize_value(&cursor, end, &value)) {
+				fatal("Worker process got a shard with a corrupt slot");
+			}
+			value.share();
+			context->slots[slot].release();
+			context->slots[slot] = value;
+		}
+
+		answer->push(0);
+		for (int i = 0; i < jobs.size && !context->failed; i++) {
+			Assignment assign;
+			if (run_job_recovering(jobs[i], &assign)) {
+				serialize_value(assign.value, answer);
+				assign.value.release();
+			}
+		}
+		if (context->failed) {
+			answer->clear();
+			answer->push(1);
+			answer->push_array(context->error, strlen(context->error) + 1);
+			context->failed = false;
+		}
+	}
+	fatal_recovery = NULL;
+
+	for (int i = 0; i < precompute.size; i++) precompute[i]->dealloc();
+	for (int i = 0; i < jobs.size; i++) jobs[i]->dealloc();
+	precompute.dealloc();
+	jobs.dealloc();
+	for (int i = 0; i < context->slots.size; i++) {
+		context->slots[i].release();
+	}
+	context->slots.clear();
+	context->var_space.current->release();
+	context->var_space.init();
+}
+
+// Body of a worker process. Runs shards until the interpreter hangs up.
+static void run_process_worker(int fd)
+{
+	static Execution_Context context;
+	options.threads = 1;
+	// Already looked up by the interpreter, which also keeps the results
+	options.cache_path = NULL;
+	exec_context = &context;
+	context.init();
+	context.recover_errors = true;
+	List<char> request, answer;
+	request.alloc();
+	answer.alloc();
+	Memory_Scope scope(MEM_JOBS);
+	while (receive_message(fd, &request)) {
+		run_shard(&request, &answer);
+		if (!send_message(fd, &answer)) break;
+	}
+	_exit(0);
+}
+
+// Whether a job can run in a worker process, against copies of the
+// variables it reads
+static bool can_run_remotely(Job * job, Variable_Space * space)
+{
+	if (!job->left || job->slot != -1 || !job->is_pure()) return false;
+	List<const char *> symbols;
+	symbols.alloc();
+	job->collect_reads(&symbols);
+	bool remote = true;
+	for (int i = 0; i < symbols.size && remote; i++) {
+		Value * value = space->find(symbols[i]);
+		if (value && value->type == VALUE_THUNK) remote = false;
+	}
+	symbols.dealloc();
+	return remote;
+}
+
+struct Process_Pool {
+	// Held from sending a batch until its answers are in, so contexts
+	// take turns
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	size_t size = 0;
+	// The interpreter's end of each worker's socket pair
+	List<int> sockets;
+	// Jobs sent to each worker in the batch in flight, in the order
+	// their results come back, and their keys in the result cache
+	List<List<Job*>> shards;
+	List<List<Cache_Key>> cache_keys;
+	List<char> message;
+	void start(size_t count);
+	size_t send(List<Job*> jobs);
+	void receive();
+	void build_shard(List<Job*> shard);
+	void worker_failed(size_t worker, const char * problem);
+};
+
+Process_Pool process_pool;
+
+// Forks the workers. Must run before any other thread is started, since
+// only the forking thread carries over into a worker.
+void Process_Pool::start(size_t count)
+{
+	sockets.alloc();
+	shards.alloc();
+	cache_keys.alloc();
+	message.alloc();
+	// Anything still buffered would otherwise be written again by every
+	// worker that exits
+	fflush(NULL);
+	for (size_t i = 0; i < count; i++) {
+		int pair[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+			fatal("Could not create a socket for worker process %zu: %s", i, strerror(errno));
+		}
+		pid_t pid = fork();
+		if (pid < 0) {
+			fatal("Could not start worker process %zu: %s", i, strerror(errno));
+		}
+		if (pid == 0) {
+			// Workers only keep their own end, so each sees the
+			// interpreter hang up as soon as it exits
+			for (int j = 0; j < sockets.size; j++) {
+				close(sockets[j]);
+			}
+			close(pair[0]);
+			size = 0;
+			run_process_worker(pair[1]);
+		}
+		close(pair[1]);
+		sockets.push(pair[0]);
+		List<Job*> shard;
+		shard.alloc();
+		shards.push(shard);
+		List<Cache_Key> keys;
+		keys.alloc();
+		cache_keys.push(keys);
+	}
+	size = count;
+}
+
+// Writes a shard of jobs, and the variables and slots they read in the
+// calling thread's context, to message
+void Process_Pool::build_shard(List<Job*> shard)
+{
+	Execution_Context * context = exec_context;
+	message.clear();
+	uint64_t image_bytes = 0;
+	message.push_array((const char *) &image_bytes, sizeof(image_bytes));
+	Bytecode_Writer writer;
+	writer.init();
+	List<Job*> none;
+	none.alloc();
+	writer.add_frame(none, shard, context->slots.size);
+	none.dealloc();
+	writer.encode(&message);
+	image_bytes = message.size - sizeof(image_bytes);
+	memcpy(message.arr, &image_bytes, sizeof(image_bytes));
+
+	// Every symbol a job reads is in the image, which numbers them
+	List<bool> sent;
+	sent.alloc();
+	for (int i = 0; i < writer.symbol_offsets.size; i++) sent.push(false);
+	size_t count_at = message.size;
+	uint32_t count = 0;
+	push_u32(&message, 0);
+	List<const char *> symbols;
+	symbols.alloc();
+	for (int i = 0; i < shard.size; i++) {
+		symbols.clear();
+		shard[i]->collect_reads(&symbols);
+		for (int j = 0; j < symbols.size; j++) {
+			uint32_t index = writer.symbols.index_of(symbols[j]);
+			if (sent[index]) continue;
+			sent[index] = true;
+			// Unbound variables are left for the worker to fail on
+			Value * value = context->var_space.find(symbols[j]);
+			if (!value) continue;
+			push_u32(&message, index);
+			serialize_value(*value, &message);
+			count++;
+		}
+	}
+	symbols.dealloc();
+	memcpy(&message.arr[count_at], &count, sizeof(count));
+
+	sent.clear();
+	for (int i = 0; i < context->slots.size; i++) sent.push(false);
+	count_at = message.size;
+	count = 0;
+	push_u32(&message, 0);
+	for (int i = 0; i < shard.size; i++) {
+		List<Command> commands = shard[i]->commands;
+		for (int j = 0; j < commands.size; j++) {
+			if (commands[j].type != CMD_LOAD_SLOT) continue;
+			size_t slot = commands[j].load_slot.slot;
+			if (sent[slot]) continue;
+			sent[slot] = true;
+			push_u32(&message, slot);
+			serialize_value(context->slots[slot], &message);
+			count++;
+		}
+	}
+	memcpy(&message.arr[count_at], &count, sizeof(count));
+	sent.dealloc();
+	writer.dealloc();
+}
+
+// The pool can't go on without every worker, so this ends the process
+// even in contexts that recover from errors
+void Process_Pool::worker_failed(size_t worker, const char * problem)
+{
+	fatal_recovery = NULL;
+	fatal("Worker process %zu %s", worker, problem);
+}
+
+// Moves the jobs worth running in worker processes to the end of jobs,
+// sends out those not found in the result cache, and returns how many
+// were moved. When any were, the pool stays held until receive() has
+// collected their results.
+size_t Process_Pool::send(List<Job*> jobs)
+{
+	Execution_Context * context = exec_context;
+	Variable_Space * space = &context->var_space;
+	size_t total_cost = 0;
+	size_t remote = 0;
+	for (int i = 0; i < jobs.size; i++) {
+		Job * job = jobs[i];
+		job->order = i;
+		if (!can_run_remotely(job, space)) {
+			job->cost = 0;
+			continue;
+		}
+		// A job that costs nothing still has to be sent, and is marked
+		// as remote by a non-zero cost
+		job->cost = estimate_cost(job, space) + 1;
+		total_cost += job->cost;
+		remote++;
+	}
+	if (remote == 0 || total_cost < (size_t) options.process_threshold) return 0;
+
+	Memory_Scope scope(MEM_JOBS);
+	List<Job*> sent;
+	sent.alloc();
+	size_t kept = 0;
+	for (int i = 0; i < jobs.size; i++) {
+		if (jobs[i]->cost) {
+			sent.push(jobs[i]);
+		} else {
+			jobs[kept++] = jobs[i];
+		}
+	}
+	memcpy(&jobs.arr[kept], sent.arr, sizeof(Job*) * sent.size);
+
+	pthread_mutex_lock(&mutex);
+	// Costliest first, each to the worker with the least so far
+	qsort(sent.arr, sent.size, sizeof(Job*), compare_job_costs);
+	List<size_t> loads;
+	loads.alloc();
+	for (size_t i = 0; i < size; i++) {
+		loads.push(0);
+		shards[i].clear();
+		cache_keys[i].clear();
+	}
+	for (int i = 0; i < sent.size; i++) {
+		Job * job = sent[i];
+		// Sent jobs are always cacheable, since they assign and have no
+		// side effects. Keyed before specialization, as run_job() does.
+		Cache_Key key = {};
+		if (options.cache_path) {
+			Value result;
+			job->compile();
+			job_cache_key(job, &key);
+			if (result_cache.lookup(key, &result)) {
+				context->assignments->publish(job->left, result);
+				continue;
+			}
+		}
+		size_t lightest = 0;
+		for (size_t j = 1; j < size; j++) {
+			if (loads[j] < loads[lightest]) lightest = j;
+		}
+		loads[lightest] += job->cost;
+		shards[lightest].push(job);
+		cache_keys[lightest].push(key);
+	}
+	loads.dealloc();
+	sent.dealloc();
+	for (size_t i = 0; i < size; i++) {
+		if (shards[i].size == 0) continue;
+		build_shard(shards[i]);
+		if (!send_message(sockets[i], &message)) worker_failed(i, "has exited");
+		__atomic_add_fetch(&stats.process_jobs, shards[i].size, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&stats.process_batches, 1, __ATOMIC_RELAXED);
+	return remote;
+}
+
+// Publishes the results of the batch in flight to the calling thread's
+// context. An error in a shard fails the frame, as one in any other job
+// would.
+void Process_Pool::receive()
+{
+	Execution_Context * context = exec_context;
+	Memory_Scope scope(MEM_JOBS);
+	char error[sizeof(fatal_message)];
+	error[0] = '\0';
+	for (size_t i = 0; i < size; i++) {
+		List<Job*> shard = shards[i];
+		if (shard.size == 0) continue;
+		if (!receive_message(sockets[i], &message)) worker_failed(i, "has exited");
+		const char * cursor = message.arr;
+		const char * end = message.arr + message.size;
+		char status;
+		if (!read_bytes(&cursor, end, &status, 1)) worker_failed(i, "sent an empty answer");
+		if (status != 0) {
+			if (!error[0]) snprintf(error, sizeof(error), "%.*s", (int) (end - cursor), cursor);
+			continue;
+		}
+		for (int j = 0; j < shard.size; j++) {
+			Value value;
+			if (!deserialize_value(&cursor, end, &value)) worker_failed(i, "sent a corrupt answer");
+			if (options.cache_path) {
+				result_cache.store(cache_keys[i][j], value, shard[j]->commands.size);
+			}
+			context->assignments->publish(shard[j]->left, value);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	if (error[0]) {
+		if (!context->recover_errors) fatal("%s", error);
+		context->fail(error);
+	}
+}
+
+size_t send_to_processes(List<Job*> jobs)
+{
+	if (process_pool.size == 0) return 0;
+	return process_pool.send(jobs);
+}
+
+void receive_from_processes()
+{
+	process_pool.receive();
+}
@@ -0,0 +1,264 @@
+// Execution profiler
+//
+// With --profile=PATH, the interpreter records a timed span for every
+// phase of every frame and for every job, and at exit writes them to
+// PATH in the Chrome trace format, which chrome://tracing and Perfetto
+// open, and prints a summary of the slowest frames and jobs.
+//
+// Each thread records into a ring buffer of its own, so recording takes
+// no locks. Buffers belong to thread slots rather than threads: slot 0
+// is the main thread, slot i + 1 is worker i, whichever thread is
+// running it, and the last slot is the background commit. A full
+// buffer overwrites its oldest spans.
+
+#define PROFILE_BUFFER_SIZE (1 << 18)
+#define PROFILE_SLOWEST_JOBS 10
+#define PROFILE_PHASES 16
+
+struct Profile_Span {
+	const char * name;
+	// Variable a job assigns, or NULL
+	const char * detail;
+	double start;
+	double end;
+	uint32_t frame;
+	// Jobs run, for frame, batch and worker spans
+	uint32_t count;
+	double duration()
+	{
+		return end - start;
+	}
+};
+
+struct Profile_Phase {
+	const char * name;
+	double total;
+};
+
+// Everything one slot records. The totals, the slowest jobs and the busy
+// time cover the whole run, even once the ring has wrapped.
+struct Profile_Buffer {
+	Profile_Span * spans;
+	// Spans ever recorded, including overwritten ones
+	size_t recorded;
+	Profile_Phase phases[PROFILE_PHASES];
+	size_t phase_count;
+	Profile_Span slowest[PROFILE_SLOWEST_JOBS];
+	size_t slowest_count;
+	// Time spent running jobs in the current frame
+	double busy;
+	// When the slot's worker last ran out of jobs
+	double finished;
+	size_t size()
+	{
+		return recorded < PROFILE_BUFFER_SIZE ? recorded : PROFILE_BUFFER_SIZE;
+	}
+	Profile_Span * at(size_t i)
+	{
+		size_t first = recorded - size();
+		return &spans[(first + i) % PROFILE_BUFFER_SIZE];
+	}
+	void add(Profile_Span span)
+	{
+		spans[recorded++ % PROFILE_BUFFER_SIZE] = span;
+		// Span names are string literals, so comparing pointers suffices
+		size_t i = 0;
+		while (i < phase_count && phases[i].name != span.name) i++;
+		if (i == phase_count && phase_count < PROFILE_PHASES) {
+			phases[phase_count++] = (Profile_Phase) { span.name, 0 };
+		}
+		if (i < phase_count) phases[i].total += span.duration();
+		if (strcmp(span.name, "job") != 0) return;
+		busy += span.duration();
+		// Keeps slowest sorted, longest first
+		if (slowest_count == PROFILE_SLOWEST_JOBS) {
+			if (span.duration() <= slowest[slowest_count - 1].duration()) return;
+			slowest_count--;
+		}
+		size_t j = slowest_count++;
+		while (j > 0 && slowest[j - 1].duration() < span.duration()) {
+			slowest[j] = slowest[j - 1];
+			j--;
+		}
+		slowest[j] = span;
+	}
+};
+
+struct Profile_Frame {
+	uint32_t index;
+	uint32_t jobs;
+	double wall;
+	double busy;
+};
+
+thread_local size_t profile_slot = 0;
+
+struct Profiler {
+	bool enabled = false;
+	double origin;
+	// Frame the spans being recorded belong to. Only written by the main
+	// thread, while no workers are running.
+	uint32_t frame = 0;
+	size_t slot_count;
+	Profile_Buffer * buffers;
+	List<Profile_Frame> frames;
+	void init(size_t workers)
+	{
+		enabled = true;
+		origin = monotonic_ns();
+		slot_count = workers + 2;
+		buffers = (Profile_Buffer*) mem_calloc(slot_count, sizeof(Profile_Buffer), MEM_PROFILER);
+		for (size_t i = 0; i < slot_count; i++) {
+			buffers[i].spans = (Profile_Span*) mem_alloc(sizeof(Profile_Span) * PROFILE_BUFFER_SIZE, MEM_PROFILER);
+		}
+		frames.alloc();
+	}
+	size_t commit_slot()
+	{
+		return slot_count - 1;
+	}
+	double now()
+	{
+		return enabled ? monotonic_ns() : 0;
+	}
+	void record(const char * name, const char * detail, double start, double end, uint32_t count = 0)
+	{
+		if (!enabled) return;
+		buffers[profile_slot].add((Profile_Span) { name, detail, start, end, frame, count });
+	}
+	// Records into another thread's slot, which must not be running
+	void record_for(size_t slot, const char * name, double start, double end)
+	{
+		size_t own = profile_slot;
+		profile_slot = slot;
+		record(name, NULL, start, end);
+		profile_slot = own;
+	}
+	// Called by the main thread once a frame's jobs have all finished
+	void end_frame(double start, double end, uint32_t jobs)
+	{
+		if (!enabled) return;
+		record("frame", NULL, start, end, jobs);
+		double busy = 0;
+		for (size_t i = 0; i < slot_count; i++) {
+			busy += buffers[i].busy;
+			buffers[i].busy = 0;
+		}
+		frames.push((Profile_Frame) { frame, jobs, end - start, busy });
+	}
+	void write_trace(const char * path);
+	void report();
+};
+
+Profiler profiler;
+
+static void write_json_string(FILE * file, const char * s)
+{
+	fputc('"', file);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\') fputc('\\', file);
+		fputc(*s, file);
+	}
+	fputc('"', file);
+}
+
+void Profiler::write_trace(const char * path)
+{
+	FILE * file = fopen(path, "w");
+	if (!file) {
+		fatal("Could not write profile to %s", path);
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (size_t slot = 0; slot < slot_count; slot++) {
+		char name[32];
+		if (slot == 0) snprintf(name, sizeof(name), "main");
+		else if (slot == commit_slot()) snprintf(name, sizeof(name), "commit");
+		else snprintf(name, sizeof(name), "worker %zu", slot - 1);
+		fprintf(file, "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%zu,"
+				"\"args\":{\"name\":\"%s\"}},\n", slot, name);
+		fprintf(file, "{\"ph\":\"M\",\"name\":\"thread_sort_index\",\"pid\":1,\"tid\":%zu,"
+				"\"args\":{\"sort_index\":%zu}},\n", slot, slot);
+	}
+	bool first = true;
+	for (size_t slot = 0; slot < slot_count; slot++) {
+		Profile_Buffer * buffer = &buffers[slot];
+		for (size_t i = 0; i < buffer->size(); i++) {
+			Profile_Span * span = buffer->at(i);
+			fprintf(file, "%s{\"ph\":\"X\",\"name\":", first ? "" : ",\n");
+			write_json_string(file, span->detail ? span->detail : span->name);
+			fprintf(file, ",\"cat\":\"%s\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,"
+					"\"args\":{\"frame\":%u",
+					span->name, slot, (span->start - origin) / 1000,
+					(span->end - span->start) / 1000, span->frame);
+			if (span->count) fprintf(file, ",\"jobs\":%u", span->count);
+			fprintf(file, "}}");
+			first = false;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+}
+
+static int compare_frames_by_duration(const void * a, const void * b)
+{
+	double left = ((Profile_Frame*) a)->wall;
+	double right = ((Profile_Frame*) b)->wall;
+	return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static int compare_spans_by_duration(const void * a, const void * b)
+{
+	double left = ((Profile_Span*) a)->duration();
+	double right = ((Profile_Span*) b)->duration();
+	return left < right ? 1 : left > right ? -1 : 0;
+}
+
+void Profiler::report()
+{
+	// Totals by span name across slots, in the order first seen
+	List<Profile_Phase> phases;
+	phases.alloc();
+	List<Profile_Span> jobs;
+	jobs.alloc();
+	size_t dropped = 0;
+	for (size_t slot = 0; slot < slot_count; slot++) {
+		Profile_Buffer * buffer = &buffers[slot];
+		dropped += buffer->recorded - buffer->size();
+		for (size_t i = 0; i < buffer->phase_count; i++) {
+			int n = 0;
+			while (n < phases.size && phases[n].name != buffer->phases[i].name) n++;
+			if (n == phases.size) phases.push((Profile_Phase) { buffer->phases[i].name, 0 });
+			phases[n].total += buffer->phases[i].total;
+		}
+		for (size_t i = 0; i < buffer->slowest_count; i++) {
+			jobs.push(buffer->slowest[i]);
+		}
+	}
+
+	size_t workers = slot_count - 2;
+	fprintf(stderr, "profile: time by phase, summed over threads\n");
+	for (int i = 0; i < phases.size; i++) {
+		fprintf(stderr, "  %-10s %12.3f ms\n", phases[i].name, phases[i].total / 1e6);
+	}
+	qsort(frames.arr, frames.size, sizeof(Profile_Frame), compare_frames_by_duration);
+	fprintf(stderr, "profile: slowest frames\n");
+	for (int i = 0; i < frames.size && i < 5; i++) {
+		Profile_Frame * frame = &frames[i];
+		fprintf(stderr, "  frame %-6u %10.3f ms, %u jobs, %.0f%% of %zu workers busy\n",
+				frame->index, frame->wall / 1e6, frame->jobs,
+				frame->wall > 0 ? 100.0 * frame->busy / (frame->wall * workers) : 0.0, workers);
+	}
+	qsort(jobs.arr, jobs.size, sizeof(Profile_Span), compare_spans_by_duration);
+	fprintf(stderr, "profile: slowest jobs\n");
+	for (int i = 0; i < jobs.size && i < PROFILE_SLOWEST_JOBS; i++) {
+		Profile_Span * span = &jobs[i];
+		fprintf(stderr, "  frame %-6u %10.3f ms  %s\n", span->frame,
+				span->duration() / 1e6, span->detail ? span->detail : "_");
+	}
+	if (dropped) {
+		fprintf(stderr, "profile: the trace holds the last %d spans of each thread, "
+				"%zu older ones were dropped\n", PROFILE_BUFFER_SIZE, dropped);
+	}
+	phases.dealloc();
+	jobs.dealloc();
+}
@@ -0,0 +1,309 @@
+// Register VM
+//
+// With --vm=register, a job's commands are translated into three-address
+// instructions before it runs. Every stack slot becomes a register, with
+// slot k held in register k, and constants, lookups and slot loads are
+// folded into the operands of the instruction that consumes them rather
+// than being executed on their own. `a + b * 3` is five stack commands
+// but two register instructions: r1 = b * 3, r0 = a + r1.
+//
+// Each operand is consumed exactly once, as its stack slot would have
+// been popped, so ownership of values works as it does in VM::execute.
+
+enum Operand_Kind {
+	OPERAND_REGISTER,
+	OPERAND_CONST,
+	OPERAND_LOOKUP,
+	OPERAND_LOOKUP_MOVE,
+	OPERAND_SLOT,
+};
+
+struct Operand {
+	Operand_Kind kind;
+	union {
+		size_t reg;
+		Value constant;
+		const char * symbol;
+		size_t slot;
+	};
+};
+
+enum Register_Op {
+	REG_LOAD,       // dst = a
+	REG_UNARY,      // dst = op a
+	REG_BINARY,     // dst = a op b
+	REG_INT_NEGATE, // As REG_UNARY and REG_BINARY, on proven integers
+	REG_INT_BINARY,
+	REG_OUTPUT,     // Prints a
+	REG_MAKE_TUPLE, // dst = [r(dst) .. r(dst + length - 1)]
+	REG_INDEX,      // dst = index: [a b]
+	REG_SLICE,      // dst = slice: [a b c]
+	REG_LENGTH,     // dst = length: [a]
+};
+
+struct Register_Instruction {
+	Register_Op op;
+	union {
+		Unary_Op unary;
+		Binary_Op binary;
+		size_t length;
+	};
+	size_t dst;
+	Operand a, b, c;
+};
+
+static Operand register_operand(size_t reg)
+{
+	Operand operand;
+	operand.kind = OPERAND_REGISTER;
+	operand.reg = reg;
+	return operand;
+}
+
+// Loads pending operands from first up into their own registers
+static void materialize(List<Operand> * pending, size_t first,
+						List<Register_Instruction> * out, size_t * register_count)
+{
+	for (size_t k = first; k < pending->size; k++) {
+		if ((*pending)[k].kind == OPERAND_REGISTER) continue;
+		Register_Instruction load;
+		load.op = REG_LOAD;
+		load.dst = k;
+		load.a = (*pending)[k];
+		out->push(load);
+		(*pending)[k] = register_operand(k);
+		if (k + 1 > *register_count) *register_count = k + 1;
+	}
+}
+
+// Translates stack commands, specialized but not fused, into register
+// instructions. Returns the number of registers used.
+size_t translate_to_registers(List<Command> commands, List<Register_Instruction> * out)
+{
+	// Operands not yet consumed, standing in for the stack
+	List<Operand> pending;
+	pending.alloc();
+	size_t register_count = 0;
+
+	for (int i = 0; i < commands.size; i++) {
+		Command cmd = commands[i];
+		Register_Instruction instr;
+		Operand operand;
+		switch (cmd.type) {
+		case CMD_LOAD_CONST:
+			operand.kind = OPERAND_CONST;
+			operand.constant = cmd.load_const.constant;
+			pending.push(operand);
+			continue;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+			operand.kind = cmd.type == CMD_LOOKUP ? OPERAND_LOOKUP : OPERAND_LOOKUP_MOVE;
+			operand.symbol = cmd.lookup.symbol;
+			pending.push(operand);
+			continue;
+		case CMD_LOAD_SLOT:
+			operand.kind = OPERAND_SLOT;
+			operand.slot = cmd.load_slot.slot;
+			pending.push(operand);
+			continue;
+		case CMD_UNARY_OP:
+		case CMD_INT_NEGATE:
+			instr.op = cmd.type == CMD_UNARY_OP ? REG_UNARY : REG_INT_NEGATE;
+			instr.unary = cmd.unary_op.op;
+			instr.a = pending.pop();
+			break;
+		case CMD_BINARY_OP:
+		case CMD_INT_ADD:
+		case CMD_INT_SUBTRACT:
+		case CMD_INT_MULTIPLY:
+		case CMD_INT_DIVIDE:
+			// Specialized commands keep the operator in binary_op
+			instr.op = cmd.type == CMD_BINARY_OP ? REG_BINARY : REG_INT_BINARY;
+			instr.binary = cmd.binary_op.op;
+			instr.b = pending.pop();
+			instr.a = pending.pop();
+			break;
+		case CMD_OUTPUT:
+			// Lookups still pending were made before the output by the
+			// stack VM, and may fail or force a thunk, so they happen first
+			materialize(&pending, 0, out, &register_count);
+			instr.op = REG_OUTPUT;
+			instr.a = pending.pop();
+			out->push(instr);
+			continue;
+		case CMD_MAKE_TUPLE: {
+			// Elements are read from consecutive registers
+			size_t first = pending.size - cmd.make_tuple.length;
+			materialize(&pending, first, out, &register_count);
+			pending.size = first;
+			instr.op = REG_MAKE_TUPLE;
+			instr.length = cmd.make_tuple.length;
+		} break;
+		case CMD_INDEX:
+			instr.op = REG_INDEX;
+			instr.b = pending.pop();
+			instr.a = pending.pop();
+			break;
+		case CMD_SLICE:
+			instr.op = REG_SLICE;
+			instr.c = pending.pop();
+			instr.b = pending.pop();
+			instr.a = pending.pop();
+			break;
+		case CMD_LENGTH:
+			instr.op = REG_LENGTH;
+			instr.a = pending.pop();
+			break;
+		default:
+			fatal_internal("Command %s cannot be translated to registers",
+						   command_type_name(cmd.type));
+		}
+		instr.dst = pending.size;
+		if (instr.dst + 1 > register_count) register_count = instr.dst + 1;
+		out->push(instr);
+		pending.push(register_operand(instr.dst));
+	}
+
+	// A job that only loads a value still needs it in a register
+	assert(pending.size == 1);
+	materialize(&pending, 0, out, &register_count);
+	pending.dealloc();
+	return register_count;
+}
+
+struct Register_VM {
+	Value * registers;
+	// Bindings captured by a thunk, read instead of the variable space
+	List<Assignment> * env = NULL;
+	Value take(Operand operand);
+	int take_integer(Operand operand);
+	void execute(List<Register_Instruction> code);
+};
+
+// Returns an owned reference to the operand's value
+Value Register_VM::take(Operand operand)
+{
+	switch (operand.kind) {
+	case OPERAND_REGISTER:
+		return registers[operand.reg];
+	case OPERAND_CONST:
+		return operand.constant;
+	case OPERAND_LOOKUP:
+		return lookup_binding(operand.symbol, env);
+	case OPERAND_LOOKUP_MOVE: {
+		Value value = exec_context->var_space.take(operand.symbol);
+		if (value.type == VALUE_THUNK) {
+			Value result = force_thunk(value.thunk);
+			value.release();
+			value = result;
+		}
+		return value;
+	}
+	case OPERAND_SLOT: {
+		Value value = exec_context->slots[operand.slot];
+		value.retain();
+		return value;
+	}
+	default:
+		fatal_internal("Register_VM::take() switch incomplete");
+	}
+	return Value::with_type(VALUE_NIL);
+}
+
+// Reads an operand proven to be an integer, which needs no reference
+// counting, so bindings are read in place even when they could move
+int Register_VM::take_integer(Operand operand)
+{
+	switch (operand.kind) {
+	case OPERAND_REGISTER:
+		return registers[operand.reg].integer;
+	case OPERAND_CONST:
+		return operand.constant.integer;
+	case OPERAND_LOOKUP:
+	case OPERAND_LOOKUP_MOVE:
+		if (env) return lookup_binding(operand.symbol, env).integer;
+		return exec_context->var_space.lookup(operand.symbol).integer;
+	case OPERAND_SLOT:
+		return exec_context->slots[operand.slot].integer;
+	default:
+		fatal_internal("Register_VM::take_integer() switch incomplete");
+	}
+	return 0;
+}
+
+void Register_VM::execute(List<Register_Instruction> code)
+{
+	for (size_t i = 0; i < code.size; i++) {
+		Register_Instruction * instr = &code.arr[i];
+		switch (instr->op) {
+		case REG_LOAD:
+			registers[instr->dst] = take(instr->a);
+			break;
+		case REG_UNARY:
+			registers[instr->dst] = apply_unary(instr->unary, take(instr->a));
+			break;
+		case REG_BINARY: {
+			Value left = take(instr->a);
+			Value right = take(instr->b);
+			registers[instr->dst] = apply_binary(instr->binary, left, right);
+		} break;
+		case REG_INT_NEGATE:
+			registers[instr->dst] = Value::make_integer(-take_integer(instr->a));
+			break;
+		case REG_INT_BINARY: {
+			int left = take_integer(instr->a);
+			int right = take_integer(instr->b);
+			registers[instr->dst] = Value::make_integer(integer_binary(instr->binary, left, right));
+		} break;
+		case REG_OUTPUT: {
+			static thread_local String_Builder line;
+			line.clear();
+			Value value = take(instr->a);
+			value.format(&line);
+			value.release();
+			line.append_char('\n');
+			fwrite(line.builder.arr, 1, line.builder.size, exec_context->output);
+		} break;
+		case REG_MAKE_TUPLE: {
+			Tuple * tuple = Tuple::make(instr->length);
+			memcpy(tuple->elements, &registers[instr->dst], sizeof(Value) * instr->length);
+			registers[instr->dst] = Value::make_tuple(tuple);
+		} break;
+		case REG_INDEX: {
+			Value tuple = take(instr->a);
+			Value index = take(instr->b);
+			registers[instr->dst] = index_tuple(tuple, index);
+		} break;
+		case REG_SLICE: {
+			Value tuple = take(instr->a);
+			Value start = take(instr->b);
+			Value end = take(instr->c);
+			registers[instr->dst] = slice_tuple(tuple, start, end);
+		} break;
+		case REG_LENGTH:
+			registers[instr->dst] = tuple_length(take(instr->a));
+			break;
+		default:
+			fatal_internal("Invalid instruction reached Register_VM::execute()");
+		}
+	}
+}
+
+// Runs a job's commands on the register VM and returns its result
+Value run_register_vm(List<Command> commands, List<Assignment> * env)
+{
+	List<Register_Instruction> code;
+	code.alloc();
+	size_t register_count = translate_to_registers(commands, &code);
+	__atomic_add_fetch(&stats.vm_commands, code.size, __ATOMIC_RELAXED);
+
+	Value local[16];
+	Register_VM vm;
+	vm.registers = register_count <= 16 ? local : (Value*) mem_alloc(sizeof(Value) * register_count, MEM_VM);
+	vm.env = env;
+	vm.execute(code);
+	Value result = vm.registers[0];
+	if (vm.registers != local) mem_free(vm.registers);
+	code.dealloc();
+	return result;
+}
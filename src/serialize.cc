@@ -0,0 +1,89 @@
+// Value serialization
+//
+// Values are written as a one byte tag followed by their payload in
+// host byte order: nothing for nil, four bytes for an integer, and a
+// four byte length followed by the elements for a tuple.
+
+void serialize_value(Value value, List<char> * out)
+{
+	switch (value.type) {
+	case VALUE_NIL:
+		out->push((char) VALUE_NIL);
+		break;
+	case VALUE_INTEGER:
+		out->push((char) VALUE_INTEGER);
+		out->push_array((const char *) &value.integer, sizeof(int32_t));
+		break;
+	case VALUE_TUPLE: {
+		uint32_t length = value.tuple.length;
+		out->push((char) VALUE_TUPLE);
+		out->push_array((const char *) &length, sizeof(length));
+		Value * elements = value.tuple.elements();
+		for (uint32_t i = 0; i < length; i++) {
+			serialize_value(elements[i], out);
+		}
+	} break;
+	default:
+		fatal_internal("serialize_value() cannot serialize a %s", value_type_name(value.type));
+	}
+}
+
+// Takes the number of bytes serialize_value() would write for value off
+// *budget. Returns false, having stopped counting, once they don't fit.
+bool serialized_size_within(Value value, size_t * budget)
+{
+	size_t size = 1;
+	if (value.type == VALUE_INTEGER) size += sizeof(int32_t);
+	if (value.type == VALUE_TUPLE) size += sizeof(uint32_t);
+	if (size > *budget) return false;
+	*budget -= size;
+	if (value.type == VALUE_TUPLE) {
+		Value * elements = value.tuple.elements();
+		for (uint32_t i = 0; i < value.tuple.length; i++) {
+			if (!serialized_size_within(elements[i], budget)) return false;
+		}
+	}
+	return true;
+}
+
+// Reads one value starting at *cursor and advances past it. Returns
+// false without building anything if the bytes run out before end or
+// are not a valid encoding.
+bool deserialize_value(const char ** cursor, const char * end, Value * out)
+{
+	if (*cursor >= end) return false;
+	char tag = *(*cursor)++;
+	switch (tag) {
+	case VALUE_NIL:
+		*out = Value::with_type(VALUE_NIL);
+		return true;
+	case VALUE_INTEGER: {
+		int32_t integer;
+		if (end - *cursor < (ptrdiff_t) sizeof(integer)) return false;
+		memcpy(&integer, *cursor, sizeof(integer));
+		*cursor += sizeof(integer);
+		*out = Value::make_integer(integer);
+		return true;
+	}
+	case VALUE_TUPLE: {
+		uint32_t length;
+		if (end - *cursor < (ptrdiff_t) sizeof(length)) return false;
+		memcpy(&length, *cursor, sizeof(length));
+		*cursor += sizeof(length);
+		// Every element takes at least one byte
+		if ((size_t) (end - *cursor) < length) return false;
+		Tuple * tuple = Tuple::make(length);
+		for (uint32_t i = 0; i < length; i++) {
+			if (!deserialize_value(cursor, end, &tuple->elements[i])) {
+				tuple->length = i;
+				Value::make_tuple(tuple).release();
+				return false;
+			}
+		}
+		*out = Value::make_tuple(tuple);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
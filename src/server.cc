@@ -0,0 +1,158 @@
+// Server mode
+//
+// With --serve, the interpreter stays up and runs frames as their text
+// arrives, from stdin or from every client of a Unix socket, so workers'
+// caches, compiled code and variables outlive any one script. Text is
+// run once a line ends with a ';', one frame at a time, and each frame
+// is answered by the lines it output followed by "ok", or by
+// "error: " and the message if it failed. A failed frame assigns
+// nothing and the rest of the text sent with it is dropped, but the
+// session goes on.
+//
+// Every session runs in an execution context of its own, with its own
+// variables. Sessions run concurrently and share the worker pool, which
+// serves them in turn.
+
+#define SERVER_BACKLOG 16
+
+struct Session {
+	FILE * in;
+	FILE * out;
+	Execution_Context * context;
+};
+
+// Parses and runs every frame in source in the calling thread's context,
+// answering each with "ok" on answers if it is given. Stops at the first
+// frame that fails, whose assignments are dropped, and returns false
+// with the message in fatal_message.
+bool run_source(const char * source, FILE * answers)
+{
+	jmp_buf recovery;
+	jmp_buf * outer = fatal_recovery;
+	Memory_Tag scope = memory_scope;
+	bool succeeded = true;
+	if (setjmp(recovery)) {
+		memory_scope = scope;
+		exec_context->discard_frame();
+		succeeded = false;
+	} else {
+		fatal_recovery = &recovery;
+		Lexer lexer(source);
+		Parser parser(&lexer);
+		while (!parser.at_end()) {
+			double start = profiler.now();
+			List<Job_Spec*> frame_spec = parser.parse_frame_spec();
+			profiler.record("parse", NULL, start, profiler.now());
+			exec_context->run_frame(frame_spec);
+			if (answers) {
+				fprintf(answers, "ok\n");
+				fflush(answers);
+			}
+		}
+	}
+	fatal_recovery = outer;
+	exec_context->finish();
+	return succeeded;
+}
+
+static void run_session_text(Session * session, const char * source)
+{
+	if (!run_source(source, session->out)) {
+		fprintf(session->out, "error: %s\n", fatal_message);
+	}
+	fflush(session->out);
+}
+
+static bool ends_frame(const char * line, size_t length)
+{
+	while (length > 0 && isspace(line[length - 1])) length--;
+	return length > 0 && line[length - 1] == ';';
+}
+
+static void run_session(Session * session)
+{
+	String_Builder text;
+	char * line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+	while ((length = getline(&line, &capacity, session->in)) >= 0) {
+		text.append(line, length);
+		if (!ends_frame(line, length)) continue;
+		text.append_char('\0');
+		run_session_text(session, text.builder.arr);
+		text.clear();
+	}
+	free(line);
+	// Text left without a closing ';' still gets an answer
+	for (int i = 0; i < text.builder.size; i++) {
+		if (isspace(text.builder[i])) continue;
+		text.append_char('\0');
+		run_session_text(session, text.builder.arr);
+		break;
+	}
+}
+
+// Runs one session in a new context, in a thread of its own
+static void * run_client(void * arg)
+{
+	int fd = (int) (size_t) arg;
+	Session session;
+	session.in = fdopen(fd, "r");
+	session.out = fdopen(dup(fd), "w");
+	session.context = (Execution_Context*) mem_calloc(1, sizeof(Execution_Context), MEM_JOBS);
+	exec_context = session.context;
+	exec_context->init();
+	exec_context->recover_errors = true;
+	exec_context->output = session.out;
+	exec_context->var_space.bind("test", Value::make_integer(12));
+	run_session(&session);
+	exec_context->dealloc();
+	mem_free(exec_context);
+	exec_context = NULL;
+	fclose(session.in);
+	fclose(session.out);
+	return NULL;
+}
+
+static void listen_on(const char * path)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		fatal("Socket path %s is too long", path);
+	}
+	strcpy(address.sun_path, path);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	// Replaces the socket a previous server left behind
+	unlink(path);
+	if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0
+		|| listen(listener, SERVER_BACKLOG) < 0) {
+		fatal("Could not listen on %s: %s", path, strerror(errno));
+	}
+	// Clients that hang up mid-answer must not take the server down
+	signal(SIGPIPE, SIG_IGN);
+	while (true) {
+		int client = accept(listener, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			fatal("Could not accept a client on %s: %s", path, strerror(errno));
+		}
+		pthread_t thread;
+		pthread_create(&thread, NULL, run_client, (void*) (size_t) client);
+		pthread_detach(thread);
+	}
+}
+
+// Serves stdin as one session in the calling thread's context and
+// returns at its end. Serving a socket never returns.
+void serve()
+{
+	if (options.serve_path) {
+		listen_on(options.serve_path);
+		return;
+	}
+	exec_context->recover_errors = true;
+	Session session = { stdin, stdout, exec_context };
+	run_session(&session);
+}
@@ -0,0 +1,116 @@
+// Optimization statistics, printed at exit with --stats
+
+struct Stats {
+	size_t frames = 0;
+	size_t jobs = 0;
+	size_t cse_hoisted = 0;
+	size_t cse_hits = 0;
+	size_t dead_jobs = 0;
+	size_t thunks_created = 0;
+	size_t thunks_forced = 0;
+	size_t cache_lookups = 0;
+	size_t cache_hits = 0;
+	size_t cache_too_large = 0;
+	size_t integer_jobs = 0;
+	// Commands dispatched by the VM, and how many that would have been
+	// without superinstructions. Jobs never branch, so each run of a
+	// job dispatches every one of its commands exactly once.
+	size_t vm_commands = 0;
+	size_t vm_commands_unfused = 0;
+	size_t jit_compiled = 0;
+	size_t jit_jobs = 0;
+	size_t versions = 0;
+	size_t partitions_copied = 0;
+	size_t overlapped_jobs = 0;
+	size_t dequeues = 0;
+	size_t dequeued_jobs = 0;
+	size_t inline_batches = 0;
+	size_t worker_batches = 0;
+	size_t process_batches = 0;
+	size_t process_jobs = 0;
+	void report()
+	{
+		size_t unforced = thunks_created - thunks_forced;
+		fprintf(stderr, "frames:        %zu\n", frames);
+		fprintf(stderr, "jobs:          %zu\n", jobs);
+		fprintf(stderr, "cse hoisted:   %zu subexpressions\n", cse_hoisted);
+		fprintf(stderr, "cse hits:      %zu occurrences (%zu evaluations saved)\n",
+				cse_hits, cse_hits - cse_hoisted);
+		fprintf(stderr, "dead jobs:     %zu\n", dead_jobs);
+		fprintf(stderr, "lazy jobs:     %zu deferred, %zu never forced\n",
+				thunks_created, unforced);
+		fprintf(stderr, "jobs skipped:  %zu\n", dead_jobs + unforced);
+		fprintf(stderr, "dequeues:      %zu for %zu jobs run by workers\n",
+				dequeues, dequeued_jobs);
+		fprintf(stderr, "job batches:   %zu run inline, %zu on workers\n",
+				inline_batches, worker_batches);
+		if (options.processes) {
+			fprintf(stderr, "processes:     %zu jobs in %zu batches sent to worker processes\n",
+					process_jobs, process_batches);
+		}
+		fprintf(stderr, "integer jobs:  %zu run on an untagged stack\n", integer_jobs);
+		double saved = vm_commands_unfused
+			? 100.0 * (vm_commands_unfused - vm_commands) / vm_commands_unfused : 0.0;
+		fprintf(stderr, "vm dispatches: %zu (%zu plain stack commands, %.1f%% saved)\n",
+				vm_commands, vm_commands_unfused, saved);
+		fprintf(stderr, "versions:      %zu committed, %zu partitions copied, "
+				"%zu jobs run during a commit\n", versions, partitions_copied, overlapped_jobs);
+		if (options.jit) {
+			fprintf(stderr, "jit:           %zu jobs run natively, %zu functions compiled\n",
+					jit_jobs, jit_compiled);
+		}
+	}
+	void report_cache()
+	{
+		double rate = cache_lookups ? 100.0 * cache_hits / cache_lookups : 0.0;
+		fprintf(stderr, "cache: %zu of %zu jobs loaded from cache (%.1f%% hit rate), "
+				"%zu results too large to store\n", cache_hits, cache_lookups, rate, cache_too_large);
+	}
+};
+
+Stats stats;
+
+// Frame latencies, printed at exit with --bench as one line of JSON for
+// bench/run.sh to collect
+struct Bench_Timer {
+	double start;
+	List<double> frame_ns;
+	void init()
+	{
+		start = monotonic_ns();
+		frame_ns.alloc();
+	}
+	void record_frame(double ns)
+	{
+		frame_ns.push(ns);
+	}
+	static int compare_times(const void * a, const void * b)
+	{
+		double left = *(double*) a;
+		double right = *(double*) b;
+		return left < right ? -1 : left > right ? 1 : 0;
+	}
+	// Nearest-rank percentile, in microseconds
+	double percentile(double p)
+	{
+		if (frame_ns.size == 0) return 0;
+		size_t rank = (size_t) (p * frame_ns.size + 0.999999);
+		if (rank < 1) rank = 1;
+		if (rank > (size_t) frame_ns.size) rank = frame_ns.size;
+		return frame_ns[rank - 1] / 1e3;
+	}
+	void report()
+	{
+		double seconds = (monotonic_ns() - start) / 1e9;
+		qsort(frame_ns.arr, frame_ns.size, sizeof(double), compare_times);
+		fprintf(stderr, "{\"frames\":%zu,\"jobs\":%zu,\"seconds\":%.6f,"
+				"\"frames_per_second\":%.1f,\"jobs_per_second\":%.1f,"
+				"\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}\n",
+				stats.frames, stats.jobs, seconds,
+				seconds > 0 ? stats.frames / seconds : 0.0,
+				seconds > 0 ? stats.jobs / seconds : 0.0,
+				percentile(0.50), percentile(0.99), percentile(1.0));
+	}
+};
+
+Bench_Timer bench_timer;
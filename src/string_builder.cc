@@ -5,11 +5,16 @@ struct String_Builder {
 	String_Builder();
 	~String_Builder();
 	void append(const char * s);
+	void append(const char * s, size_t length);
+	void append_char(char c);
+	void append_integer(int integer);
+	void clear();
 	char * final_string();
 };
 
 String_Builder::String_Builder()
 {
+	Memory_Scope scope(MEM_STRINGS);
 	builder.alloc();
 }
 
@@ -20,17 +25,68 @@ String_Builder::~String_Builder()
 
 void String_Builder::append(const char * s)
 {
-	for (int i = 0; i < strlen(s); i++) {
-		builder.push(s[i]);
+	append(s, strlen(s));
+}
+
+void String_Builder::append(const char * s, size_t length)
+{
+	Memory_Scope scope(MEM_STRINGS);
+	builder.push_array(s, length);
+}
+
+void String_Builder::append_char(char c)
+{
+	Memory_Scope scope(MEM_STRINGS);
+	builder.push(c);
+}
+
+static const char digit_pairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Writes the decimal form of an integer two digits at a time, back
+// to front into a scratch buffer, then appends it in one copy.
+void String_Builder::append_integer(int integer)
+{
+	char buf[16];
+	char * end = buf + sizeof(buf);
+	char * p = end;
+	unsigned int n = integer < 0 ? 0u - (unsigned int) integer : (unsigned int) integer;
+	while (n >= 100) {
+		unsigned int pair = (n % 100) * 2;
+		n /= 100;
+		*--p = digit_pairs[pair + 1];
+		*--p = digit_pairs[pair];
+	}
+	if (n >= 10) {
+		*--p = digit_pairs[n * 2 + 1];
+		*--p = digit_pairs[n * 2];
+	} else {
+		*--p = '0' + n;
+	}
+	if (integer < 0) {
+		*--p = '-';
 	}
+	append(p, end - p);
+}
+
+void String_Builder::clear()
+{
+	builder.clear();
 }
 
 char * String_Builder::final_string()
 {
-	char * str = (char*) malloc(sizeof(char) * (builder.size + 1));
-	strncpy(str, builder.arr, builder.size);
+	char * str = (char*) mem_alloc(sizeof(char) * (builder.size + 1), MEM_STRINGS);
+	memcpy(str, builder.arr, builder.size);
 	str[builder.size] = '\0';
 	return str;
 }
-
-//
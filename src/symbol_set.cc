@@ -0,0 +1,110 @@
+// Symbol Set
+//
+// Open-addressed set of symbol names. Symbols are never unlinked from
+// the table, only marked absent, so lookups never need tombstones. Each
+// symbol also keeps the index at which it was first added.
+
+struct Symbol_Set_Entry {
+	const char * symbol;
+	uint64_t hash;
+	bool present;
+	size_t index;
+};
+
+struct Symbol_Set {
+	List<Symbol_Set_Entry> entries;
+	size_t used;
+	void init();
+	void dealloc();
+	void clear();
+	Symbol_Set_Entry * find(const char * symbol, uint64_t hash);
+	void grow();
+	bool contains(const char * symbol);
+	void add(const char * symbol);
+	void remove(const char * symbol);
+	int index_of(const char * symbol);
+};
+
+void Symbol_Set::init()
+{
+	entries.alloc();
+	for (int i = 0; i < 16; i++) {
+		entries.push((Symbol_Set_Entry) { NULL, 0, false, 0 });
+	}
+	used = 0;
+}
+
+void Symbol_Set::dealloc()
+{
+	entries.dealloc();
+}
+
+void Symbol_Set::clear()
+{
+	for (int i = 0; i < entries.size; i++) {
+		entries[i] = (Symbol_Set_Entry) { NULL, 0, false, 0 };
+	}
+	used = 0;
+}
+
+// Returns the entry holding symbol, or the empty entry it would go in
+Symbol_Set_Entry * Symbol_Set::find(const char * symbol, uint64_t hash)
+{
+	size_t mask = entries.size - 1;
+	size_t i = hash & mask;
+	while (entries[i].symbol) {
+		if (entries[i].hash == hash && strcmp(entries[i].symbol, symbol) == 0) {
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return &entries[i];
+}
+
+void Symbol_Set::grow()
+{
+	List<Symbol_Set_Entry> old = entries;
+	entries.alloc();
+	for (size_t i = 0; i < old.size * 2; i++) {
+		entries.push((Symbol_Set_Entry) { NULL, 0, false, 0 });
+	}
+	for (int i = 0; i < old.size; i++) {
+		if (old[i].symbol) {
+			*find(old[i].symbol, old[i].hash) = old[i];
+		}
+	}
+	old.dealloc();
+}
+
+bool Symbol_Set::contains(const char * symbol)
+{
+	Symbol_Set_Entry * entry = find(symbol, hash_string(symbol));
+	return entry->symbol && entry->present;
+}
+
+void Symbol_Set::add(const char * symbol)
+{
+	uint64_t hash = hash_string(symbol);
+	Symbol_Set_Entry * entry = find(symbol, hash);
+	if (!entry->symbol) {
+		*entry = (Symbol_Set_Entry) { symbol, hash, true, used };
+		if (++used * 2 > entries.size) grow();
+		return;
+	}
+	entry->present = true;
+}
+
+void Symbol_Set::remove(const char * symbol)
+{
+	Symbol_Set_Entry * entry = find(symbol, hash_string(symbol));
+	if (entry->symbol) {
+		entry->present = false;
+	}
+}
+
+// Returns the order in which symbol was first added, or -1
+int Symbol_Set::index_of(const char * symbol)
+{
+	Symbol_Set_Entry * entry = find(symbol, hash_string(symbol));
+	return entry->symbol ? (int) entry->index : -1;
+}
@@ -0,0 +1,116 @@
+// Type specialization
+//
+// Before a job runs, its commands are checked against the types of the
+// values it reads, which cannot change while its frame runs. Operators
+// whose operands are proven to be integers are replaced by CMD_INT_*
+// commands that skip apply_unary() and apply_binary(). A job that turns
+// out to be integer-only throughout is run by VM::execute_integer() on a
+// stack of plain ints. Anything whose type depends on a tuple, a thunk
+// or an index into a tuple is left to the generic commands.
+
+// Returns whether the value read by a LOOKUP, LOOKUP_MOVE or LOAD_SLOT
+// command is known to be an integer
+typedef bool (*Integer_Input_Fn)(Command * cmd);
+
+static Command_Type integer_command_for(Binary_Op op)
+{
+	switch (op) {
+	case BINARY_PLUS:     return CMD_INT_ADD;
+	case BINARY_MINUS:    return CMD_INT_SUBTRACT;
+	case BINARY_MULTIPLY: return CMD_INT_MULTIPLY;
+	case BINARY_DIVIDE:   return CMD_INT_DIVIDE;
+	default:
+		fatal_internal("integer_command_for() switch incomplete");
+	}
+	return CMD_COUNT;
+}
+
+// Rewrites commands in place, fusing integer operators with their
+// operands if fuse is set, and returns whether every value the job
+// handles is an integer along with the deepest the stack gets
+bool specialize_types(List<Command> * commands, Integer_Input_Fn is_integer_input,
+					  bool fuse, size_t * max_depth)
+{
+	// Whether each stack entry is known to be an integer
+	List<bool> stack;
+	stack.alloc();
+	bool integer_only = true;
+	*max_depth = 0;
+	// Fusion only ever shrinks the program, so it is written back over
+	// the commands already read
+	size_t kept = 0;
+
+	for (size_t i = 0; i < commands->size; i++) {
+		Command * cmd = &commands->arr[i];
+		bool fused = false;
+		switch (cmd->type) {
+		case CMD_LOAD_CONST:
+			stack.push(cmd->load_const.constant.type == VALUE_INTEGER);
+			break;
+		case CMD_LOOKUP:
+		case CMD_LOOKUP_MOVE:
+		case CMD_LOAD_SLOT:
+			stack.push(is_integer_input(cmd));
+			break;
+		case CMD_UNARY_OP: {
+			bool integer = stack.arr[stack.size - 1];
+			if (integer) cmd->type = CMD_INT_NEGATE;
+		} break;
+		case CMD_BINARY_OP: {
+			bool integer = stack.arr[stack.size - 1] && stack.arr[stack.size - 2];
+			stack.size--;
+			stack.arr[stack.size - 1] = integer;
+			if (integer && fuse) {
+				emit_fused(commands->arr, &kept, cmd->binary_op.op,
+						   integer_command_for(cmd->binary_op.op));
+				fused = true;
+			} else if (integer) {
+				cmd->type = integer_command_for(cmd->binary_op.op);
+			}
+		} break;
+		case CMD_OUTPUT:
+			stack.size--;
+			integer_only = false;
+			break;
+		case CMD_MAKE_TUPLE:
+			stack.size -= cmd->make_tuple.length;
+			stack.push(false);
+			break;
+		case CMD_INDEX:
+			stack.size -= 1;
+			stack.arr[stack.size - 1] = false;
+			break;
+		case CMD_SLICE:
+			stack.size -= 2;
+			stack.arr[stack.size - 1] = false;
+			break;
+		case CMD_LENGTH:
+			// tuple_length() either returns an integer or is fatal
+			stack.arr[stack.size - 1] = true;
+			integer_only = false;
+			break;
+		case CMD_INT_NEGATE:
+			break;
+		case CMD_INT_ADD:
+		case CMD_INT_SUBTRACT:
+		case CMD_INT_MULTIPLY:
+		case CMD_INT_DIVIDE:
+			stack.size--;
+			break;
+		case CMD_INT_OP_CONST:
+		case CMD_INT_OP_VAR:
+			break;
+		case CMD_INT_VAR_OP_VAR:
+			stack.push(true);
+			break;
+		default:
+			fatal_internal("specialize_types() switch incomplete");
+		}
+		if (!stack.size || !stack.arr[stack.size - 1]) integer_only = false;
+		if (stack.size > *max_depth) *max_depth = stack.size;
+		if (!fused) commands->arr[kept++] = *cmd;
+	}
+	commands->size = kept;
+	stack.dealloc();
+	return integer_only;
+}
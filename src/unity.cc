@@ -0,0 +1,60 @@
+// Unity build of everything but the command line, which main.cc adds.
+// make libsync compiles it on its own into the embedding library, see
+// include/sync.h.
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "list.h" // Necessary evil
+#include "sync.h"
+
+#include "utility.cc"
+#include "memory.cc"
+#include "error.cc"
+#include "options.cc"
+#include "stats.cc"
+#include "affinity.cc"
+#include "parallelism.cc"
+#include "profile.cc"
+#include "string_builder.cc"
+#include "lexer.cc"
+#include "collection.cc"
+#include "value.cc"
+#include "symbol_set.cc"
+#include "parser.cc"
+#include "operators.cc"
+#include "serialize.cc"
+#include "cache.cc"
+#include "bytecode.cc"
+#include "vm_stats.cc"
+#include "jit.cc"
+#include "compiler.cc"
+#include "fusion.cc"
+#include "types.cc"
+#include "cse.cc"
+#include "liveness.cc"
+#include "intern.cc"
+#include "variable_space.cc"
+#include "execution.cc"
+#include "register_vm.cc"
+#include "bytecode_file.cc"
+#include "processes.cc"
+#include "server.cc"
+#include "library.cc"
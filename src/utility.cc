@@ -4,10 +4,43 @@ char * load_string_from_file(char * path)
 	if (file == NULL) return NULL;
 	int file_len = 0;
 	while (fgetc(file) != EOF) file_len++;
-	char * str = (char*) malloc(file_len + 1);
+	char * str = (char*) mem_alloc(file_len + 1, MEM_PARSER);
 	str[file_len] = '\0';
 	fseek(file, 0, SEEK_SET);
 	for (int i = 0; i < file_len; i++) str[i] = fgetc(file);
 	fclose(file);
 	return str;
 }
+
+double monotonic_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+// FNV-1a over a byte range
+uint64_t hash_bytes(const void * data, size_t length, uint64_t seed = 14695981039346656037ull)
+{
+	const unsigned char * bytes = (const unsigned char *) data;
+	uint64_t hash = seed;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+uint64_t hash_string(const char * s)
+{
+	return hash_bytes(s, strlen(s));
+}
+
+// Order-dependent mix of two hashes
+uint64_t hash_combine(uint64_t seed, uint64_t value)
+{
+	value *= 0x9e3779b97f4a7c15ull;
+	value ^= value >> 32;
+	seed ^= value + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2);
+	return seed;
+}
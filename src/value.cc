@@ -2,13 +2,24 @@ enum Value_Type {
 	VALUE_NIL,
 	VALUE_INTEGER,
 	VALUE_TUPLE,
+	VALUE_THUNK,
 };
 
 struct Tuple;
+struct Thunk;
 
+void thunk_retain(Thunk * thunk);
+void thunk_release(Thunk * thunk);
+
+// A tuple value is a view of length elements starting at offset in a
+// shared payload. Freshly built tuples view their whole payload, while
+// slices point into their parent's payload and keep it alive.
 struct Value_Tuple {
-	size_t length;
-	struct Value * elements;
+	Tuple * data;
+	uint32_t offset;
+	uint32_t length;
+	struct Value * elements();
+	bool is_whole();
 };
 
 struct Value {
@@ -16,6 +27,8 @@ struct Value {
 	union {
 		int integer;
 		Value_Tuple tuple;
+		// Only ever stored in a variable space; lookups force it
+		Thunk * thunk;
 	};
 	static Value with_type(Value_Type type)
 	{
@@ -29,30 +42,227 @@ struct Value {
 		value.integer = integer;
 		return value;
 	}
+	static Value make_view(Tuple * data, size_t offset, size_t length)
+	{
+		Value value = Value::with_type(VALUE_TUPLE);
+		value.tuple.data = data;
+		value.tuple.offset = offset;
+		value.tuple.length = length;
+		return value;
+	}
+	static Value make_tuple(Tuple * data);
+	void retain();
+	void release();
+	void share();
+	bool is_unique();
+	Tuple * claim_payload();
+	uint64_t content_hash();
+	void format(String_Builder * builder);
 	char * to_string()
 	{
-		switch (type) {
-		case VALUE_NIL:
-			return strdup("nil");
-		case VALUE_INTEGER: {
-			char buf[512];
-			snprintf(buf, 512, "%d", integer);
-			return strdup(buf);
+		String_Builder builder;
+		format(&builder);
+		return builder.final_string();
+	}
+};
+
+// Tuple payloads are reference counted. A tuple is private to the
+// thread that built it until it is bound into the variable space, at
+// which point it is marked shared and its count is only touched with
+// atomic operations from then on.
+struct Tuple {
+	size_t refcount;
+	bool shared;
+	// Held by the intern table, see intern.cc
+	bool interned;
+	size_t length;
+	size_t capacity;
+	Value * elements;
+	// Cached content_hash() of the whole payload, or 0 if not computed.
+	// Reset whenever the payload is claimed for reuse.
+	uint64_t hash;
+	static Tuple * make(size_t length)
+	{
+		Tuple * tuple = (Tuple*) mem_alloc(sizeof(Tuple), MEM_VALUES);
+		tuple->refcount = 1;
+		tuple->shared = false;
+		tuple->interned = false;
+		tuple->hash = 0;
+		tuple->length = length;
+		tuple->capacity = length;
+		tuple->elements = (Value*) mem_alloc(sizeof(Value) * (length ? length : 1), MEM_VALUES);
+		return tuple;
+	}
+	void reserve(size_t new_capacity)
+	{
+		if (new_capacity <= capacity) return;
+		if (new_capacity < capacity * 2) new_capacity = capacity * 2;
+		elements = (Value*) mem_realloc(elements, sizeof(Value) * new_capacity, MEM_VALUES);
+		capacity = new_capacity;
+	}
+	// Frees the payload without touching the elements, for callers
+	// that have already moved the elements somewhere else.
+	void free_shell()
+	{
+		mem_free(elements);
+		mem_free(this);
+	}
+};
+
+Value * Value_Tuple::elements()
+{
+	return data->elements + offset;
+}
+
+bool Value_Tuple::is_whole()
+{
+	return offset == 0 && length == data->length;
+}
+
+Value Value::make_tuple(Tuple * data)
+{
+	return Value::make_view(data, 0, data->length);
+}
+
+void Value::retain()
+{
+	if (type == VALUE_THUNK) thunk_retain(thunk);
+	if (type != VALUE_TUPLE) return;
+	Tuple * data = tuple.data;
+	if (data->shared) {
+		__atomic_add_fetch(&data->refcount, 1, __ATOMIC_RELAXED);
+	} else {
+		data->refcount++;
+	}
+}
+
+void Value::release()
+{
+	if (type == VALUE_THUNK) thunk_release(thunk);
+	if (type != VALUE_TUPLE) return;
+	Tuple * data = tuple.data;
+	size_t remaining;
+	if (data->shared) {
+		remaining = __atomic_sub_fetch(&data->refcount, 1, __ATOMIC_ACQ_REL);
+	} else {
+		remaining = --data->refcount;
+	}
+	if (remaining == 0) {
+		for (size_t i = 0; i < data->length; i++) {
+			data->elements[i].release();
 		}
-		case VALUE_TUPLE: {
-			String_Builder builder;
-			builder.append("[");
-			for (int i = 0; i < tuple.length; i++) {
-				char * s = tuple.elements[i].to_string();
-				builder.append(s);
-				free(s);
-				if (i < tuple.length - 1) builder.append(" . ");
-			}
-			builder.append("]");
-			return builder.final_string();
+		data->free_shell();
+	}
+}
+
+// Marks a tuple and everything reachable from it as visible to other
+// threads. Already-shared subtrees are skipped, which relies on every
+// element of a shared payload being shared too. Payloads written to
+// after they were shared are unmarked by claim_payload() for that.
+void Value::share()
+{
+	if (type != VALUE_TUPLE) return;
+	Tuple * data = tuple.data;
+	if (data->shared) return;
+	data->shared = true;
+	for (size_t i = 0; i < data->length; i++) {
+		data->elements[i].share();
+	}
+}
+
+// True when the caller holds the only reference, which makes it safe
+// to reuse the payload for a derived tuple.
+bool Value::is_unique()
+{
+	assert(type == VALUE_TUPLE);
+	return __atomic_load_n(&tuple.data->refcount, __ATOMIC_ACQUIRE) == 1;
+}
+
+// When the caller holds the only reference, trims the payload down to
+// the viewed elements and hands it over for reuse. Returns NULL when
+// the payload is shared and has to be copied instead.
+Tuple * Value::claim_payload()
+{
+	if (!is_unique()) return NULL;
+	Tuple * data = tuple.data;
+	data->hash = 0;
+	// No other thread can reach it any more, and the unshared elements
+	// the caller is about to write must be shared along with it later
+	data->shared = false;
+	if (!tuple.is_whole()) {
+		for (size_t i = 0; i < tuple.offset; i++) {
+			data->elements[i].release();
 		}
-		default:
-			fatal("Value::to_string() type switch incomplete");
+		for (size_t i = tuple.offset + tuple.length; i < data->length; i++) {
+			data->elements[i].release();
 		}
+		memmove(data->elements, data->elements + tuple.offset, sizeof(Value) * tuple.length);
+		data->length = tuple.length;
+		tuple.offset = 0;
 	}
-};
+	return data;
+}
+
+static uint64_t hash_elements(Value * elements, size_t length)
+{
+	uint64_t hash = hash_combine(VALUE_TUPLE, length);
+	for (size_t i = 0; i < length; i++) {
+		hash = hash_combine(hash, elements[i].content_hash());
+	}
+	return hash;
+}
+
+// Hash of the value's contents, equal for structurally equal values.
+// Hashes of whole tuple payloads are cached, since the same tuple tends
+// to be hashed once per job that reads it.
+uint64_t Value::content_hash()
+{
+	switch (type) {
+	case VALUE_NIL:
+		return hash_combine(VALUE_NIL, 0);
+	case VALUE_INTEGER:
+		return hash_combine(VALUE_INTEGER, (uint32_t) integer);
+	case VALUE_TUPLE: {
+		if (!tuple.is_whole()) {
+			return hash_elements(tuple.elements(), tuple.length);
+		}
+		uint64_t hash = __atomic_load_n(&tuple.data->hash, __ATOMIC_RELAXED);
+		if (hash == 0) {
+			hash = hash_elements(tuple.elements(), tuple.length);
+			if (hash == 0) hash = 1;
+			__atomic_store_n(&tuple.data->hash, hash, __ATOMIC_RELAXED);
+		}
+		return hash;
+	}
+	default:
+		fatal_internal("Value::content_hash() type switch incomplete");
+	}
+	return 0;
+}
+
+// Writes the printed form of the value into the builder without
+// any intermediate strings, so formatting a tuple costs one pass.
+void Value::format(String_Builder * builder)
+{
+	switch (type) {
+	case VALUE_NIL:
+		builder->append("nil", 3);
+		break;
+	case VALUE_INTEGER:
+		builder->append_integer(integer);
+		break;
+	case VALUE_TUPLE: {
+		builder->append_char('[');
+		Value * elements = tuple.elements();
+		for (size_t i = 0; i < tuple.length; i++) {
+			if (i > 0) builder->append(" . ", 3);
+			elements[i].format(builder);
+		}
+		builder->append_char(']');
+	} break;
+	case VALUE_THUNK:
+		fatal_internal("Unforced thunk reached Value::format()");
+	default:
+		fatal("Value::format() type switch incomplete");
+	}
+}
@@ -0,0 +1,435 @@
+// Variable space and frame commit
+//
+// The variable space is versioned. Each frame's commit produces a new
+// Variable_Version, and anyone holding a reference to an older one
+// keeps seeing it unchanged. Bindings are spread over a fixed number of
+// partitions by the hash of their name, each an open-addressed table of
+// its own, and versions share every partition the commit did not
+// write. A written partition is copied unless no other version or
+// reader can see it, in which case it is updated in place.
+//
+// Assignments produced during a frame are published as each job
+// finishes into an Assignment_Table partitioned the same way, which
+// catches a variable assigned twice on insert. The table is applied
+// partition by partition, in parallel for large frames, since no two
+// partitions ever touch the same binding.
+
+#define VARIABLE_PARTITIONS 64
+
+// Commits of fewer assignments than this run on the calling thread
+// alone, since starting threads would cost more than it saves
+#define PARALLEL_COMMIT_THRESHOLD 4096
+
+static size_t partition_of(uint64_t hash)
+{
+	return hash % VARIABLE_PARTITIONS;
+}
+
+struct Assignment {
+	const char * symbol;
+	Value value;
+};
+
+struct Binding {
+	const char * key; // Shared by every copy, NULL if the slot is empty
+	uint64_t hash;
+	Value value;
+};
+
+struct Variable_Partition {
+	// Number of versions holding this partition
+	size_t refs;
+	List<Binding> bindings;
+	size_t used;
+	static Variable_Partition * make(size_t capacity)
+	{
+		Variable_Partition * partition = (Variable_Partition*) mem_alloc(sizeof(Variable_Partition), MEM_VARIABLES);
+		partition->refs = 1;
+		partition->bindings.alloc();
+		for (size_t i = 0; i < capacity; i++) {
+			partition->bindings.push((Binding) { NULL, 0, Value::with_type(VALUE_NIL) });
+		}
+		partition->used = 0;
+		return partition;
+	}
+	Variable_Partition * clone()
+	{
+		Variable_Partition * copy = make(bindings.size);
+		for (size_t i = 0; i < bindings.size; i++) {
+			copy->bindings.arr[i] = bindings.arr[i];
+			if (bindings.arr[i].key) bindings.arr[i].value.retain();
+		}
+		copy->used = used;
+		__atomic_add_fetch(&stats.partitions_copied, 1, __ATOMIC_RELAXED);
+		return copy;
+	}
+	void retain()
+	{
+		__atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+	}
+	void release()
+	{
+		if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+		for (size_t i = 0; i < bindings.size; i++) {
+			if (bindings.arr[i].key) bindings.arr[i].value.release();
+		}
+		bindings.dealloc();
+		mem_free(this);
+	}
+	// Returns the binding for key, or the empty slot it would go in
+	Binding * find(const char * key, uint64_t hash)
+	{
+		size_t mask = bindings.size - 1;
+		// The low bits chose the partition, so probe with the rest
+		size_t i = (hash / VARIABLE_PARTITIONS) & mask;
+		while (bindings.arr[i].key) {
+			if (bindings.arr[i].hash == hash && strcmp(bindings.arr[i].key, key) == 0) break;
+			i = (i + 1) & mask;
+		}
+		return &bindings.arr[i];
+	}
+	void grow()
+	{
+		List<Binding> old = bindings;
+		bindings.alloc();
+		for (size_t i = 0; i < old.size * 2; i++) {
+			bindings.push((Binding) { NULL, 0, Value::with_type(VALUE_NIL) });
+		}
+		for (int i = 0; i < old.size; i++) {
+			if (old[i].key) *find(old[i].key, old[i].hash) = old[i];
+		}
+		old.dealloc();
+	}
+	// Takes ownership of value, which becomes visible to every thread.
+	// Only valid on a partition no other version holds.
+	void bind(const char * key, uint64_t hash, Value value)
+	{
+		value.share();
+		Binding * binding = find(key, hash);
+		if (binding->key) {
+			binding->value.release();
+			binding->value = value;
+			return;
+		}
+		*binding = (Binding) { mem_strdup(key, MEM_VARIABLES), hash, value };
+		if (++used * 2 > bindings.size) grow();
+	}
+};
+
+struct Variable_Version {
+	size_t refs;
+	Variable_Partition * partitions[VARIABLE_PARTITIONS];
+	// Takes the base's references to its partitions if base is NULL,
+	// otherwise shares them all
+	static Variable_Version * make(Variable_Version * base)
+	{
+		Variable_Version * version = (Variable_Version*) mem_alloc(sizeof(Variable_Version), MEM_VARIABLES);
+		version->refs = 1;
+		for (int p = 0; p < VARIABLE_PARTITIONS; p++) {
+			if (base) {
+				version->partitions[p] = base->partitions[p];
+				version->partitions[p]->retain();
+			} else {
+				version->partitions[p] = Variable_Partition::make(8);
+			}
+		}
+		return version;
+	}
+	void retain()
+	{
+		__atomic_add_fetch(&refs, 1, __ATOMIC_RELAXED);
+	}
+	void release()
+	{
+		if (__atomic_sub_fetch(&refs, 1, __ATOMIC_ACQ_REL) != 0) return;
+		for (int p = 0; p < VARIABLE_PARTITIONS; p++) {
+			partitions[p]->release();
+		}
+		mem_free(this);
+	}
+	// Returns partition p ready to be written, copying it first if
+	// anything besides this version can see it
+	Variable_Partition * writable(size_t p)
+	{
+		Variable_Partition * partition = partitions[p];
+		if (refs == 1 && partition->refs == 1) return partition;
+		partitions[p] = partition->clone();
+		partition->release();
+		return partitions[p];
+	}
+};
+
+struct Variable_Space {
+	// The version jobs read. It only changes between job batches.
+	Variable_Version * current;
+	void init()
+	{
+		Memory_Scope scope(MEM_VARIABLES);
+		current = Variable_Version::make(NULL);
+	}
+	// Pins the current version, which stays readable and unchanged until
+	// released, whatever is committed in the meantime
+	Variable_Version * snapshot()
+	{
+		current->retain();
+		return current;
+	}
+	void publish(Variable_Version * version)
+	{
+		Variable_Version * old = current;
+		current = version;
+		old->release();
+	}
+	void bind(const char * key, Value value)
+	{
+		uint64_t hash = hash_string(key);
+		current->writable(partition_of(hash))->bind(key, hash, value);
+	}
+	// Returns the binding of key, or NULL if it is unbound
+	Value * find(const char * key)
+	{
+		uint64_t hash = hash_string(key);
+		Binding * binding = current->partitions[partition_of(hash)]->find(key, hash);
+		return binding->key ? &binding->value : NULL;
+	}
+	bool is_bound(const char * key)
+	{
+		return find(key) != NULL;
+	}
+	Value lookup(const char * key)
+	{
+		Value * value = find(key);
+		if (!value) {
+			fatal("Tried to lookup unbound variable %s", key);
+		}
+		return *value;
+	}
+	// Hands the binding's reference to the caller and leaves nil in its
+	// place. Only valid when nothing else reads key during this frame.
+	// A binding some pinned version can also see is shared instead.
+	Value take(const char * key)
+	{
+		uint64_t hash = hash_string(key);
+		Variable_Partition * partition = current->partitions[partition_of(hash)];
+		Binding * binding = partition->find(key, hash);
+		if (!binding->key) {
+			fatal("Tried to lookup unbound variable %s", key);
+		}
+		Value value = binding->value;
+		if (current->refs == 1 && partition->refs == 1) {
+			binding->value = Value::with_type(VALUE_NIL);
+		} else {
+			value.retain();
+		}
+		return value;
+	}
+};
+
+struct Pending_Assignment {
+	const char * symbol;
+	uint64_t hash;
+	Value value;
+};
+
+// Index entries are only valid if stamped with the table's current
+// generation, so clearing the index between frames is free
+struct Pending_Index_Entry {
+	uint32_t generation;
+	uint32_t position; // Into Pending_Partition::assignments
+};
+
+struct Pending_Partition {
+	pthread_mutex_t mutex;
+	List<Pending_Assignment> assignments;
+	List<Pending_Index_Entry> index;
+	void init()
+	{
+		pthread_mutex_init(&mutex, NULL);
+		assignments.alloc();
+		index.alloc();
+		for (int i = 0; i < 16; i++) {
+			index.push((Pending_Index_Entry) { 0, 0 });
+		}
+	}
+	// Returns the index entry for symbol, or the empty one it would go in
+	Pending_Index_Entry * find(const char * symbol, uint64_t hash, uint32_t generation)
+	{
+		size_t mask = index.size - 1;
+		size_t i = (hash / VARIABLE_PARTITIONS) & mask;
+		while (index.arr[i].generation == generation) {
+			Pending_Assignment * other = &assignments.arr[index.arr[i].position];
+			if (other->hash == hash && strcmp(other->symbol, symbol) == 0) break;
+			i = (i + 1) & mask;
+		}
+		return &index.arr[i];
+	}
+	void grow(uint32_t generation)
+	{
+		index.dealloc();
+		index.alloc();
+		// Doubles the index; every stale entry is dropped along the way
+		size_t size = 16;
+		while (size < assignments.size * 4) size *= 2;
+		for (size_t i = 0; i < size; i++) {
+			index.push((Pending_Index_Entry) { 0, 0 });
+		}
+		for (size_t i = 0; i < assignments.size; i++) {
+			Pending_Assignment * assignment = &assignments.arr[i];
+			*find(assignment->symbol, assignment->hash, generation) =
+				(Pending_Index_Entry) { generation, (uint32_t) i };
+		}
+	}
+};
+
+struct Assignment_Table {
+	Pending_Partition partitions[VARIABLE_PARTITIONS];
+	// Starts at 1 so zeroed index entries are never current
+	uint32_t generation;
+	size_t count;
+	// First variable found assigned twice this frame, or NULL
+	const char * conflict;
+	void init()
+	{
+		Memory_Scope scope(MEM_VARIABLES);
+		for (int i = 0; i < VARIABLE_PARTITIONS; i++) {
+			partitions[i].init();
+		}
+		generation = 1;
+		count = 0;
+		conflict = NULL;
+	}
+	void dealloc()
+	{
+		discard();
+		for (int i = 0; i < VARIABLE_PARTITIONS; i++) {
+			pthread_mutex_destroy(&partitions[i].mutex);
+			partitions[i].assignments.dealloc();
+			partitions[i].index.dealloc();
+		}
+	}
+	// Called by workers as jobs finish. Takes ownership of value.
+	void publish(const char * symbol, Value value)
+	{
+		Memory_Scope scope(MEM_VARIABLES);
+		uint64_t hash = hash_string(symbol);
+		Pending_Partition * partition = &partitions[partition_of(hash)];
+		pthread_mutex_lock(&partition->mutex);
+		Pending_Index_Entry * entry = partition->find(symbol, hash, generation);
+		if (entry->generation == generation) {
+			pthread_mutex_unlock(&partition->mutex);
+			// Reported once the frame's jobs have all run, as before
+			const char * expected = NULL;
+			__atomic_compare_exchange_n(&conflict, &expected, symbol, false,
+										__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+			value.release();
+			return;
+		}
+		*entry = (Pending_Index_Entry) { generation, (uint32_t) partition->assignments.size };
+		partition->assignments.push((Pending_Assignment) { symbol, hash, value });
+		if (partition->assignments.size * 2 > partition->index.size) {
+			partition->grow(generation);
+		}
+		pthread_mutex_unlock(&partition->mutex);
+		__atomic_add_fetch(&count, 1, __ATOMIC_RELAXED);
+	}
+	// Returns whether symbol was assigned this frame
+	bool contains(const char * symbol)
+	{
+		uint64_t hash = hash_string(symbol);
+		Pending_Partition * partition = &partitions[partition_of(hash)];
+		return partition->find(symbol, hash, generation)->generation == generation;
+	}
+	void apply_partition(Variable_Version * version, size_t p)
+	{
+		Pending_Partition * pending = &partitions[p];
+		if (pending->assignments.size == 0) return;
+		Memory_Scope scope(MEM_VARIABLES);
+		Variable_Partition * partition = version->writable(p);
+		for (size_t i = 0; i < pending->assignments.size; i++) {
+			Pending_Assignment * assignment = &pending->assignments.arr[i];
+			partition->bind(assignment->symbol, assignment->hash, assignment->value);
+		}
+		pending->assignments.clear();
+	}
+	// Interns every tuple assigned this frame. Runs on the committing
+	// thread alone, before any partition is applied.
+	void intern_values()
+	{
+		pthread_mutex_lock(&tuple_interner.mutex);
+		for (int p = 0; p < VARIABLE_PARTITIONS; p++) {
+			List<Pending_Assignment> * assignments = &partitions[p].assignments;
+			for (int i = 0; i < assignments->size; i++) {
+				(*assignments)[i].value = tuple_interner.intern((*assignments)[i].value);
+			}
+		}
+		pthread_mutex_unlock(&tuple_interner.mutex);
+	}
+	// Drops every assignment published this frame
+	void discard()
+	{
+		for (int p = 0; p < VARIABLE_PARTITIONS; p++) {
+			List<Pending_Assignment> * assignments = &partitions[p].assignments;
+			for (int i = 0; i < assignments->size; i++) {
+				(*assignments)[i].value.release();
+			}
+			assignments->clear();
+		}
+		next_frame();
+	}
+	void next_frame()
+	{
+		generation++;
+		count = 0;
+		conflict = NULL;
+	}
+};
+
+struct Commit_Worker {
+	Assignment_Table * table;
+	Variable_Version * version;
+	size_t first;
+	size_t stride;
+};
+
+static void * apply_partitions(void * arg)
+{
+	Commit_Worker * worker = (Commit_Worker*) arg;
+	for (size_t p = worker->first; p < VARIABLE_PARTITIONS; p += worker->stride) {
+		worker->table->apply_partition(worker->version, p);
+	}
+	return NULL;
+}
+
+// Builds the version that follows base from every assignment published
+// this frame. Takes over the caller's reference to base, so partitions
+// only base could see are reused rather than copied.
+Variable_Version * commit_assignments(Assignment_Table * table, Variable_Version * base,
+									  size_t thread_count)
+{
+	Memory_Scope scope(MEM_VARIABLES);
+	Variable_Version * version = Variable_Version::make(base);
+	base->release();
+	if (options.intern_tuples) table->intern_values();
+	if (table->count < PARALLEL_COMMIT_THRESHOLD || thread_count < 2) {
+		for (size_t p = 0; p < VARIABLE_PARTITIONS; p++) {
+			table->apply_partition(version, p);
+		}
+	} else {
+		if (thread_count > VARIABLE_PARTITIONS) thread_count = VARIABLE_PARTITIONS;
+		pthread_t * threads = (pthread_t*) mem_alloc(sizeof(pthread_t) * thread_count);
+		Commit_Worker * workers = (Commit_Worker*) mem_alloc(sizeof(Commit_Worker) * thread_count);
+		for (size_t i = 0; i < thread_count; i++) {
+			workers[i] = (Commit_Worker) { table, version, i, thread_count };
+			pthread_create(&threads[i], NULL, apply_partitions, &workers[i]);
+			if (options.pin) cpu_placement.pin(threads[i], i);
+		}
+		for (size_t i = 0; i < thread_count; i++) {
+			pthread_join(threads[i], NULL);
+		}
+		mem_free(threads);
+		mem_free(workers);
+	}
+	table->next_frame();
+	__atomic_add_fetch(&stats.versions, 1, __ATOMIC_RELAXED);
+	return version;
+}
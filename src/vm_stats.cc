@@ -0,0 +1,199 @@
+// VM statistics
+//
+// Built only with -DSYNC_VM_STATS (make vm-stats), since counting every
+// dispatch slows the VM down. With --vm-stats, the stack VM counts how
+// often each command and each command/operator combination runs, which
+// commands follow one another, how deep the stack gets and how often it
+// has to grow, and how many commands each job runs. The register VM is
+// not counted.
+//
+// Counters belong to the same thread slots as the profiler's, each on
+// cache lines of its own, so workers never write to shared counters.
+// They are summed when the report is printed at exit.
+
+#ifdef SYNC_VM_STATS
+
+#define BINARY_OP_COUNT 4
+// Jobs are bucketed by commands run: 1, 2-3, 4-7, ...
+#define JOB_SIZE_BUCKETS 16
+
+struct alignas(64) Vm_Counters {
+	size_t commands[CMD_COUNT];
+	size_t operators[CMD_COUNT][BINARY_OP_COUNT];
+	size_t pairs[CMD_COUNT][CMD_COUNT];
+	size_t jobs;
+	size_t job_sizes[JOB_SIZE_BUCKETS];
+	size_t depth_total;
+	size_t depth_max;
+	size_t resizes;
+	// State of the job being run
+	int previous;
+	size_t capacity;
+};
+
+struct Vm_Stats {
+	bool enabled = false;
+	size_t slot_count;
+	Vm_Counters * slots;
+	void init(size_t workers)
+	{
+		enabled = true;
+		slot_count = workers + 2;
+		slots = (Vm_Counters*) aligned_alloc(64, sizeof(Vm_Counters) * slot_count);
+		memset(slots, 0, sizeof(Vm_Counters) * slot_count);
+	}
+	void begin_job(size_t command_count, size_t capacity)
+	{
+		if (!enabled) return;
+		Vm_Counters * counters = &slots[profile_slot];
+		counters->jobs++;
+		size_t bucket = 0;
+		while (bucket < JOB_SIZE_BUCKETS - 1 && (2ull << bucket) <= command_count) bucket++;
+		counters->job_sizes[bucket]++;
+		counters->previous = -1;
+		counters->capacity = capacity;
+	}
+	// Called before each command runs, with the stack as it stands
+	void dispatch(Command * cmd, size_t depth, size_t capacity)
+	{
+		if (!enabled) return;
+		Vm_Counters * counters = &slots[profile_slot];
+		counters->commands[cmd->type]++;
+		int op = command_operator(cmd);
+		if (op >= 0) counters->operators[cmd->type][op]++;
+		if (counters->previous >= 0) counters->pairs[counters->previous][cmd->type]++;
+		counters->previous = cmd->type;
+		counters->depth_total += depth;
+		if (depth > counters->depth_max) counters->depth_max = depth;
+		if (capacity != counters->capacity) {
+			counters->resizes++;
+			counters->capacity = capacity;
+		}
+	}
+	static int command_operator(Command * cmd)
+	{
+		switch (cmd->type) {
+		case CMD_BINARY_OP:
+		case CMD_INT_ADD:
+		case CMD_INT_SUBTRACT:
+		case CMD_INT_MULTIPLY:
+		case CMD_INT_DIVIDE:
+			return cmd->binary_op.op;
+		case CMD_INT_OP_CONST:
+			return cmd->int_op_const.op;
+		case CMD_INT_OP_VAR:
+			return cmd->int_op_var.op;
+		case CMD_INT_VAR_OP_VAR:
+			return cmd->int_var_op_var.op;
+		default:
+			return -1;
+		}
+	}
+	void report();
+};
+
+struct Vm_Stats_Row {
+	size_t count;
+	const char * first;
+	const char * second;
+};
+
+static int compare_rows(const void * a, const void * b)
+{
+	size_t left = ((Vm_Stats_Row*) a)->count;
+	size_t right = ((Vm_Stats_Row*) b)->count;
+	return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void print_rows(const char * title, List<Vm_Stats_Row> * rows, size_t total, int limit)
+{
+	qsort(rows->arr, rows->size, sizeof(Vm_Stats_Row), compare_rows);
+	fprintf(stderr, "%s\n", title);
+	for (int i = 0; i < rows->size && i < limit; i++) {
+		Vm_Stats_Row * row = &(*rows)[i];
+		char name[64];
+		snprintf(name, sizeof(name), "%s%s%s", row->first,
+				 row->second ? " " : "", row->second ? row->second : "");
+		fprintf(stderr, "  %-32s %12zu  %5.1f%%\n", name, row->count,
+				total ? 100.0 * row->count / total : 0.0);
+	}
+}
+
+void Vm_Stats::report()
+{
+	Vm_Counters sum;
+	memset(&sum, 0, sizeof(sum));
+	for (size_t slot = 0; slot < slot_count; slot++) {
+		Vm_Counters * counters = &slots[slot];
+		for (int type = 0; type < CMD_COUNT; type++) {
+			sum.commands[type] += counters->commands[type];
+			for (int op = 0; op < BINARY_OP_COUNT; op++) {
+				sum.operators[type][op] += counters->operators[type][op];
+			}
+			for (int next = 0; next < CMD_COUNT; next++) {
+				sum.pairs[type][next] += counters->pairs[type][next];
+			}
+		}
+		sum.jobs += counters->jobs;
+		for (int bucket = 0; bucket < JOB_SIZE_BUCKETS; bucket++) {
+			sum.job_sizes[bucket] += counters->job_sizes[bucket];
+		}
+		sum.depth_total += counters->depth_total;
+		if (counters->depth_max > sum.depth_max) sum.depth_max = counters->depth_max;
+		sum.resizes += counters->resizes;
+	}
+
+	size_t dispatches = 0;
+	for (int type = 0; type < CMD_COUNT; type++) {
+		dispatches += sum.commands[type];
+	}
+	fprintf(stderr, "vm stats: %zu commands in %zu jobs (%.1f per job)\n",
+			dispatches, sum.jobs, sum.jobs ? (double) dispatches / sum.jobs : 0.0);
+	fprintf(stderr, "  stack depth %.2f on average, %zu at most; %zu stack resizes\n",
+			dispatches ? (double) sum.depth_total / dispatches : 0.0, sum.depth_max, sum.resizes);
+
+	List<Vm_Stats_Row> rows;
+	rows.alloc();
+	for (int type = 0; type < CMD_COUNT; type++) {
+		if (sum.commands[type] == 0) continue;
+		rows.push((Vm_Stats_Row) { sum.commands[type], command_type_name((Command_Type) type), NULL });
+	}
+	print_rows("commands:", &rows, dispatches, CMD_COUNT);
+
+	rows.clear();
+	for (int type = 0; type < CMD_COUNT; type++) {
+		for (int op = 0; op < BINARY_OP_COUNT; op++) {
+			if (sum.operators[type][op] == 0) continue;
+			rows.push((Vm_Stats_Row) { sum.operators[type][op],
+									   command_type_name((Command_Type) type),
+									   binary_op_name((Binary_Op) op) });
+		}
+	}
+	print_rows("commands by operator:", &rows, dispatches, 20);
+
+	rows.clear();
+	size_t pair_total = 0;
+	for (int first = 0; first < CMD_COUNT; first++) {
+		for (int second = 0; second < CMD_COUNT; second++) {
+			size_t count = sum.pairs[first][second];
+			if (count == 0) continue;
+			pair_total += count;
+			rows.push((Vm_Stats_Row) { count, command_type_name((Command_Type) first),
+									   command_type_name((Command_Type) second) });
+		}
+	}
+	print_rows("most frequent command pairs:", &rows, pair_total, 20);
+	rows.dealloc();
+
+	fprintf(stderr, "commands per job:\n");
+	for (int bucket = 0; bucket < JOB_SIZE_BUCKETS; bucket++) {
+		if (sum.job_sizes[bucket] == 0) continue;
+		size_t low = 1ull << bucket;
+		fprintf(stderr, "  %6zu-%-6zu %12zu  %5.1f%%\n", low, (low << 1) - 1,
+				sum.job_sizes[bucket], 100.0 * sum.job_sizes[bucket] / sum.jobs);
+	}
+}
+
+Vm_Stats vm_stats;
+
+#endif
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Regression tests, run by make test. Runs every script in tests/ on
+# each VM and compares what it prints with the .out file next to it.
+# Options in a .flags file next to a script are passed when running it.
+# With UPDATE=1, rewrites the .out files from the stack VM instead.
+
+SYNC=${SYNC:-./sync}
+DIR=$(dirname "$0")
+VMS=${VMS:-stack register}
+
+fail=0
+for script in "$DIR"/*.sync; do
+	expected=${script%.sync}.out
+	flags=
+	[ -f "${script%.sync}.flags" ] && flags=$(cat "${script%.sync}.flags")
+	if [ -n "$UPDATE" ]; then
+		"$SYNC" $flags --vm=stack "$script" > "$expected"
+		continue
+	fi
+	for vm in $VMS; do
+		if ! "$SYNC" $flags --vm=$vm "$script" | diff -u "$expected" - > /dev/null; then
+			echo "FAIL $(basename "$script") $flags --vm=$vm"
+			"$SYNC" $flags --vm=$vm "$script" | diff -u "$expected" -
+			fail=1
+		fi
+	done
+done
+[ $fail = 0 ] && echo "all tests passed"
+exit $fail